@@ -0,0 +1,219 @@
+/******************************************************************************
+ *
+ * Epson TM-T88V Printer Driver for GNU/Linux
+ *
+ * Copyright (C) 2020 Grégory DAVID.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *****************************************************************************/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "tmt88v.h"
+
+/*----------------
+ * MACRO (#define)
+ *----------------*/
+#define EPTMD_BENCH_JOBS (200) // Jobs per thread and raster file.
+
+/*--------------------------------
+ * Structure prototype declaration
+ *--------------------------------*/
+typedef struct
+{
+  EPTMS_ENCODER_T *p_encoder;
+  const std::vector<unsigned char> *p_raster;
+  unsigned jobs;
+  tm_result_t result; // First error of the thread.
+  std::vector<unsigned char> output; // Commands of the last job.
+} EPTMS_BENCH_WORKER_T; // Encoder of one thread
+
+/*--------------------------------------
+ * Static function prototype declaration
+ *--------------------------------------*/
+static bool ReadFile(const char *, std::vector<unsigned char> *);
+static void RunWorker(EPTMS_BENCH_WORKER_T *);
+static double GetMonotonicTime(void);
+
+// Encodes each raster file in memory with one encoder per thread, without
+// starting the filter, and checks that all threads produce the same commands.
+int main(int argc, char *argv[])
+{
+  unsigned threads = 1;
+  unsigned jobs = EPTMD_BENCH_JOBS;
+  int option;
+
+  while(-1 != (option = getopt(argc, argv, "t:n:")))
+  {
+    switch(option)
+    {
+      case 't':
+        threads = static_cast<unsigned>(atoi(optarg));
+        break;
+
+      case 'n':
+        jobs = static_cast<unsigned>(atoi(optarg));
+        break;
+
+      default:
+        threads = 0;
+        break;
+    }
+  }
+
+  if((0 == threads) || (0 == jobs) || ((optind + 3) > argc))
+  {
+    fprintf(stderr, "Usage: %s [-t threads] [-n jobs] ppd options raster...\n", argv[0]);
+    return 1;
+  }
+
+  const char *p_ppd = argv[optind];
+  const char *p_options = argv[optind + 1];
+  FILE *p_log = fopen("/dev/null", "w");
+  std::vector<EPTMS_BENCH_WORKER_T> workers(threads);
+  int result = 0;
+
+  for(EPTMS_BENCH_WORKER_T &worker : workers)
+  {
+    worker.p_encoder = TmCreateEncoder("encoderbench");
+
+    if((nullptr == worker.p_encoder) || (nullptr == p_log))
+    {
+      fprintf(stderr, "%s: cannot create the encoders\n", argv[0]);
+      return 1;
+    }
+
+    TmSetEncoderLog(worker.p_encoder, p_log);
+    TmSetEncoderOutputMemory(worker.p_encoder);
+
+    if(TM_SUCCESS != TmLoadEncoderConfig(worker.p_encoder, p_ppd, p_options))
+    {
+      fprintf(stderr, "%s: cannot load %s\n", argv[0], p_ppd);
+      return 1;
+    }
+  }
+
+  printf("%-16s %7s %7s %9s %9s %9s\n", "raster", "threads", "jobs", "time ms", "jobs/s", "MB/s");
+
+  for(int i = optind + 2; i < argc; i++)
+  {
+    std::vector<unsigned char> raster;
+
+    if(!ReadFile(argv[i], &raster))
+    {
+      fprintf(stderr, "%s: cannot read %s\n", argv[0], argv[i]);
+      result = 1;
+      continue;
+    }
+
+    std::vector<std::thread> running;
+    double start_time = GetMonotonicTime();
+
+    for(EPTMS_BENCH_WORKER_T &worker : workers)
+    {
+      worker.p_raster = &raster;
+      worker.jobs = jobs;
+      worker.result = TM_SUCCESS;
+      running.emplace_back(RunWorker, &worker);
+    }
+
+    for(std::thread &thread : running)
+    {
+      thread.join();
+    }
+
+    double time = GetMonotonicTime() - start_time;
+    std::string name = argv[i];
+    name = name.substr(name.find_last_of('/') + 1);
+    bool same = true;
+
+    for(EPTMS_BENCH_WORKER_T &worker : workers)
+    {
+      if(TM_SUCCESS != worker.result)
+      {
+        fprintf(stderr, "%s: %s failed with error %u\n", argv[0], argv[i], worker.result);
+        result = 1;
+      }
+
+      same = same && (worker.output == workers[0].output);
+    }
+
+    if(!same)
+    {
+      fprintf(stderr, "%s: %s encoded differently by the threads\n", argv[0], argv[i]);
+      result = 1;
+    }
+
+    double total = static_cast<double>(threads) * jobs;
+    printf("%-16s %7u %7u %9.1f %9.0f %9.1f\n", name.c_str(), threads, jobs, time * 1000.0,
+           total / time, (total * static_cast<double>(raster.size())) / (time * 1e6));
+  }
+
+  for(EPTMS_BENCH_WORKER_T &worker : workers)
+  {
+    TmDeleteEncoder(worker.p_encoder);
+  }
+
+  fclose(p_log);
+  return result;
+}
+
+static bool ReadFile(const char *p_path, std::vector<unsigned char> *p_data)
+{
+  FILE *p_file = fopen(p_path, "rb");
+
+  if(nullptr == p_file)
+  {
+    return false;
+  }
+
+  unsigned char buffer[64 * 1024];
+  std::size_t size;
+
+  while(0 < (size = fread(buffer, 1, sizeof(buffer), p_file)))
+  {
+    p_data->insert(p_data->end(), buffer, buffer + size);
+  }
+
+  bool read = (0 == ferror(p_file));
+  fclose(p_file);
+  return read;
+}
+
+static void RunWorker(EPTMS_BENCH_WORKER_T *p_worker)
+{
+  for(unsigned job = 0; (job < p_worker->jobs) && (TM_SUCCESS == p_worker->result); job++)
+  {
+    p_worker->result = TmEncodeRasterMemory(p_worker->p_encoder, p_worker->p_raster->data(), p_worker->p_raster->size());
+  }
+
+  std::size_t size = 0;
+  const unsigned char *p_output = TmGetEncoderOutput(p_worker->p_encoder, &size);
+  p_worker->output.assign(p_output, p_output + size);
+}
+
+static double GetMonotonicTime(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<double>(now.tv_sec) + (static_cast<double>(now.tv_nsec) / 1e9);
+}
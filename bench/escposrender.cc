@@ -0,0 +1,916 @@
+/******************************************************************************
+ *
+ * Epson TM-T88V Printer Driver for GNU/Linux
+ *
+ * Copyright (C) 2020 Grégory DAVID.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *****************************************************************************/
+#include <cups/raster.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "rasterkernel.h"
+
+/*----------------
+ * MACRO (#define)
+ *----------------*/
+#define ESC (0x1b)
+#define GS (0x1d)
+#define EPTMD_RENDER_DPI (180) // Resolution of the TM-T88V.
+#define EPTMD_BITS_TO_BYTES(bits) (((bits) + 7) / 8)
+
+/*-----------------
+ * enum declaration
+ *-----------------*/
+typedef enum
+{
+  TmCommandSelectDevice = 0, // ESC =
+  TmCommandInitialize, // ESC @
+  TmCommandPaperSensor, // ESC c
+  TmCommandDrawer, // ESC p
+  TmCommandBuzzer, // ESC ( A
+  TmCommandPosition, // ESC $
+  TmCommandFeed, // ESC J
+  TmCommandMotionUnit, // GS P
+  TmCommandStoreGraphics, // GS 8 L fn 112
+  TmCommandPrintGraphics, // GS ( L fn 50
+  TmCommandDefineNVGraphics, // GS ( L fn 67
+  TmCommandPrintNVGraphics, // GS ( L fn 69
+  TmCommandDeleteNVGraphics, // GS ( L fn 66
+  TmCommandNVGraphicsKeys, // GS ( L fn 64
+  TmCommandCut, // GS V
+  TmCommandStatusBack, // GS a
+  TmCommandCount,
+} EPTME_COMMAND; // Decoded ESC/POS commands
+
+typedef enum
+{
+  TmReductionOff = 0,
+  TmReductionTop,
+  TmReductionBottom,
+  TmReductionBoth,
+} EPTME_REDUCTION; // TmxPaperReduction of the filter run
+
+typedef enum
+{
+  TmDitherOrdered = 0,
+  TmDitherDiffusion,
+} EPTME_DITHER; // TmxDithering of the filter run, for 8 bit gray rasters
+
+/*--------------------------------
+ * Structure prototype declaration
+ *--------------------------------*/
+typedef struct
+{
+  unsigned width; // Dots per line.
+  unsigned height; // Lines.
+  std::vector<unsigned char> data; // Packed lines, MSB first.
+} EPTMS_GRAPHICS_T; // Graphics stored in the printer
+
+typedef struct
+{
+  unsigned width; // Widest line in dots.
+  std::vector<std::vector<unsigned char>> rows; // Lines from dot 0, packed MSB first.
+} EPTMS_IMAGE_T; // Bitmap of the paper
+
+typedef struct
+{
+  EPTMS_IMAGE_T image; // Printed paper.
+  unsigned x; // Print position in dots.
+  unsigned dpi; // Dots per inch of the head.
+  unsigned h_motionUnit; // Horizontal motion unit of ESC $.
+  unsigned v_motionUnit; // Vertical motion unit of ESC J.
+  EPTMS_GRAPHICS_T buffer; // Graphics stored by GS 8 L.
+  std::map<std::string, EPTMS_GRAPHICS_T> nvGraphics; // Graphics defined by GS ( L fn 67.
+  std::vector<size_t> cuts; // Line of each GS V.
+  unsigned long count[TmCommandCount]; // Commands per type.
+  unsigned long long bytes[TmCommandCount]; // Command bytes per type, payload included.
+  unsigned long long payload[TmCommandCount]; // Graphics bytes per type.
+} EPTMS_RENDER_T; // Printer state of the decoder
+
+/*--------------------------------------
+ * Static function prototype declaration
+ *--------------------------------------*/
+static void InitRender(EPTMS_RENDER_T *, unsigned);
+static bool ReadFile(const char *, std::vector<unsigned char> *);
+static bool DecodeStream(const char *, const std::vector<unsigned char> &, EPTMS_RENDER_T *);
+static size_t DecodeCommand(const unsigned char *, size_t, EPTMS_RENDER_T *, EPTME_COMMAND *, size_t *);
+static size_t DecodeGraphicsCommand(const unsigned char *, size_t, EPTMS_RENDER_T *, EPTME_COMMAND *, size_t *);
+static void PrintGraphics(EPTMS_RENDER_T *, const EPTMS_GRAPHICS_T *);
+static void Feed(EPTMS_RENDER_T *, unsigned);
+static bool ReadExpectedImage(const char *, EPTME_REDUCTION, EPTME_DITHER, bool, EPTMS_IMAGE_T *, unsigned *);
+static void AppendExpectedLines(const cups_page_header2_t *, EPTME_REDUCTION, std::vector<unsigned char> *, EPTMS_IMAGE_T *);
+static bool DitherPage(const cups_page_header2_t *, EPTME_DITHER, std::vector<unsigned char> *);
+static bool CompareImages(const EPTMS_IMAGE_T *, const EPTMS_IMAGE_T *, const char *);
+static bool WritePbm(const char *, const EPTMS_IMAGE_T *);
+static void PrintReport(const EPTMS_RENDER_T *);
+
+static const char *g_TmCommandNames[TmCommandCount] =
+{
+  "ESC =", "ESC @", "ESC c", "ESC p", "ESC ( A", "ESC $", "ESC J", "GS P",
+  "GS 8 L fn 112", "GS ( L fn 50", "GS ( L fn 67", "GS ( L fn 69",
+  "GS ( L fn 66", "GS ( L fn 64", "GS V",
+  "GS a",
+};
+
+int main(int argc, char *argv[])
+{
+  const char *p_pbm = nullptr;
+  const char *p_raster = nullptr;
+  std::vector<const char *> nvStreams;
+  EPTME_REDUCTION reduction = TmReductionBoth;
+  EPTME_DITHER dither = TmDitherOrdered;
+  bool continuous = false;
+  bool quiet = false;
+  int option;
+
+  while(-1 != (option = getopt(argc, argv, "cd:n:o:qr:t:")))
+  {
+    switch(option)
+    {
+    case 'c':
+      continuous = true;
+      break;
+
+    case 'd':
+      if(0 == strcmp(optarg, "Ordered"))
+      {
+        dither = TmDitherOrdered;
+      }
+      else if(0 == strcmp(optarg, "Diffusion"))
+      {
+        dither = TmDitherDiffusion;
+      }
+      else
+      {
+        optind = argc;
+      }
+
+      break;
+
+    case 'n':
+      nvStreams.push_back(optarg);
+      break;
+
+    case 'o':
+      p_pbm = optarg;
+      break;
+
+    case 'q':
+      quiet = true;
+      break;
+
+    case 'r':
+      p_raster = optarg;
+      break;
+
+    case 't':
+      if(0 == strcmp(optarg, "Off"))
+      {
+        reduction = TmReductionOff;
+      }
+      else if(0 == strcmp(optarg, "Top"))
+      {
+        reduction = TmReductionTop;
+      }
+      else if(0 == strcmp(optarg, "Bottom"))
+      {
+        reduction = TmReductionBottom;
+      }
+      else if(0 == strcmp(optarg, "Both"))
+      {
+        reduction = TmReductionBoth;
+      }
+      else
+      {
+        optind = argc;
+      }
+
+      break;
+
+    default:
+      optind = argc;
+      break;
+    }
+  }
+
+  if((optind + 1) != argc)
+  {
+    fprintf(stderr, "Usage: %s [-q] [-o image.pbm] [-r raster [-t Off|Top|Bottom|Both] [-d Ordered|Diffusion] [-c]] [-n earlier-output]... output\n", argv[0]);
+    return 1;
+  }
+
+  EPTMS_IMAGE_T expected;
+  unsigned dpi = EPTMD_RENDER_DPI;
+
+  if((nullptr != p_raster) && !ReadExpectedImage(p_raster, reduction, dither, continuous, &expected, &dpi))
+  {
+    fprintf(stderr, "%s: cannot read raster %s\n", argv[0], p_raster);
+    return 1;
+  }
+
+  // NV graphics persist in the printer, the outputs of earlier jobs define
+  // the keys printed by this one.
+  EPTMS_RENDER_T render;
+  InitRender(&render, dpi);
+
+  for(const char *p_stream : nvStreams)
+  {
+    EPTMS_RENDER_T earlier;
+    std::vector<unsigned char> stream;
+    InitRender(&earlier, dpi);
+    earlier.nvGraphics = render.nvGraphics;
+
+    if(!ReadFile(p_stream, &stream) || !DecodeStream(p_stream, stream, &earlier))
+    {
+      return 1;
+    }
+
+    render.nvGraphics = earlier.nvGraphics;
+  }
+
+  std::vector<unsigned char> stream;
+
+  if(!ReadFile(argv[optind], &stream) || !DecodeStream(argv[optind], stream, &render))
+  {
+    return 1;
+  }
+
+  if(!quiet)
+  {
+    PrintReport(&render);
+  }
+
+  if((nullptr != p_pbm) && !WritePbm(p_pbm, &render.image))
+  {
+    fprintf(stderr, "%s: cannot write %s\n", argv[0], p_pbm);
+    return 1;
+  }
+
+  if((nullptr != p_raster) && !CompareImages(&render.image, &expected, p_raster))
+  {
+    return 1;
+  }
+
+  return 0;
+}
+
+static void InitRender(EPTMS_RENDER_T *p_render, unsigned dpi)
+{
+  p_render->image.width = 0;
+  p_render->image.rows.clear();
+  p_render->x = 0;
+  p_render->dpi = dpi;
+  p_render->h_motionUnit = dpi;
+  p_render->v_motionUnit = dpi;
+  p_render->buffer.width = 0;
+  p_render->buffer.height = 0;
+  p_render->buffer.data.clear();
+  p_render->nvGraphics.clear();
+  p_render->cuts.clear();
+  memset(p_render->count, 0, sizeof(p_render->count));
+  memset(p_render->bytes, 0, sizeof(p_render->bytes));
+  memset(p_render->payload, 0, sizeof(p_render->payload));
+}
+
+static bool ReadFile(const char *p_path, std::vector<unsigned char> *p_data)
+{
+  FILE *p_file = fopen(p_path, "rb");
+
+  if(nullptr == p_file)
+  {
+    fprintf(stderr, "cannot open %s\n", p_path);
+    return false;
+  }
+
+  unsigned char buffer[64 * 1024];
+  size_t length;
+  p_data->clear();
+
+  while(0 < (length = fread(buffer, 1, sizeof(buffer), p_file)))
+  {
+    p_data->insert(p_data->end(), buffer, buffer + length);
+  }
+
+  bool read = (0 == ferror(p_file));
+  fclose(p_file);
+  return read;
+}
+
+static bool DecodeStream(const char *p_name, const std::vector<unsigned char> &stream, EPTMS_RENDER_T *p_render)
+{
+  size_t offset = 0;
+
+  while(offset < stream.size())
+  {
+    EPTME_COMMAND command = TmCommandCount;
+    size_t payload = 0;
+    size_t length = DecodeCommand(&stream[offset], stream.size() - offset, p_render, &command, &payload);
+
+    if(0 == length)
+    {
+      fprintf(stderr, "%s: cannot decode 0x%02x 0x%02x at offset %zu\n", p_name, stream[offset],
+              ((offset + 1) < stream.size()) ? stream[offset + 1] : 0, offset);
+      return false;
+    }
+
+    p_render->count[command]++;
+    p_render->bytes[command] += length;
+    p_render->payload[command] += payload;
+    offset += length;
+  }
+
+  return true;
+}
+
+// Returns the length of the command at p_data, 0 if it is unknown or truncated.
+static size_t DecodeCommand(const unsigned char *p_data, size_t available, EPTMS_RENDER_T *p_render, EPTME_COMMAND *p_command, size_t *p_payload)
+{
+  if(2 > available)
+  {
+    return 0;
+  }
+
+  if(GS == p_data[0])
+  {
+    switch(p_data[1])
+    {
+    case 'P':
+      if(4 > available)
+      {
+        return 0;
+      }
+
+      // 0 selects the default unit.
+      p_render->h_motionUnit = (0 != p_data[2]) ? p_data[2] : p_render->dpi;
+      p_render->v_motionUnit = (0 != p_data[3]) ? p_data[3] : p_render->dpi;
+      *p_command = TmCommandMotionUnit;
+      return 4;
+
+    case 'V':
+      if(3 > available)
+      {
+        return 0;
+      }
+
+      *p_command = TmCommandCut;
+      p_render->cuts.push_back(p_render->image.rows.size());
+
+      if((0 == p_data[2]) || (1 == p_data[2]) || ('0' == p_data[2]) || ('1' == p_data[2]))
+      {
+        return 3;
+      }
+
+      if((65 == p_data[2]) || (66 == p_data[2]) || (103 == p_data[2]) || (104 == p_data[2]))
+      {
+        return (4 > available) ? 0 : 4;
+      }
+
+      return 0;
+
+    case 'a':
+      *p_command = TmCommandStatusBack;
+      return (3 > available) ? 0 : 3;
+
+    case '8':
+    case '(':
+      return DecodeGraphicsCommand(p_data, available, p_render, p_command, p_payload);
+
+    default:
+      return 0;
+    }
+  }
+
+  if(ESC != p_data[0])
+  {
+    return 0;
+  }
+
+  switch(p_data[1])
+  {
+  case '=':
+    *p_command = TmCommandSelectDevice;
+    return (3 > available) ? 0 : 3;
+
+  case '@':
+    *p_command = TmCommandInitialize;
+    return 2;
+
+  case 'c':
+    *p_command = TmCommandPaperSensor;
+    return (4 > available) ? 0 : 4;
+
+  case 'p':
+    *p_command = TmCommandDrawer;
+    return (5 > available) ? 0 : 5;
+
+  case '(':
+    if((5 > available) || ('A' != p_data[2]))
+    {
+      return 0;
+    }
+    else
+    {
+      size_t length = 5 + p_data[3] + ((size_t)p_data[4] << 8);
+      *p_command = TmCommandBuzzer;
+      return (length > available) ? 0 : length;
+    }
+
+  case '$':
+    if(4 > available)
+    {
+      return 0;
+    }
+
+    p_render->x = (unsigned)(((p_data[2] + ((unsigned)p_data[3] << 8)) * p_render->dpi) / p_render->h_motionUnit);
+    *p_command = TmCommandPosition;
+    return 4;
+
+  case 'J':
+    if(3 > available)
+    {
+      return 0;
+    }
+
+    Feed(p_render, p_data[2]);
+    *p_command = TmCommandFeed;
+    return 3;
+
+  default:
+    return 0;
+  }
+}
+
+// GS 8 L and GS ( L, only the 1 bit raster graphics functions of the filter.
+static size_t DecodeGraphicsCommand(const unsigned char *p_data, size_t available, EPTMS_RENDER_T *p_render, EPTME_COMMAND *p_command, size_t *p_payload)
+{
+  size_t header;
+  size_t parameters;
+
+  if('8' == p_data[1])
+  {
+    if((7 > available) || ('L' != p_data[2]))
+    {
+      return 0;
+    }
+
+    header = 7;
+    parameters = p_data[3] + ((size_t)p_data[4] << 8) + ((size_t)p_data[5] << 16) + ((size_t)p_data[6] << 24);
+  }
+  else
+  {
+    if((5 > available) || ('L' != p_data[2]))
+    {
+      return 0;
+    }
+
+    header = 5;
+    parameters = p_data[3] + ((size_t)p_data[4] << 8);
+  }
+
+  if((2 > parameters) || ((header + parameters) > available) || (48 != p_data[header]))
+  {
+    return 0;
+  }
+
+  const unsigned char *p_parameter = &p_data[header];
+  unsigned char function = p_parameter[1];
+
+  if(('8' == p_data[1]) && (112 == function))
+  {
+    // a = monochrome, bx = by = 1, c = color 1.
+    if((10 > parameters) || (48 != p_parameter[2]) || (1 != p_parameter[3]) || (1 != p_parameter[4]) || (49 != p_parameter[5]))
+    {
+      return 0;
+    }
+
+    EPTMS_GRAPHICS_T *p_buffer = &p_render->buffer;
+    p_buffer->width = p_parameter[6] + ((unsigned)p_parameter[7] << 8);
+    p_buffer->height = p_parameter[8] + ((unsigned)p_parameter[9] << 8);
+
+    if(((size_t)EPTMD_BITS_TO_BYTES(p_buffer->width) * p_buffer->height) != (parameters - 10))
+    {
+      return 0;
+    }
+
+    p_buffer->data.assign(&p_parameter[10], &p_parameter[parameters]);
+    *p_command = TmCommandStoreGraphics;
+    *p_payload = parameters - 10;
+  }
+  else if(('(' == p_data[1]) && (50 == function))
+  {
+    PrintGraphics(p_render, &p_render->buffer);
+    *p_command = TmCommandPrintGraphics;
+  }
+  else if(('(' == p_data[1]) && (67 == function))
+  {
+    // a = define raster, kc1 kc2, b = 1 color, xL xH yL yH, c = color 1.
+    if((11 > parameters) || (48 != p_parameter[2]) || (1 != p_parameter[5]) || (49 != p_parameter[10]))
+    {
+      return 0;
+    }
+
+    EPTMS_GRAPHICS_T graphics;
+    graphics.width = p_parameter[6] + ((unsigned)p_parameter[7] << 8);
+    graphics.height = p_parameter[8] + ((unsigned)p_parameter[9] << 8);
+
+    if(((size_t)EPTMD_BITS_TO_BYTES(graphics.width) * graphics.height) != (parameters - 11))
+    {
+      return 0;
+    }
+
+    graphics.data.assign(&p_parameter[11], &p_parameter[parameters]);
+    p_render->nvGraphics[std::string((const char *)&p_parameter[3], 2)] = graphics;
+    *p_command = TmCommandDefineNVGraphics;
+    *p_payload = parameters - 11;
+  }
+  else if(('(' == p_data[1]) && (69 == function))
+  {
+    // kc1 kc2, x = y = 1.
+    if((6 != parameters) || (1 != p_parameter[4]) || (1 != p_parameter[5]))
+    {
+      return 0;
+    }
+
+    auto entry = p_render->nvGraphics.find(std::string((const char *)&p_parameter[2], 2));
+
+    if(p_render->nvGraphics.end() == entry)
+    {
+      fprintf(stderr, "NV graphics %c%c is not defined, pass the output defining it with -n\n", p_parameter[2], p_parameter[3]);
+      return 0;
+    }
+
+    PrintGraphics(p_render, &entry->second);
+    *p_command = TmCommandPrintNVGraphics;
+  }
+  else if(('(' == p_data[1]) && (66 == function))
+  {
+    // kc1 kc2, deleting an undefined key does nothing.
+    if(4 != parameters)
+    {
+      return 0;
+    }
+
+    p_render->nvGraphics.erase(std::string((const char *)&p_parameter[2], 2));
+    *p_command = TmCommandDeleteNVGraphics;
+  }
+  else if(('(' == p_data[1]) && (64 == function))
+  {
+    // d1 d2 = "KC", answered through the back-channel.
+    if((4 != parameters) || ('K' != p_parameter[2]) || ('C' != p_parameter[3]))
+    {
+      return 0;
+    }
+
+    *p_command = TmCommandNVGraphicsKeys;
+  }
+  else
+  {
+    return 0;
+  }
+
+  return header + parameters;
+}
+
+// Prints the graphics at the print position, the paper moves by its height.
+static void PrintGraphics(EPTMS_RENDER_T *p_render, const EPTMS_GRAPHICS_T *p_graphics)
+{
+  EPTMS_IMAGE_T *p_image = &p_render->image;
+  unsigned BytesPerLine = EPTMD_BITS_TO_BYTES(p_graphics->width);
+  unsigned right = p_render->x + p_graphics->width;
+  size_t top = p_image->rows.size();
+
+  if(right > p_image->width)
+  {
+    p_image->width = right;
+  }
+
+  p_image->rows.resize(top + p_graphics->height);
+
+  for(unsigned y = 0; y < p_graphics->height; y++)
+  {
+    std::vector<unsigned char> &row = p_image->rows[top + y];
+    const unsigned char *p_line = &p_graphics->data[(size_t)y * BytesPerLine];
+    row.assign(EPTMD_BITS_TO_BYTES(right), 0);
+
+    for(unsigned x = 0; x < p_graphics->width; x++)
+    {
+      if(0 != (p_line[x / 8] & (0x80 >> (x % 8))))
+      {
+        unsigned dot = p_render->x + x;
+        row[dot / 8] = (unsigned char)(row[dot / 8] | (0x80 >> (dot % 8)));
+      }
+    }
+  }
+
+  p_render->x = 0;
+}
+
+static void Feed(EPTMS_RENDER_T *p_render, unsigned units)
+{
+  size_t lines = ((size_t)units * p_render->dpi) / p_render->v_motionUnit;
+  p_render->image.rows.resize(p_render->image.rows.size() + lines);
+  p_render->x = 0;
+}
+
+// The raster as the filter should print it: NumCopies copies of each page with
+// blank lines reduced at the edges, DLE EOT/ENQ/DC4 and ESC = broken as the
+// filter breaks them. On a continuous roll, pages of the same layout are
+// merged before the blank lines are reduced.
+static bool ReadExpectedImage(const char *p_path, EPTME_REDUCTION reduction, EPTME_DITHER dither, bool continuous,
+                              EPTMS_IMAGE_T *p_image, unsigned *p_dpi)
+{
+  int fd = open(p_path, O_RDONLY);
+
+  if(0 > fd)
+  {
+    return false;
+  }
+
+  cups_raster_t *p_raster = cupsRasterOpen(fd, CUPS_RASTER_READ);
+  cups_page_header2_t header;
+  cups_page_header2_t roll_header;
+  std::vector<unsigned char> roll; // Packed lines of the pages merged so far.
+  bool rolled = false;
+  bool read = (nullptr != p_raster);
+  p_image->width = 0;
+  p_image->rows.clear();
+
+  while(read && (0 != cupsRasterReadHeader2(p_raster, &header)))
+  {
+    if(((1 != header.cupsBitsPerPixel) && (8 != header.cupsBitsPerPixel)) || (0 == header.HWResolution[1]))
+    {
+      fprintf(stderr, "%s: only 1 bit and 8 bit gray rasters are compared\n", p_path);
+      read = false;
+      break;
+    }
+
+    std::vector<unsigned char> page((size_t)header.cupsBytesPerLine * header.cupsHeight);
+
+    if(!page.empty() && (page.size() != cupsRasterReadPixels(p_raster, page.data(), (unsigned)page.size())))
+    {
+      read = false;
+      break;
+    }
+
+    unsigned BytesPerLine = EPTMD_BITS_TO_BYTES(header.cupsWidth);
+    unsigned stride = header.cupsBytesPerLine;
+
+    if(8 == header.cupsBitsPerPixel)
+    {
+      if(!DitherPage(&header, dither, &page))
+      {
+        fprintf(stderr, "%s: only 1 bit and 8 bit gray rasters are compared\n", p_path);
+        read = false;
+        break;
+      }
+
+      stride = BytesPerLine;
+    }
+
+    bool merged = continuous && rolled && (1 >= header.NumCopies) && (1 >= roll_header.NumCopies)
+                  && (header.cupsWidth == roll_header.cupsWidth) && (header.cupsBytesPerLine == roll_header.cupsBytesPerLine)
+                  && (header.cupsBitsPerPixel == roll_header.cupsBitsPerPixel) && (header.cupsColorSpace == roll_header.cupsColorSpace)
+                  && (header.cupsRowCount == roll_header.cupsRowCount)
+                  && (header.HWResolution[0] == roll_header.HWResolution[0]) && (header.HWResolution[1] == roll_header.HWResolution[1]);
+
+    if(!merged)
+    {
+      if(rolled)
+      {
+        AppendExpectedLines(&roll_header, reduction, &roll, p_image);
+      }
+
+      roll_header = header;
+      rolled = true;
+    }
+
+    for(unsigned y = 0; y < header.cupsHeight; y++)
+    {
+      const unsigned char *p_line = &page[(size_t)y * stride];
+      roll.insert(roll.end(), p_line, p_line + BytesPerLine);
+    }
+
+    *p_dpi = header.HWResolution[1];
+  }
+
+  if(read && rolled)
+  {
+    AppendExpectedLines(&roll_header, reduction, &roll, p_image);
+  }
+
+  if(nullptr != p_raster)
+  {
+    cupsRasterClose(p_raster);
+  }
+
+  close(fd);
+  return read;
+}
+
+// Adds the packed lines of a page, or of a roll of pages, to the expected
+// image and empties them.
+static void AppendExpectedLines(const cups_page_header2_t *p_header, EPTME_REDUCTION reduction, std::vector<unsigned char> *p_lines, EPTMS_IMAGE_T *p_image)
+{
+  std::vector<unsigned char> &lines = *p_lines;
+  unsigned BytesPerLine = EPTMD_BITS_TO_BYTES(p_header->cupsWidth);
+  size_t first = 0;
+  size_t last = (0 < BytesPerLine) ? (lines.size() / BytesPerLine) : 0;
+
+  if((TmReductionTop == reduction) || (TmReductionBoth == reduction))
+  {
+    while((first < last) && IsBlankRasterLine(&lines[first * BytesPerLine], BytesPerLine))
+    {
+      first++;
+    }
+  }
+
+  if((TmReductionBottom == reduction) || (TmReductionBoth == reduction))
+  {
+    while((first < last) && IsBlankRasterLine(&lines[(last - 1) * BytesPerLine], BytesPerLine))
+    {
+      last--;
+    }
+  }
+
+  if(first < last)
+  {
+    AvoidDisturbingRasterData(&lines[first * BytesPerLine], (last - first) * BytesPerLine);
+  }
+
+  unsigned char mask = (unsigned char)(0xff << ((8 - (p_header->cupsWidth % 8)) % 8));
+  unsigned copies = (1 < p_header->NumCopies) ? p_header->NumCopies : 1;
+
+  for(unsigned copy = 0; copy < copies; copy++)
+  {
+    for(size_t y = first; y < last; y++)
+    {
+      std::vector<unsigned char> row(&lines[y * BytesPerLine], &lines[y * BytesPerLine] + BytesPerLine);
+      row.back() = (unsigned char)(row.back() & mask);
+      p_image->rows.push_back(row);
+    }
+  }
+
+  if(p_header->cupsWidth > p_image->width)
+  {
+    p_image->width = p_header->cupsWidth;
+  }
+
+  lines.clear();
+}
+
+// Converts the gray lines of a page to packed 1 bit lines as the filter does.
+static bool DitherPage(const cups_page_header2_t *p_header, EPTME_DITHER dither, std::vector<unsigned char> *p_page)
+{
+  unsigned char invert = 0;
+
+  if(CUPS_CSPACE_K == p_header->cupsColorSpace)
+  {
+    invert = 0xff;
+  }
+  else if((CUPS_CSPACE_W != p_header->cupsColorSpace) && (CUPS_CSPACE_SW != p_header->cupsColorSpace))
+  {
+    return false;
+  }
+
+  unsigned BytesPerLine = EPTMD_BITS_TO_BYTES(p_header->cupsWidth);
+  std::vector<unsigned char> lines((size_t)BytesPerLine * p_header->cupsHeight);
+  std::vector<int> errors(p_header->cupsWidth + 2, 0);
+
+  for(unsigned y = 0; y < p_header->cupsHeight; y++)
+  {
+    const unsigned char *p_gray = &(*p_page)[(size_t)y * p_header->cupsBytesPerLine];
+    unsigned char *p_line = &lines[(size_t)y * BytesPerLine];
+
+    if(TmDitherDiffusion == dither)
+    {
+      DitherDiffusionRasterLine(p_gray, p_header->cupsWidth, invert, errors.data(), p_line);
+    }
+    else
+    {
+      DitherOrderedRasterLine(p_gray, p_header->cupsWidth, y, invert, p_line);
+    }
+  }
+
+  p_page->swap(lines);
+  return true;
+}
+
+static bool CompareImages(const EPTMS_IMAGE_T *p_printed, const EPTMS_IMAGE_T *p_expected, const char *p_name)
+{
+  size_t lines = (p_printed->rows.size() > p_expected->rows.size()) ? p_printed->rows.size() : p_expected->rows.size();
+  size_t differences = 0;
+  size_t first = 0;
+
+  for(size_t y = 0; y < lines; y++)
+  {
+    static const std::vector<unsigned char> blank;
+    const std::vector<unsigned char> &printed = (y < p_printed->rows.size()) ? p_printed->rows[y] : blank;
+    const std::vector<unsigned char> &expected = (y < p_expected->rows.size()) ? p_expected->rows[y] : blank;
+    size_t length = (printed.size() > expected.size()) ? printed.size() : expected.size();
+
+    for(size_t x = 0; x < length; x++)
+    {
+      unsigned char a = (x < printed.size()) ? printed[x] : 0;
+      unsigned char b = (x < expected.size()) ? expected[x] : 0;
+
+      if(a != b)
+      {
+        if(0 == differences)
+        {
+          first = y;
+        }
+
+        differences++;
+        break;
+      }
+    }
+  }
+
+  if(p_printed->rows.size() != p_expected->rows.size())
+  {
+    printf("%s: differs, %zu lines printed, %zu expected\n", p_name, p_printed->rows.size(), p_expected->rows.size());
+    return false;
+  }
+
+  if(0 != differences)
+  {
+    printf("%s: differs, %zu of %zu lines, first at line %zu\n", p_name, differences, lines, first);
+    return false;
+  }
+
+  printf("%s: identical, %zu lines\n", p_name, lines);
+  return true;
+}
+
+static bool WritePbm(const char *p_path, const EPTMS_IMAGE_T *p_image)
+{
+  FILE *p_file = fopen(p_path, "wb");
+
+  if(nullptr == p_file)
+  {
+    return false;
+  }
+
+  size_t BytesPerLine = EPTMD_BITS_TO_BYTES(p_image->width);
+  std::vector<unsigned char> line(BytesPerLine);
+  fprintf(p_file, "P4\n%u %zu\n", p_image->width, p_image->rows.size());
+
+  for(const std::vector<unsigned char> &row : p_image->rows)
+  {
+    std::fill(line.begin(), line.end(), 0);
+    std::copy(row.begin(), row.begin() + (long)((row.size() < BytesPerLine) ? row.size() : BytesPerLine), line.begin());
+    fwrite(line.data(), 1, line.size(), p_file);
+  }
+
+  return (0 == fclose(p_file));
+}
+
+static void PrintReport(const EPTMS_RENDER_T *p_render)
+{
+  unsigned long long total = 0;
+  unsigned long long payload = 0;
+
+  printf("%-16s %9s %12s %12s\n", "command", "count", "bytes", "graphics");
+
+  for(unsigned i = 0; i < TmCommandCount; i++)
+  {
+    if(0 != p_render->count[i])
+    {
+      printf("%-16s %9lu %12llu %12llu\n", g_TmCommandNames[i], p_render->count[i], p_render->bytes[i], p_render->payload[i]);
+      total += p_render->bytes[i];
+      payload += p_render->payload[i];
+    }
+  }
+
+  printf("%-16s %9s %12llu %12llu\n", "total", "", total, payload);
+  printf("paper: %u x %zu dots, %zu cuts", p_render->image.width, p_render->image.rows.size(), p_render->cuts.size());
+
+  for(size_t cut : p_render->cuts)
+  {
+    printf(" %zu", cut);
+  }
+
+  printf("\n");
+}
@@ -0,0 +1,215 @@
+/******************************************************************************
+ *
+ * Epson TM-T88V Printer Driver for GNU/Linux
+ *
+ * Copyright (C) 2020 Grégory DAVID.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *****************************************************************************/
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*----------------
+ * MACRO (#define)
+ *----------------*/
+#define EPTMD_BENCH_RUNS (5) // Runs per raster file, the fastest one is reported.
+#define EPTMD_BENCH_READ_SIZE (64 * 1024) // Read size of the filter output.
+
+/*--------------------------------
+ * Structure prototype declaration
+ *--------------------------------*/
+typedef struct
+{
+  double time; // Seconds from fork to exit.
+  double firstByte; // Seconds from fork to the first output byte.
+  unsigned long long outputBytes; // Bytes written by the filter.
+  unsigned long long syscalls; // Output syscalls reported by the filter.
+  unsigned pages; // PAGE: messages of the filter.
+  long maxRss; // Peak resident set size in KiB.
+} EPTMS_BENCH_RUN_T; // Measurements of one filter run
+
+/*--------------------------------------
+ * Static function prototype declaration
+ *--------------------------------------*/
+static bool RunFilter(const char *, const char *, const char *, const char *, EPTMS_BENCH_RUN_T *);
+static bool ParseFilterLog(FILE *, EPTMS_BENCH_RUN_T *);
+static double GetMonotonicTime(void);
+
+int main(int argc, char *argv[])
+{
+  if(5 > argc)
+  {
+    fprintf(stderr, "Usage: %s filter ppd options raster...\n", argv[0]);
+    return 1;
+  }
+
+  const char *p_filter = argv[1];
+  const char *p_ppd = argv[2];
+  const char *p_options = argv[3];
+  int result = 0;
+
+  printf("%-16s %5s %9s %9s %9s %9s %9s %9s\n",
+         "raster", "pages", "time ms", "pages/s", "MB/s", "TTFB ms", "syscalls", "RSS KiB");
+
+  for(int i = 4; i < argc; i++)
+  {
+    struct stat info;
+
+    if(0 != stat(argv[i], &info))
+    {
+      fprintf(stderr, "%s: cannot stat %s\n", argv[0], argv[i]);
+      result = 1;
+      continue;
+    }
+
+    EPTMS_BENCH_RUN_T best;
+    memset(&best, 0, sizeof(best));
+    bool measured = false;
+
+    for(unsigned run = 0; run < EPTMD_BENCH_RUNS; run++)
+    {
+      EPTMS_BENCH_RUN_T current;
+
+      if(!RunFilter(p_filter, p_ppd, p_options, argv[i], &current))
+      {
+        measured = false;
+        break;
+      }
+
+      if(!measured || (current.time < best.time))
+      {
+        best = current;
+      }
+
+      measured = true;
+    }
+
+    if(!measured)
+    {
+      fprintf(stderr, "%s: filter failed on %s\n", argv[0], argv[i]);
+      result = 1;
+      continue;
+    }
+
+    std::string name = argv[i];
+    name = name.substr(name.find_last_of('/') + 1);
+    printf("%-16s %5u %9.2f %9.1f %9.1f %9.3f %9llu %9ld\n",
+           name.c_str(), best.pages, best.time * 1e3, best.pages / best.time,
+           static_cast<double>(info.st_size) / best.time / 1e6, best.firstByte * 1e3, best.syscalls, best.maxRss);
+  }
+
+  return result;
+}
+
+// Runs the filter as CUPS would, reading its output like a backend that discards it.
+static bool RunFilter(const char *p_filter, const char *p_ppd, const char *p_options, const char *p_raster, EPTMS_BENCH_RUN_T *p_run)
+{
+  int output[2];
+  FILE *p_log = tmpfile();
+
+  if((nullptr == p_log) || (0 != pipe(output)))
+  {
+    return false;
+  }
+
+  double start = GetMonotonicTime();
+  pid_t pid = fork();
+
+  if(0 == pid)
+  {
+    dup2(output[1], STDOUT_FILENO);
+    dup2(fileno(p_log), STDERR_FILENO);
+    close(output[0]);
+    close(output[1]);
+    setenv("PPD", p_ppd, 1);
+    execl(p_filter, "rastertotmt88v", "1", "bench", "bench", "1", p_options, p_raster, (char *)nullptr);
+    _exit(127);
+  }
+
+  close(output[1]);
+  memset(p_run, 0, sizeof(*p_run));
+  static char buffer[EPTMD_BENCH_READ_SIZE];
+  ssize_t length;
+
+  while((0 < (length = read(output[0], buffer, sizeof(buffer)))) || ((0 > length) && (EINTR == errno)))
+  {
+    if((0 < length) && (0 == p_run->outputBytes))
+    {
+      p_run->firstByte = GetMonotonicTime() - start;
+    }
+
+    if(0 < length)
+    {
+      p_run->outputBytes += static_cast<unsigned long long>(length);
+    }
+  }
+
+  close(output[0]);
+  int status = 0;
+  struct rusage usage;
+
+  if((0 > pid) || (pid != wait4(pid, &status, 0, &usage)))
+  {
+    fclose(p_log);
+    return false;
+  }
+
+  p_run->time = GetMonotonicTime() - start;
+  p_run->maxRss = usage.ru_maxrss;
+  bool parsed = ParseFilterLog(p_log, p_run);
+  fclose(p_log);
+  return parsed && WIFEXITED(status) && (0 == WEXITSTATUS(status));
+}
+
+static bool ParseFilterLog(FILE *p_log, EPTMS_BENCH_RUN_T *p_run)
+{
+  char line[256];
+  rewind(p_log);
+
+  while(nullptr != fgets(line, sizeof(line), p_log))
+  {
+    if(0 == strncmp(line, "PAGE: ", 6))
+    {
+      p_run->pages++;
+    }
+    else if(1 == sscanf(line, "DEBUG: output syscalls = %llu", &p_run->syscalls))
+    {
+      continue;
+    }
+    else if(0 == strncmp(line, "ERROR: ", 7))
+    {
+      fputs(line, stderr);
+    }
+  }
+
+  return 0 < p_run->pages;
+}
+
+static double GetMonotonicTime(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<double>(now.tv_sec) + (static_cast<double>(now.tv_nsec) / 1e9);
+}
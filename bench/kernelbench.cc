@@ -0,0 +1,902 @@
+/******************************************************************************
+ *
+ * Epson TM-T88V Printer Driver for GNU/Linux
+ *
+ * Copyright (C) 2020 Grégory DAVID.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *****************************************************************************/
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "rasterkernel.h"
+
+/*----------------
+ * MACRO (#define)
+ *----------------*/
+#define EPTMD_BENCH_LINES (16384) // Raster rows of the synthetic page.
+#define EPTMD_BENCH_REPEATS (5) // Measurements per result, the fastest is reported.
+#define EPTMD_BENCH_ROUNDS (20) // Passes over the page per measurement.
+#define EPTMD_BENCH_SCAN_ROUNDS (2000) // Passes over the blank line bitmap.
+#define EPTMD_BENCH_BAND_LINES (48) // Rows per band of FindInkColumns and of the band header.
+#define EPTMD_BENCH_DITHER_ROUNDS (4) // Passes over the gray page, 8 times the bytes of a 1 bit page.
+#define EPTMD_BENCH_NONE (~0u) // Density or escape period that does not apply.
+#define EPTMD_CHECK_MAX_BYTES (96) // Widest row of the kernel check, every width from 1 byte.
+#define EPTMD_CHECK_OFFSETS (8) // Alignments of the data checked.
+#define EPTMD_CHECK_MAX_DATA (256) // Longest data of the AvoidDisturbingData check, every length from 0.
+
+/*--------------------------------
+ * Structure prototype declaration
+ *--------------------------------*/
+typedef struct
+{
+  const char *p_kernel; // Kernel under test.
+  unsigned BytesPerLine; // Bytes per row, gray pixels for the dither.
+  unsigned density; // Percent of rows with ink.
+  unsigned period; // One escape pair every period bytes, 0 for none.
+  double reference; // ns/row of the first implementation, the base of the speedup.
+} EPTMS_BENCH_CASE_T; // Page of one group of results
+
+typedef struct
+{
+  std::string name; // Instruction set, name/width for a kernel built for a width.
+  const EPTMS_RASTER_KERNEL_T *p_kernel;
+} EPTMS_BENCH_KERNEL_T; // Implementation under test
+
+/*--------------------------------------
+ * Static function prototype declaration
+ *--------------------------------------*/
+static bool IsSelected(const char *);
+static std::vector<EPTMS_BENCH_KERNEL_T> GetBenchKernels(unsigned);
+static void PrintResult(EPTMS_BENCH_CASE_T *, const char *, double, unsigned long long, unsigned long long, unsigned long long);
+static void FillPage(std::vector<unsigned char> &, unsigned, unsigned);
+static unsigned FindBlankLinesBytewise(const unsigned char *, unsigned, unsigned, std::uint64_t *);
+static void BenchFindBlankLines(EPTMS_BENCH_CASE_T *, const char *, unsigned (*)(const unsigned char *, unsigned, unsigned, std::uint64_t *),
+                                const std::vector<unsigned char> &);
+static void BenchFindBlackLine(EPTMS_BENCH_CASE_T *, unsigned (*)(const std::uint64_t *, unsigned), const std::vector<unsigned char> &);
+static void FindInkColumnsBytewise(const unsigned char *, unsigned, unsigned, unsigned *, unsigned *);
+static void BenchFindInkColumns(EPTMS_BENCH_CASE_T *, const char *, void (*)(const unsigned char *, unsigned, unsigned, unsigned *, unsigned *),
+                                const std::vector<unsigned char> &);
+static void BenchTransferRaster(EPTMS_BENCH_CASE_T *, const char *, void (*)(unsigned char *, const unsigned char *, unsigned),
+                                const std::vector<unsigned char> &);
+static void FillEscapes(std::vector<unsigned char> &, unsigned);
+static void AvoidDisturbingDataBytewise(unsigned char *, unsigned long);
+static void BenchAvoidDisturbingData(EPTMS_BENCH_CASE_T *, const char *, void (*)(unsigned char *, unsigned long),
+                                     const std::vector<unsigned char> &);
+static void BenchBandHeader(EPTMS_BENCH_CASE_T *);
+static void FillGray(std::vector<unsigned char> &, unsigned);
+static void DitherDiffusionEntry(const unsigned char *, unsigned, unsigned, unsigned char, unsigned char *);
+static void BenchDither(EPTMS_BENCH_CASE_T *, const char *, void (*)(const unsigned char *, unsigned, unsigned, unsigned char, unsigned char *),
+                        const std::vector<unsigned char> &);
+static unsigned CheckKernels(void);
+static void FillCheckPage(unsigned char *, unsigned, unsigned, unsigned, unsigned *);
+static unsigned CheckLineKernels(const EPTMS_BENCH_KERNEL_T &, const unsigned char *, unsigned, unsigned, unsigned);
+static unsigned CheckAvoidDisturbingData(const EPTMS_BENCH_KERNEL_T &);
+static unsigned CheckDither(const EPTMS_RASTER_KERNEL_T *, const EPTMS_BENCH_KERNEL_T &);
+static unsigned ReportMismatch(const char *, const EPTMS_BENCH_KERNEL_T &, unsigned, unsigned, unsigned);
+
+static const char *g_BenchFilter = nullptr; // Runs only the kernels whose name contains it.
+static std::vector<int> g_BenchErrors; // Error diffusion state of DitherDiffusionEntry.
+
+// Times the raster kernels on synthetic pages, one CSV row per kernel,
+// implementation and page. GB/s counts the raster bytes of the rows, so a
+// kernel that skips bytes may run faster than memory. With -c the kernels
+// are only compared with their scalar reference, the exit status is 1 if
+// any of them differs.
+int main(int argc, char *argv[])
+{
+  bool check = false;
+  int option;
+
+  while(-1 != (option = getopt(argc, argv, "ck:")))
+  {
+    if('c' == option)
+    {
+      check = true;
+    }
+    else if('k' == option)
+    {
+      g_BenchFilter = optarg;
+    }
+    else
+    {
+      fprintf(stderr, "Usage: %s [-c] [-k kernel]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if(check)
+  {
+    return (0 == CheckKernels()) ? 0 : 1;
+  }
+
+  // 58 mm (45 bytes) and 80 mm (64/72 bytes) roll widths.
+  const unsigned widths[] = { EPTMD_RASTER_WIDTH_58, EPTMD_RASTER_WIDTH_80, 72 };
+  const unsigned densities[] = { 0, 10, 50, 100 };
+  unsigned count = 0;
+  const EPTMS_RASTER_KERNEL_T *p_kernels = GetRasterKernels(&count);
+  printf("kernel,impl,bytes_per_row,density,escape_period,ns_per_row,gb_per_s,speedup,check\n");
+
+  for(unsigned BytesPerLine : widths)
+  {
+    std::vector<EPTMS_BENCH_KERNEL_T> kernels = GetBenchKernels(BytesPerLine);
+
+    for(unsigned density : densities)
+    {
+      std::vector<unsigned char> page(static_cast<std::size_t>(BytesPerLine) * EPTMD_BENCH_LINES);
+      FillPage(page, BytesPerLine, density);
+      EPTMS_BENCH_CASE_T blank = { "FindBlankLines", BytesPerLine, density, EPTMD_BENCH_NONE, 0 };
+      BenchFindBlankLines(&blank, "bytewise", FindBlankLinesBytewise, page);
+
+      for(EPTMS_BENCH_KERNEL_T &kernel : kernels)
+      {
+        BenchFindBlankLines(&blank, kernel.name.c_str(), kernel.p_kernel->FindBlankLines, page);
+      }
+
+      EPTMS_BENCH_CASE_T top = { "FindBlackRasterLineTop", BytesPerLine, density, EPTMD_BENCH_NONE, 0 };
+      BenchFindBlackLine(&top, FindBlackRasterLineTop, page);
+      EPTMS_BENCH_CASE_T end = { "FindBlackRasterLineEnd", BytesPerLine, density, EPTMD_BENCH_NONE, 0 };
+      BenchFindBlackLine(&end, FindBlackRasterLineEnd, page);
+      EPTMS_BENCH_CASE_T ink = { "FindInkColumns", BytesPerLine, density, EPTMD_BENCH_NONE, 0 };
+      BenchFindInkColumns(&ink, "bytewise", FindInkColumnsBytewise, page);
+
+      for(EPTMS_BENCH_KERNEL_T &kernel : kernels)
+      {
+        BenchFindInkColumns(&ink, kernel.name.c_str(), kernel.p_kernel->FindInkColumns, page);
+      }
+
+      EPTMS_BENCH_CASE_T transfer = { "TransferRaster", BytesPerLine, density, EPTMD_BENCH_NONE, 0 };
+
+      for(EPTMS_BENCH_KERNEL_T &kernel : kernels)
+      {
+        BenchTransferRaster(&transfer, kernel.name.c_str(), kernel.p_kernel->CopyLine, page);
+      }
+    }
+  }
+
+  // Dense image data of 80 mm rows with one DLE or ESC pair every 'period'
+  // bytes, half of them real-time commands.
+  const unsigned periods[] = { 0, 4096, 64, 8 };
+
+  for(unsigned period : periods)
+  {
+    std::vector<unsigned char> page(static_cast<std::size_t>(EPTMD_RASTER_WIDTH_80) * EPTMD_BENCH_LINES);
+    FillEscapes(page, period);
+    EPTMS_BENCH_CASE_T escapes = { "AvoidDisturbingData", EPTMD_RASTER_WIDTH_80, 100, period, 0 };
+    BenchAvoidDisturbingData(&escapes, "bytewise", AvoidDisturbingDataBytewise, page);
+
+    for(unsigned k = 0; k < count; k++)
+    {
+      BenchAvoidDisturbingData(&escapes, p_kernels[k].p_name, p_kernels[k].AvoidDisturbingData, page);
+    }
+  }
+
+  for(unsigned BytesPerLine : widths)
+  {
+    EPTMS_BENCH_CASE_T header = { "EncodeRasterBandHeader", BytesPerLine, EPTMD_BENCH_NONE, EPTMD_BENCH_NONE, 0 };
+    BenchBandHeader(&header);
+  }
+
+  // 8 bit gray rows of 58 mm (360 dots) and 80 mm (512/576 dots) rolls.
+  const unsigned dots[] = { 360, 512, 576 };
+
+  for(unsigned width : dots)
+  {
+    std::vector<unsigned char> page(static_cast<std::size_t>(width) * EPTMD_BENCH_LINES);
+    FillGray(page, width);
+    EPTMS_BENCH_CASE_T dither = { "DitherOrdered", width, EPTMD_BENCH_NONE, EPTMD_BENCH_NONE, 0 };
+
+    for(unsigned k = 0; k < count; k++)
+    {
+      BenchDither(&dither, p_kernels[k].p_name, p_kernels[k].DitherOrdered, page);
+    }
+
+    // Error diffusion has a single scalar implementation and other dots,
+    // so it is its own kernel, with its own speedup base and check.
+    EPTMS_BENCH_CASE_T diffusion = { "DitherDiffusion", width, EPTMD_BENCH_NONE, EPTMD_BENCH_NONE, 0 };
+    BenchDither(&diffusion, "generic", DitherDiffusionEntry, page);
+  }
+
+  return 0;
+}
+
+static bool IsSelected(const char *p_kernel)
+{
+  return (nullptr == g_BenchFilter) || (nullptr != strstr(p_kernel, g_BenchFilter));
+}
+
+// Kernels of each instruction set, each followed by its kernel built for
+// BytesPerLine if there is one.
+static std::vector<EPTMS_BENCH_KERNEL_T> GetBenchKernels(unsigned BytesPerLine)
+{
+  std::vector<EPTMS_BENCH_KERNEL_T> kernels;
+  unsigned count = 0;
+  const EPTMS_RASTER_KERNEL_T *p_kernels = GetRasterKernels(&count);
+
+  for(unsigned k = 0; k < count; k++)
+  {
+    kernels.push_back({ p_kernels[k].p_name, &p_kernels[k] });
+    const EPTMS_RASTER_KERNEL_T *p_width = GetRasterKernelForWidth(&p_kernels[k], BytesPerLine);
+
+    if(&p_kernels[k] != p_width)
+    {
+      kernels.push_back({ std::string(p_width->p_name) + "/" + std::to_string(p_width->BytesPerLine), p_width });
+    }
+  }
+
+  return kernels;
+}
+
+// ns is the fastest measurement of rows, 'check' is a result of the kernel that all implementations must agree on.
+static void PrintResult(EPTMS_BENCH_CASE_T *p_case, const char *p_impl, double ns, unsigned long long rows, unsigned long long bytes,
+                        unsigned long long check)
+{
+  double ns_per_row = ns / static_cast<double>(rows);
+  std::string density = (EPTMD_BENCH_NONE == p_case->density) ? "-" : std::to_string(p_case->density);
+  std::string period = (EPTMD_BENCH_NONE == p_case->period) ? "-" : std::to_string(p_case->period);
+
+  if(0 == p_case->reference)
+  {
+    p_case->reference = ns_per_row;
+  }
+
+  printf("%s,%s,%u,%s,%s,%.4g,%.4g,%.2f,%llu\n", p_case->p_kernel, p_impl, p_case->BytesPerLine, density.c_str(), period.c_str(),
+         ns_per_row, static_cast<double>(bytes) / ns, p_case->reference / ns_per_row, check);
+  fflush(stdout);
+}
+
+// Rows hold ink with a probability of density percent, one black byte near
+// the right edge like the end of a text line.
+static void FillPage(std::vector<unsigned char> &page, unsigned BytesPerLine, unsigned density)
+{
+  unsigned seed = 1;
+
+  for(unsigned y = 0; y < EPTMD_BENCH_LINES; y++)
+  {
+    seed = (seed * 1103515245u) + 12345u;
+
+    if(((seed >> 16) % 100) >= density)
+    {
+      continue;
+    }
+
+    seed = (seed * 1103515245u) + 12345u;
+    unsigned x = BytesPerLine - 1 - ((seed >> 16) % 8);
+    page[(static_cast<std::size_t>(y) * BytesPerLine) + x] = static_cast<unsigned char>(0x80 >> ((seed >> 8) % 8));
+  }
+}
+
+// Reference: the byte at a time scan formerly used by FindBlackRasterLineTop/End.
+static unsigned FindBlankLinesBytewise(const unsigned char *p_data, unsigned BytesPerLine, unsigned lines, std::uint64_t *p_bitmap)
+{
+  unsigned blank_lines = 0;
+
+  for(unsigned y = 0; y < lines; y++)
+  {
+    bool blank = true;
+
+    for(unsigned x = 0; x < BytesPerLine; x++)
+    {
+      if(0x00 != p_data[x])
+      {
+        blank = false;
+        break;
+      }
+    }
+
+    if(0 == (y % 64))
+    {
+      p_bitmap[y / 64] = 0;
+    }
+
+    if(blank)
+    {
+      p_bitmap[y / 64] |= (std::uint64_t)1 << (y % 64);
+      blank_lines++;
+    }
+
+    p_data += BytesPerLine;
+  }
+
+  if(0 != (lines % 64))
+  {
+    p_bitmap[lines / 64] |= ~(std::uint64_t)0 << (lines % 64);
+  }
+
+  return blank_lines;
+}
+
+static void BenchFindBlankLines(EPTMS_BENCH_CASE_T *p_case, const char *p_impl,
+                                unsigned (*FindBlankLines)(const unsigned char *, unsigned, unsigned, std::uint64_t *),
+                                const std::vector<unsigned char> &page)
+{
+  if(!IsSelected(p_case->p_kernel))
+  {
+    return;
+  }
+
+  std::vector<std::uint64_t> bitmap(EPTMD_BITMAP_WORDS(EPTMD_BENCH_LINES));
+  unsigned long long blank_lines = 0;
+  double best = 0;
+
+  for(unsigned repeat = 0; repeat < EPTMD_BENCH_REPEATS; repeat++)
+  {
+    blank_lines = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for(unsigned round = 0; round < EPTMD_BENCH_ROUNDS; round++)
+    {
+      blank_lines += FindBlankLines(page.data(), p_case->BytesPerLine, EPTMD_BENCH_LINES, bitmap.data());
+    }
+
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    best = ((0 == best) || (elapsed.count() < best)) ? elapsed.count() : best;
+  }
+
+  PrintResult(p_case, p_impl, best, 1ull * EPTMD_BENCH_LINES * EPTMD_BENCH_ROUNDS, 1ull * page.size() * EPTMD_BENCH_ROUNDS,
+              blank_lines / EPTMD_BENCH_ROUNDS);
+}
+
+// Scans the blank line bitmap of the page, a page without ink is read in full.
+static void BenchFindBlackLine(EPTMS_BENCH_CASE_T *p_case, unsigned (*FindBlackLine)(const std::uint64_t *, unsigned),
+                               const std::vector<unsigned char> &page)
+{
+  if(!IsSelected(p_case->p_kernel))
+  {
+    return;
+  }
+
+  std::vector<std::uint64_t> bitmap(EPTMD_BITMAP_WORDS(EPTMD_BENCH_LINES));
+  FindBlankRasterLines(page.data(), p_case->BytesPerLine, EPTMD_BENCH_LINES, bitmap.data());
+  unsigned long long line_no = 0;
+  double best = 0;
+
+  for(unsigned repeat = 0; repeat < EPTMD_BENCH_REPEATS; repeat++)
+  {
+    line_no = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for(unsigned round = 0; round < EPTMD_BENCH_SCAN_ROUNDS; round++)
+    {
+      line_no += FindBlackLine(bitmap.data(), EPTMD_BENCH_LINES);
+      __asm__ __volatile__("" : : "r"(bitmap.data()) : "memory"); // The bitmap may change between rounds.
+    }
+
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    best = ((0 == best) || (elapsed.count() < best)) ? elapsed.count() : best;
+  }
+
+  PrintResult(p_case, "bitmap", best, 1ull * EPTMD_BENCH_LINES * EPTMD_BENCH_SCAN_ROUNDS,
+              1ull * page.size() * EPTMD_BENCH_SCAN_ROUNDS, line_no / EPTMD_BENCH_SCAN_ROUNDS);
+}
+
+// Reference: every byte of the band, 0 to BytesPerLine.
+static void FindInkColumnsBytewise(const unsigned char *p_data, unsigned BytesPerLine, unsigned lines, unsigned *p_left, unsigned *p_right)
+{
+  *p_left = 0;
+  *p_right = 0;
+
+  for(unsigned x = 0; x < BytesPerLine; x++)
+  {
+    for(unsigned y = 0; y < lines; y++)
+    {
+      if(0x00 != p_data[(static_cast<std::size_t>(y) * BytesPerLine) + x])
+      {
+        if(*p_left == *p_right)
+        {
+          *p_left = x;
+        }
+
+        *p_right = x + 1;
+        break;
+      }
+    }
+  }
+}
+
+static void BenchFindInkColumns(EPTMS_BENCH_CASE_T *p_case, const char *p_impl,
+                                void (*FindInkColumns)(const unsigned char *, unsigned, unsigned, unsigned *, unsigned *),
+                                const std::vector<unsigned char> &page)
+{
+  if(!IsSelected(p_case->p_kernel))
+  {
+    return;
+  }
+
+  unsigned BytesPerLine = p_case->BytesPerLine;
+  unsigned long long columns = 0;
+  double best = 0;
+
+  for(unsigned repeat = 0; repeat < EPTMD_BENCH_REPEATS; repeat++)
+  {
+    columns = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for(unsigned round = 0; round < EPTMD_BENCH_ROUNDS; round++)
+    {
+      for(unsigned y = 0; y < EPTMD_BENCH_LINES; y += EPTMD_BENCH_BAND_LINES)
+      {
+        unsigned lines = ((EPTMD_BENCH_LINES - y) < EPTMD_BENCH_BAND_LINES) ? (EPTMD_BENCH_LINES - y) : EPTMD_BENCH_BAND_LINES;
+        unsigned left;
+        unsigned right;
+        FindInkColumns(&page[static_cast<std::size_t>(y) * BytesPerLine], BytesPerLine, lines, &left, &right);
+        columns += right - left;
+      }
+    }
+
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    best = ((0 == best) || (elapsed.count() < best)) ? elapsed.count() : best;
+  }
+
+  PrintResult(p_case, p_impl, best, 1ull * EPTMD_BENCH_LINES * EPTMD_BENCH_ROUNDS, 1ull * page.size() * EPTMD_BENCH_ROUNDS,
+              columns / EPTMD_BENCH_ROUNDS);
+}
+
+// Copies the rows of the page one by one, as lines with padding are read.
+static void BenchTransferRaster(EPTMS_BENCH_CASE_T *p_case, const char *p_impl,
+                                void (*CopyLine)(unsigned char *, const unsigned char *, unsigned),
+                                const std::vector<unsigned char> &page)
+{
+  if(!IsSelected(p_case->p_kernel))
+  {
+    return;
+  }
+
+  unsigned BytesPerLine = p_case->BytesPerLine;
+  std::vector<unsigned char> copy(page.size());
+  double best = 0;
+
+  for(unsigned repeat = 0; repeat < EPTMD_BENCH_REPEATS; repeat++)
+  {
+    auto start = std::chrono::steady_clock::now();
+
+    for(unsigned round = 0; round < EPTMD_BENCH_ROUNDS; round++)
+    {
+      for(unsigned y = 0; y < EPTMD_BENCH_LINES; y++)
+      {
+        CopyLine(&copy[static_cast<std::size_t>(y) * BytesPerLine], &page[static_cast<std::size_t>(y) * BytesPerLine], BytesPerLine);
+      }
+
+      __asm__ __volatile__("" : : "r"(copy.data()) : "memory"); // Every round is stored.
+    }
+
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    best = ((0 == best) || (elapsed.count() < best)) ? elapsed.count() : best;
+  }
+
+  unsigned long long same = (copy == page) ? EPTMD_BENCH_LINES : 0;
+  PrintResult(p_case, p_impl, best, 1ull * EPTMD_BENCH_LINES * EPTMD_BENCH_ROUNDS, 1ull * page.size() * EPTMD_BENCH_ROUNDS, same);
+}
+
+static void FillEscapes(std::vector<unsigned char> &page, unsigned period)
+{
+  const unsigned char escapes[][2] = { { 0x10, 0x04 }, { 0x10, 0x20 }, { 0x1b, 0x3d }, { 0x1b, 0x40 } };
+  unsigned seed = 1;
+
+  for(std::size_t i = 0; (i + 1) < page.size(); i++)
+  {
+    seed = (seed * 1103515245u) + 12345u;
+    page[i] = static_cast<unsigned char>(0x20 | ((seed >> 16) & 0xc3)); // never DLE nor ESC
+
+    if((0 != period) && (0 == (i % period)))
+    {
+      page[i] = escapes[(seed >> 8) % 4][0];
+      page[i + 1] = escapes[(seed >> 8) % 4][1];
+      i++;
+    }
+  }
+}
+
+// Reference: the byte at a time loop formerly used by AvoidDisturbingData.
+static void AvoidDisturbingDataBytewise(unsigned char *p_data, unsigned long data_size)
+{
+  for(unsigned long i = 0; (i + 1) < data_size; i++)
+  {
+    if(0x10 == p_data[i])
+    {
+      if((0x04 == p_data[i + 1]) || (0x05 == p_data[i + 1]) || (0x14 == p_data[i + 1]))
+      {
+        p_data[i] = 0x30;
+      }
+    }
+    else if(0x1B == p_data[i])
+    {
+      if(0x3D == p_data[i + 1])
+      {
+        p_data[i] = 0x3B;
+      }
+    }
+    else {}
+  }
+}
+
+static void BenchAvoidDisturbingData(EPTMS_BENCH_CASE_T *p_case, const char *p_impl, void (*AvoidDisturbingData)(unsigned char *, unsigned long),
+                                     const std::vector<unsigned char> &page)
+{
+  if(!IsSelected(p_case->p_kernel))
+  {
+    return;
+  }
+
+  std::vector<unsigned char> data(page);
+  double best = 0;
+
+  for(unsigned repeat = 0; repeat < EPTMD_BENCH_REPEATS; repeat++)
+  {
+    std::chrono::duration<double, std::nano> elapsed(0);
+
+    for(unsigned round = 0; round < EPTMD_BENCH_ROUNDS; round++)
+    {
+      data = page;
+      auto start = std::chrono::steady_clock::now();
+      AvoidDisturbingData(data.data(), data.size());
+      elapsed += std::chrono::steady_clock::now() - start;
+    }
+
+    best = ((0 == best) || (elapsed.count() < best)) ? elapsed.count() : best;
+  }
+
+  unsigned long long changed = 0;
+
+  for(std::size_t i = 0; i < page.size(); i++)
+  {
+    changed += (page[i] != data[i]) ? 1u : 0u;
+  }
+
+  PrintResult(p_case, p_impl, best, 1ull * EPTMD_BENCH_LINES * EPTMD_BENCH_ROUNDS, 1ull * page.size() * EPTMD_BENCH_ROUNDS, changed);
+}
+
+// One GS 8 L header per band of the page, rows are the rows of the bands.
+static void BenchBandHeader(EPTMS_BENCH_CASE_T *p_case)
+{
+  if(!IsSelected(p_case->p_kernel))
+  {
+    return;
+  }
+
+  unsigned char command[EPTMD_BAND_HEADER_SIZE];
+  unsigned long long sum = 0;
+  double best = 0;
+
+  for(unsigned repeat = 0; repeat < EPTMD_BENCH_REPEATS; repeat++)
+  {
+    sum = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for(unsigned round = 0; round < EPTMD_BENCH_ROUNDS; round++)
+    {
+      for(unsigned y = 0; y < EPTMD_BENCH_LINES; y += EPTMD_BENCH_BAND_LINES)
+      {
+        unsigned lines = ((EPTMD_BENCH_LINES - y) < EPTMD_BENCH_BAND_LINES) ? (EPTMD_BENCH_LINES - y) : EPTMD_BENCH_BAND_LINES;
+        EncodeRasterBandHeader(command, 8ul * p_case->BytesPerLine, lines);
+        __asm__ __volatile__("" : : "r"(command) : "memory"); // The header is written out.
+        sum += command[3];
+      }
+    }
+
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    best = ((0 == best) || (elapsed.count() < best)) ? elapsed.count() : best;
+  }
+
+  PrintResult(p_case, "gs8l", best, 1ull * EPTMD_BENCH_LINES * EPTMD_BENCH_ROUNDS,
+              1ull * p_case->BytesPerLine * EPTMD_BENCH_LINES * EPTMD_BENCH_ROUNDS, sum / EPTMD_BENCH_ROUNDS);
+}
+
+// Horizontal gradient with noise.
+static void FillGray(std::vector<unsigned char> &page, unsigned width)
+{
+  unsigned seed = 1;
+
+  for(std::size_t i = 0; i < page.size(); i++)
+  {
+    seed = (seed * 1103515245u) + 12345u;
+    page[i] = static_cast<unsigned char>((((i % width) * 224) / width) + ((seed >> 16) % 32));
+  }
+}
+
+static void DitherDiffusionEntry(const unsigned char *p_gray, unsigned width, unsigned y, unsigned char invert, unsigned char *p_line)
+{
+  if(0 == y)
+  {
+    g_BenchErrors.assign(width + 2, 0);
+  }
+
+  DitherDiffusionRasterLine(p_gray, width, invert, g_BenchErrors.data(), p_line);
+}
+
+static void BenchDither(EPTMS_BENCH_CASE_T *p_case, const char *p_impl,
+                        void (*Dither)(const unsigned char *, unsigned, unsigned, unsigned char, unsigned char *),
+                        const std::vector<unsigned char> &page)
+{
+  if(!IsSelected(p_case->p_kernel))
+  {
+    return;
+  }
+
+  unsigned width = p_case->BytesPerLine;
+  std::vector<unsigned char> line((width + 7) / 8);
+  unsigned long long black = 0;
+  double best = 0;
+
+  for(unsigned repeat = 0; repeat < EPTMD_BENCH_REPEATS; repeat++)
+  {
+    black = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for(unsigned round = 0; round < EPTMD_BENCH_DITHER_ROUNDS; round++)
+    {
+      for(unsigned y = 0; y < EPTMD_BENCH_LINES; y++)
+      {
+        Dither(&page[static_cast<std::size_t>(y) * width], width, y, 0, line.data());
+        black += static_cast<unsigned>(__builtin_popcount(line[y % line.size()]));
+      }
+    }
+
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    best = ((0 == best) || (elapsed.count() < best)) ? elapsed.count() : best;
+  }
+
+  PrintResult(p_case, p_impl, best, 1ull * EPTMD_BENCH_LINES * EPTMD_BENCH_DITHER_ROUNDS,
+              1ull * page.size() * EPTMD_BENCH_DITHER_ROUNDS, black / EPTMD_BENCH_DITHER_ROUNDS);
+}
+
+// Every implementation of every instruction set the CPU runs, and every
+// kernel built for a width, against the scalar references above.
+static unsigned CheckKernels(void)
+{
+  const unsigned line_counts[] = { 1, 7, 63, 64, 65, 130 };
+  const unsigned densities[] = { 0, 5, 50, 100 };
+  unsigned count = 0;
+  const EPTMS_RASTER_KERNEL_T *p_kernels = GetRasterKernels(&count);
+  unsigned seed = 1;
+  unsigned cases = 0;
+  unsigned errors = 0;
+
+  for(unsigned BytesPerLine = 1; BytesPerLine <= EPTMD_CHECK_MAX_BYTES; BytesPerLine++)
+  {
+    std::vector<EPTMS_BENCH_KERNEL_T> kernels = GetBenchKernels(BytesPerLine);
+
+    for(unsigned lines : line_counts)
+    {
+      std::vector<unsigned char> buffer(EPTMD_CHECK_OFFSETS + (static_cast<std::size_t>(BytesPerLine) * lines));
+
+      for(unsigned offset = 0; offset < EPTMD_CHECK_OFFSETS; offset++)
+      {
+        FillCheckPage(&buffer[offset], BytesPerLine, lines, densities[offset % 4], &seed);
+
+        for(const EPTMS_BENCH_KERNEL_T &kernel : kernels)
+        {
+          errors += CheckLineKernels(kernel, &buffer[offset], BytesPerLine, lines, offset);
+          cases++;
+        }
+      }
+    }
+  }
+
+  // The kernels built for a width share the AvoidDisturbingData and the
+  // DitherOrdered of their instruction set, the generic one is the reference.
+  for(unsigned k = 0; k < count; k++)
+  {
+    EPTMS_BENCH_KERNEL_T kernel = { p_kernels[k].p_name, &p_kernels[k] };
+    errors += CheckAvoidDisturbingData(kernel);
+    errors += CheckDither(&p_kernels[0], kernel);
+    cases += 2;
+  }
+
+  fprintf(stderr, "kernelcheck: %u pages of %u instruction sets checked, %u differences\n", cases, count, errors);
+  return errors;
+}
+
+// Rows hold ink with a probability of density percent, one to three bytes
+// anywhere in the row.
+static void FillCheckPage(unsigned char *p_data, unsigned BytesPerLine, unsigned lines, unsigned density, unsigned *p_seed)
+{
+  memset(p_data, 0, static_cast<std::size_t>(BytesPerLine) * lines);
+
+  for(unsigned y = 0; y < lines; y++)
+  {
+    *p_seed = (*p_seed * 1103515245u) + 12345u;
+
+    if(((*p_seed >> 16) % 100) >= density)
+    {
+      continue;
+    }
+
+    for(unsigned dots = 1 + ((*p_seed >> 8) % 3); 0 < dots; dots--)
+    {
+      *p_seed = (*p_seed * 1103515245u) + 12345u;
+      unsigned x = (*p_seed >> 16) % BytesPerLine;
+      p_data[(static_cast<std::size_t>(y) * BytesPerLine) + x] = static_cast<unsigned char>(1 + ((*p_seed >> 8) % 255));
+    }
+  }
+}
+
+// IsBlankLine, FindBlankLines, FindInkColumns and CopyLine on one page.
+static unsigned CheckLineKernels(const EPTMS_BENCH_KERNEL_T &kernel, const unsigned char *p_data, unsigned BytesPerLine, unsigned lines,
+                                 unsigned offset)
+{
+  const EPTMS_RASTER_KERNEL_T *p_kernel = kernel.p_kernel;
+  unsigned errors = 0;
+
+  if(IsSelected("IsBlankLine"))
+  {
+    std::uint64_t expected = 0;
+    FindBlankLinesBytewise(p_data, BytesPerLine, 1, &expected);
+
+    if((0 != (expected & 1)) != p_kernel->IsBlankLine(p_data, BytesPerLine))
+    {
+      errors += ReportMismatch("IsBlankLine", kernel, BytesPerLine, 1, offset);
+    }
+  }
+
+  if(IsSelected("FindBlankLines"))
+  {
+    std::vector<std::uint64_t> expected(EPTMD_BITMAP_WORDS(lines));
+    std::vector<std::uint64_t> bitmap(EPTMD_BITMAP_WORDS(lines), 0x5a5a5a5a5a5a5a5aULL);
+    unsigned expected_lines = FindBlankLinesBytewise(p_data, BytesPerLine, lines, expected.data());
+
+    if((expected_lines != p_kernel->FindBlankLines(p_data, BytesPerLine, lines, bitmap.data())) || (expected != bitmap))
+    {
+      errors += ReportMismatch("FindBlankLines", kernel, BytesPerLine, lines, offset);
+    }
+  }
+
+  if(IsSelected("FindInkColumns"))
+  {
+    unsigned expected_left;
+    unsigned expected_right;
+    unsigned left = ~0u;
+    unsigned right = ~0u;
+    FindInkColumnsBytewise(p_data, BytesPerLine, lines, &expected_left, &expected_right);
+    p_kernel->FindInkColumns(p_data, BytesPerLine, lines, &left, &right);
+
+    if((expected_left != left) || (expected_right != right))
+    {
+      errors += ReportMismatch("FindInkColumns", kernel, BytesPerLine, lines, offset);
+    }
+  }
+
+  if(IsSelected("CopyLine"))
+  {
+    std::vector<unsigned char> copy(BytesPerLine + 1, 0xa5);
+    p_kernel->CopyLine(copy.data(), p_data, BytesPerLine);
+
+    if((0 != memcmp(copy.data(), p_data, BytesPerLine)) || (0xa5 != copy[BytesPerLine]))
+    {
+      errors += ReportMismatch("CopyLine", kernel, BytesPerLine, 1, offset);
+    }
+  }
+
+  return errors;
+}
+
+// Data of every length up to EPTMD_CHECK_MAX_DATA at every alignment, mostly
+// made of the bytes of the pairs so that pairs overlap and chain.
+static unsigned CheckAvoidDisturbingData(const EPTMS_BENCH_KERNEL_T &kernel)
+{
+  const unsigned char alphabet[] = { 0x10, 0x1b, 0x04, 0x05, 0x14, 0x3d, 0x30, 0x3b };
+  unsigned seed = 1;
+  unsigned errors = 0;
+
+  if(!IsSelected("AvoidDisturbingData"))
+  {
+    return 0;
+  }
+
+  for(unsigned size = 0; size <= EPTMD_CHECK_MAX_DATA; size++)
+  {
+    for(unsigned offset = 0; offset < EPTMD_CHECK_OFFSETS; offset++)
+    {
+      std::vector<unsigned char> data(EPTMD_CHECK_OFFSETS + size);
+
+      for(unsigned char &byte : data)
+      {
+        seed = (seed * 1103515245u) + 12345u;
+        byte = (0 == ((seed >> 16) % 4)) ? static_cast<unsigned char>(seed >> 8) : alphabet[(seed >> 16) % sizeof(alphabet)];
+      }
+
+      std::vector<unsigned char> expected(data);
+      AvoidDisturbingDataBytewise(&expected[offset], size);
+      kernel.p_kernel->AvoidDisturbingData(&data[offset], size);
+
+      if(expected != data)
+      {
+        errors += ReportMismatch("AvoidDisturbingData", kernel, size, 1, offset);
+      }
+    }
+  }
+
+  // The pages of the benchmark.
+  const unsigned periods[] = { 0, 4096, 64, 8, 2 };
+
+  for(unsigned period : periods)
+  {
+    std::vector<unsigned char> page(static_cast<std::size_t>(EPTMD_RASTER_WIDTH_80) * 256);
+    FillEscapes(page, period);
+    std::vector<unsigned char> expected(page);
+    AvoidDisturbingDataBytewise(expected.data(), expected.size());
+    kernel.p_kernel->AvoidDisturbingData(page.data(), page.size());
+
+    if(expected != page)
+    {
+      errors += ReportMismatch("AvoidDisturbingData", kernel, EPTMD_RASTER_WIDTH_80, 256, 0);
+    }
+  }
+
+  return errors;
+}
+
+// Every width up to EPTMD_CHECK_MAX_BYTES dots and those around the vector
+// sizes and the roll widths, at every line of the matrix, both polarities,
+// into another line and in place.
+static unsigned CheckDither(const EPTMS_RASTER_KERNEL_T *p_reference, const EPTMS_BENCH_KERNEL_T &kernel)
+{
+  std::vector<unsigned> widths;
+  unsigned errors = 0;
+
+  if(!IsSelected("DitherOrdered") || (p_reference == kernel.p_kernel))
+  {
+    return 0;
+  }
+
+  for(unsigned width = 1; width <= EPTMD_CHECK_MAX_BYTES; width++)
+  {
+    widths.push_back(width);
+  }
+
+  for(unsigned width : { 127u, 128u, 129u, 255u, 256u, 257u, 360u, 511u, 512u, 513u, 576u })
+  {
+    widths.push_back(width);
+  }
+
+  for(unsigned width : widths)
+  {
+    std::vector<unsigned char> gray(width);
+    FillGray(gray, width);
+    std::vector<unsigned char> expected((width + 7) / 8);
+    std::vector<unsigned char> line((width + 7) / 8);
+
+    for(unsigned y = 0; y < 9; y++)
+    {
+      for(unsigned char invert : { static_cast<unsigned char>(0x00), static_cast<unsigned char>(0xff) })
+      {
+        p_reference->DitherOrdered(gray.data(), width, y, invert, expected.data());
+        kernel.p_kernel->DitherOrdered(gray.data(), width, y, invert, line.data());
+        std::vector<unsigned char> in_place(gray);
+        kernel.p_kernel->DitherOrdered(in_place.data(), width, y, invert, in_place.data());
+
+        if((expected != line) || (0 != memcmp(expected.data(), in_place.data(), expected.size())))
+        {
+          errors += ReportMismatch("DitherOrdered", kernel, width, y, invert);
+        }
+      }
+    }
+  }
+
+  return errors;
+}
+
+static unsigned ReportMismatch(const char *p_function, const EPTMS_BENCH_KERNEL_T &kernel, unsigned size, unsigned lines, unsigned offset)
+{
+  fprintf(stderr, "kernelcheck: %s of %s differs from the reference, size %u, lines %u, offset %u\n",
+          p_function, kernel.name.c_str(), size, lines, offset);
+  return 1;
+}
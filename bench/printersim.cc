@@ -0,0 +1,604 @@
+/******************************************************************************
+ *
+ * Epson TM-T88V Printer Driver for GNU/Linux
+ *
+ * Copyright (C) 2020 Grégory DAVID.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *****************************************************************************/
+#include <cups/cups.h>
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <set>
+#include <poll.h>
+#include <string>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+/*----------------
+ * MACRO (#define)
+ *----------------*/
+#define ESC (0x1b)
+#define GS (0x1d)
+#define EPTMD_SIM_BUFFER_SIZE (4096) // Receive buffer of the TM-T88V.
+#define EPTMD_SIM_PRINT_RATE (136000) // Raster bytes printed per second, 300 mm/s of 80 mm paper.
+#define EPTMD_SIM_POLL_TIMEOUT (5) // Milliseconds between printer updates.
+#define EPTMD_SIM_MAX_EVENTS (16)
+
+/*-----------------
+ * enum declaration
+ *-----------------*/
+typedef enum
+{
+  TmSimCoverOpen = 0, // Cover opened, then closed.
+  TmSimPaperEnd, // Roll paper out, then replaced.
+  TmSimNearEnd, // Roll paper near its end until the job ends.
+} EPTME_SIM_EVENT; // Printer event of the simulation
+
+/*--------------------------------
+ * Structure prototype declaration
+ *--------------------------------*/
+typedef struct
+{
+  EPTME_SIM_EVENT type;
+  unsigned long long offset; // Received bytes that trigger the event.
+  double duration; // Seconds until the printer recovers.
+  double end; // Time of the recovery, 0 until triggered.
+} EPTMS_SIM_EVENT_T; // Scripted printer event
+
+typedef struct
+{
+  double level; // Bytes in the receive buffer.
+  double capacity; // Size of the receive buffer.
+  double rate; // Bytes printed per second.
+  bool coverOpen;
+  bool paperEnd;
+  bool nearEnd;
+  bool statusBack; // Automatic Status Back enabled by GS a.
+  std::set<std::string> nvKeys; // Key codes of the NV graphics, GS ( L fn 67 and fn 66.
+  unsigned char sent[4]; // Last status sent to the filter.
+  std::vector<unsigned char> data; // Received bytes.
+  std::size_t parsed; // Bytes of data decoded as commands.
+  bool unknown; // Decoding stopped at an unknown command.
+  unsigned long long statuses; // Status packets sent.
+  unsigned long long offlineBytes; // Bytes received while the printer could not print.
+  double offlineTime; // Seconds the printer could not print.
+  double peakLevel; // Highest receive buffer level while the printer could not print.
+  EPTMS_SIM_EVENT_T events[EPTMD_SIM_MAX_EVENTS];
+  unsigned eventCount;
+} EPTMS_SIM_PRINTER_T; // Simulated TM-T88V
+
+/*--------------------------------------
+ * Static function prototype declaration
+ *--------------------------------------*/
+static bool ParseEvent(const char *, EPTMS_SIM_PRINTER_T *);
+static pid_t StartFilter(char *[], const char *, int *, int *);
+static void ReceiveData(EPTMS_SIM_PRINTER_T *, const unsigned char *, std::size_t, double);
+static void UpdatePrinter(EPTMS_SIM_PRINTER_T *, double, double);
+static void DecodeCommands(EPTMS_SIM_PRINTER_T *);
+static std::size_t GetCommandLength(const unsigned char *, std::size_t, bool *);
+static void SendStatus(EPTMS_SIM_PRINTER_T *, bool);
+static void SendGraphicsKeys(EPTMS_SIM_PRINTER_T *);
+static bool IsOffline(const EPTMS_SIM_PRINTER_T *);
+static void ForwardLog(std::string *, double);
+static double GetMonotonicTime(void);
+
+int main(int argc, char *argv[])
+{
+  EPTMS_SIM_PRINTER_T printer;
+  printer.level = 0;
+  printer.capacity = EPTMD_SIM_BUFFER_SIZE;
+  printer.rate = EPTMD_SIM_PRINT_RATE;
+  printer.coverOpen = false;
+  printer.paperEnd = false;
+  printer.nearEnd = false;
+  printer.statusBack = false;
+  memset(printer.sent, 0, sizeof(printer.sent));
+  printer.parsed = 0;
+  printer.unknown = false;
+  printer.statuses = 0;
+  printer.offlineBytes = 0;
+  printer.offlineTime = 0;
+  printer.peakLevel = 0;
+  printer.eventCount = 0;
+  const char *p_output = nullptr;
+  int option;
+
+  while(-1 != (option = getopt(argc, argv, "b:e:o:r:")))
+  {
+    switch(option)
+    {
+    case 'b':
+      printer.capacity = atof(optarg);
+      break;
+
+    case 'e':
+      if(!ParseEvent(optarg, &printer))
+      {
+        fprintf(stderr, "%s: bad event %s\n", argv[0], optarg);
+        return 1;
+      }
+
+      break;
+
+    case 'o':
+      p_output = optarg;
+      break;
+
+    case 'r':
+      printer.rate = atof(optarg);
+      break;
+
+    default:
+      return 1;
+    }
+  }
+
+  if(4 != (argc - optind))
+  {
+    fprintf(stderr, "Usage: %s [-b buffer] [-r rate] [-e cover|empty:bytes:ms] [-e low:bytes] [-o output] filter ppd options raster\n", argv[0]);
+    return 1;
+  }
+
+  // Status changes after the filter has exited go nowhere.
+  signal(SIGPIPE, SIG_IGN);
+  int master = -1;
+  int log = -1;
+  double start = GetMonotonicTime();
+  pid_t pid = StartFilter(argv + optind, argv[optind + 1], &master, &log);
+
+  if(0 > pid)
+  {
+    fprintf(stderr, "%s: cannot start %s\n", argv[0], argv[optind]);
+    return 1;
+  }
+
+  std::string lines;
+  double last = start;
+
+  while((0 <= master) || (0 <= log))
+  {
+    double now = GetMonotonicTime();
+    UpdatePrinter(&printer, now, now - last);
+    last = now;
+
+    // A full receive buffer stops reading, the filter sees it as a blocked write.
+    struct pollfd fds[2];
+    fds[0].fd = ((printer.level + 1) <= printer.capacity) ? master : -1;
+    fds[0].events = POLLIN;
+    fds[1].fd = log;
+    fds[1].events = POLLIN;
+
+    if((0 > poll(fds, 2, EPTMD_SIM_POLL_TIMEOUT)) && (EINTR != errno))
+    {
+      break;
+    }
+
+    unsigned char buffer[EPTMD_SIM_BUFFER_SIZE];
+
+    if((0 <= fds[0].fd) && (0 != fds[0].revents))
+    {
+      std::size_t room = static_cast<std::size_t>(printer.capacity - printer.level);
+      ssize_t length = read(master, buffer, (room < sizeof(buffer)) ? room : sizeof(buffer));
+
+      if(0 < length)
+      {
+        ReceiveData(&printer, buffer, static_cast<std::size_t>(length), GetMonotonicTime());
+      }
+      else if((0 == length) || ((EINTR != errno) && (EAGAIN != errno)))
+      {
+        // EIO once the filter has closed the terminal.
+        close(master);
+        master = -1;
+      }
+    }
+
+    if((0 <= log) && (0 != fds[1].revents))
+    {
+      ssize_t length = read(log, buffer, sizeof(buffer));
+
+      if(0 < length)
+      {
+        lines.append(reinterpret_cast<char *>(buffer), static_cast<std::size_t>(length));
+        ForwardLog(&lines, GetMonotonicTime() - start);
+      }
+      else if((0 == length) || (EINTR != errno))
+      {
+        close(log);
+        log = -1;
+      }
+    }
+  }
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+  double time = GetMonotonicTime() - start;
+
+  if(nullptr != p_output)
+  {
+    FILE *p_file = fopen(p_output, "wb");
+
+    if((nullptr == p_file) || (printer.data.size() != fwrite(printer.data.data(), 1, printer.data.size(), p_file)))
+    {
+      fprintf(stderr, "%s: cannot write %s\n", argv[0], p_output);
+      status = 1;
+    }
+
+    if(nullptr != p_file)
+    {
+      fclose(p_file);
+    }
+  }
+
+  printf("received %zu bytes in %.3f s, %llu status packets sent%s\n",
+         printer.data.size(), time, printer.statuses, printer.unknown ? ", unknown command" : "");
+  printf("offline %.3f s, %llu bytes received while offline, receive buffer peak %.0f of %.0f bytes\n",
+         printer.offlineTime, printer.offlineBytes, printer.peakLevel, printer.capacity);
+  return (WIFEXITED(status) && (0 == WEXITSTATUS(status))) ? 0 : 1;
+}
+
+// cover:bytes:ms, empty:bytes:ms or low:bytes
+static bool ParseEvent(const char *p_text, EPTMS_SIM_PRINTER_T *p_printer)
+{
+  if(EPTMD_SIM_MAX_EVENTS <= p_printer->eventCount)
+  {
+    return false;
+  }
+
+  EPTMS_SIM_EVENT_T *p_event = &p_printer->events[p_printer->eventCount];
+  unsigned long long offset = 0;
+  unsigned ms = 0;
+
+  if(2 == sscanf(p_text, "cover:%llu:%u", &offset, &ms))
+  {
+    p_event->type = TmSimCoverOpen;
+  }
+  else if(2 == sscanf(p_text, "empty:%llu:%u", &offset, &ms))
+  {
+    p_event->type = TmSimPaperEnd;
+  }
+  else if(1 == sscanf(p_text, "low:%llu", &offset))
+  {
+    p_event->type = TmSimNearEnd;
+  }
+  else
+  {
+    return false;
+  }
+
+  p_event->offset = offset;
+  p_event->duration = ms / 1e3;
+  p_event->end = 0;
+  p_printer->eventCount++;
+  return true;
+}
+
+// Runs the filter as CUPS would, its output goes to a terminal like a serial
+// printer and the back-channel is fd 3 of both processes.
+static pid_t StartFilter(char *argv[], const char *p_ppd, int *p_master, int *p_log)
+{
+  // Both ends are moved above fd 3, which is then taken by the write end
+  // before the other descriptors are opened.
+  int back[2];
+
+  if(0 != pipe(back))
+  {
+    return -1;
+  }
+
+  int reader = fcntl(back[0], F_DUPFD, CUPS_BC_FD + 1);
+  int writer = fcntl(back[1], F_DUPFD, CUPS_BC_FD + 1);
+  close(back[0]);
+  close(back[1]);
+
+  if((0 > reader) || (0 > writer) || (CUPS_BC_FD != dup2(writer, CUPS_BC_FD)))
+  {
+    return -1;
+  }
+
+  close(writer);
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+  if((0 > master) || (0 != grantpt(master)) || (0 != unlockpt(master)))
+  {
+    return -1;
+  }
+
+  int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+  struct termios settings;
+
+  if((0 > slave) || (0 != tcgetattr(slave, &settings)))
+  {
+    return -1;
+  }
+
+  cfmakeraw(&settings);
+  tcsetattr(slave, TCSANOW, &settings);
+  int log[2];
+
+  if(0 != pipe(log))
+  {
+    return -1;
+  }
+
+  pid_t pid = fork();
+
+  if(0 == pid)
+  {
+    dup2(slave, STDOUT_FILENO);
+    dup2(log[1], STDERR_FILENO);
+    dup2(reader, CUPS_BC_FD);
+    close(reader);
+    close(master);
+    close(slave);
+    close(log[0]);
+    close(log[1]);
+    setenv("PPD", p_ppd, 1);
+    execl(argv[0], "rastertotmt88v", "1", "sim", "sim", "1", argv[2], argv[3], (char *)nullptr);
+    _exit(127);
+  }
+
+  close(reader);
+  close(slave);
+  close(log[1]);
+  *p_master = master;
+  *p_log = log[0];
+  return pid;
+}
+
+static void ReceiveData(EPTMS_SIM_PRINTER_T *p_printer, const unsigned char *p_data, std::size_t length, double now)
+{
+  unsigned long long received = p_printer->data.size();
+  p_printer->data.insert(p_printer->data.end(), p_data, p_data + length);
+  p_printer->level += static_cast<double>(length);
+
+  if(IsOffline(p_printer))
+  {
+    p_printer->offlineBytes += length;
+  }
+
+  // Events start once their byte has been received.
+  for(unsigned i = 0; i < p_printer->eventCount; i++)
+  {
+    EPTMS_SIM_EVENT_T *p_event = &p_printer->events[i];
+
+    if((0 != p_event->end) || (p_event->offset < received) || (p_event->offset >= (received + length)))
+    {
+      continue;
+    }
+
+    p_event->end = now + p_event->duration;
+    p_printer->coverOpen |= (TmSimCoverOpen == p_event->type);
+    p_printer->paperEnd |= (TmSimPaperEnd == p_event->type);
+    p_printer->nearEnd |= (TmSimNearEnd == p_event->type);
+  }
+
+  DecodeCommands(p_printer);
+  SendStatus(p_printer, false);
+}
+
+// Prints from the receive buffer and ends the events that are over.
+static void UpdatePrinter(EPTMS_SIM_PRINTER_T *p_printer, double now, double elapsed)
+{
+  if(IsOffline(p_printer))
+  {
+    p_printer->offlineTime += elapsed;
+    p_printer->peakLevel = (p_printer->level > p_printer->peakLevel) ? p_printer->level : p_printer->peakLevel;
+  }
+  else
+  {
+    p_printer->level -= (p_printer->level < (p_printer->rate * elapsed)) ? p_printer->level : (p_printer->rate * elapsed);
+  }
+
+  for(unsigned i = 0; i < p_printer->eventCount; i++)
+  {
+    EPTMS_SIM_EVENT_T *p_event = &p_printer->events[i];
+
+    if((0 == p_event->end) || (now < p_event->end) || (TmSimNearEnd == p_event->type))
+    {
+      continue;
+    }
+
+    p_printer->coverOpen &= (TmSimCoverOpen != p_event->type);
+    p_printer->paperEnd &= (TmSimPaperEnd != p_event->type);
+    p_event->end = 0;
+    p_event->offset = ~0ULL;
+  }
+
+  SendStatus(p_printer, false);
+}
+
+// Follows the commands of the filter to find GS a and the NV graphics
+// commands outside of raster data.
+static void DecodeCommands(EPTMS_SIM_PRINTER_T *p_printer)
+{
+  while(!p_printer->unknown && (p_printer->parsed < p_printer->data.size()))
+  {
+    const unsigned char *p_data = p_printer->data.data() + p_printer->parsed;
+    std::size_t available = p_printer->data.size() - p_printer->parsed;
+    std::size_t length = GetCommandLength(p_data, available, &p_printer->unknown);
+
+    if((0 == length) || (length > available))
+    {
+      return;
+    }
+
+    p_printer->parsed += length;
+
+    // The status is sent at once when Automatic Status Back is enabled.
+    if((GS == p_data[0]) && ('a' == p_data[1]))
+    {
+      p_printer->statusBack = (0 != p_data[2]);
+      SendStatus(p_printer, true);
+    }
+
+    // GS ( L pL pH 48 fn: fn 67 defines kc1 kc2 after a, fn 66 deletes them,
+    // fn 64 asks for the key code list.
+    if((GS == p_data[0]) && ('(' == p_data[1]) && ('L' == p_data[2]) && (9 <= length) && (48 == p_data[5]))
+    {
+      if((67 == p_data[6]) && (10 <= length))
+      {
+        p_printer->nvKeys.insert(std::string(reinterpret_cast<const char *>(&p_data[8]), 2));
+      }
+      else if(66 == p_data[6])
+      {
+        p_printer->nvKeys.erase(std::string(reinterpret_cast<const char *>(&p_data[7]), 2));
+      }
+      else if(64 == p_data[6])
+      {
+        SendGraphicsKeys(p_printer);
+      }
+    }
+  }
+}
+
+// Length of the command, payload included, 0 until its parameters are received.
+// Only the commands of the filter are known.
+static std::size_t GetCommandLength(const unsigned char *p_data, std::size_t available, bool *p_unknown)
+{
+  if(2 > available)
+  {
+    return 0;
+  }
+
+  std::size_t length = (5 > available) ? 0 : (static_cast<std::size_t>(p_data[3]) | (static_cast<std::size_t>(p_data[4]) << 8));
+
+  if(ESC == p_data[0])
+  {
+    switch(p_data[1])
+    {
+    case '@':
+      return 2;
+
+    case '=':
+    case 'J':
+      return 3;
+
+    case 'c':
+    case '$':
+      return 4;
+
+    case 'p':
+      return 5;
+
+    case '(':
+      return (5 > available) ? 0 : (5 + length);
+
+    default:
+      break;
+    }
+  }
+  else if(GS == p_data[0])
+  {
+    switch(p_data[1])
+    {
+    case 'a':
+      return 3;
+
+    case 'P':
+      return 4;
+
+    case 'V':
+      return (3 > available) ? 0 : ((65 == p_data[2]) || (66 == p_data[2]) || (103 == p_data[2]) || (104 == p_data[2])) ? 4 : 3;
+
+    case '(':
+      return (5 > available) ? 0 : (5 + length);
+
+    case '8':
+      return (7 > available) ? 0 : 7 + (length | (static_cast<std::size_t>(p_data[5]) << 16) | (static_cast<std::size_t>(p_data[6]) << 24));
+
+    default:
+      break;
+    }
+  }
+
+  *p_unknown = true;
+  return 0;
+}
+
+static void SendStatus(EPTMS_SIM_PRINTER_T *p_printer, bool always)
+{
+  if(!p_printer->statusBack)
+  {
+    return;
+  }
+
+  // Offline and cover open in the first byte, near end and paper end in the third.
+  unsigned char status[4] = { 0x10, 0x00, 0x00, 0x00 };
+  status[0] = static_cast<unsigned char>(status[0] | (IsOffline(p_printer) ? 0x08 : 0x00) | (p_printer->coverOpen ? 0x20 : 0x00));
+  status[2] = static_cast<unsigned char>((p_printer->nearEnd ? 0x03 : 0x00) | (p_printer->paperEnd ? 0x0c : 0x00));
+
+  if(!always && (0 == memcmp(status, p_printer->sent, sizeof(status))))
+  {
+    return;
+  }
+
+  memcpy(p_printer->sent, status, sizeof(status));
+  cupsBackChannelWrite(reinterpret_cast<char *>(status), sizeof(status), 1.0);
+  p_printer->statuses++;
+}
+
+// The whole list in one block, status 40h.
+static void SendGraphicsKeys(EPTMS_SIM_PRINTER_T *p_printer)
+{
+  std::string list("\x37\x72\x40", 3);
+
+  for(const std::string &key : p_printer->nvKeys)
+  {
+    list += key;
+  }
+
+  list += '\0';
+  cupsBackChannelWrite(list.data(), list.size(), 1.0);
+}
+
+static bool IsOffline(const EPTMS_SIM_PRINTER_T *p_printer)
+{
+  return p_printer->coverOpen || p_printer->paperEnd;
+}
+
+// Shows the printer state and error messages of the filter with their time.
+static void ForwardLog(std::string *p_lines, double time)
+{
+  std::size_t end;
+
+  while(std::string::npos != (end = p_lines->find('\n')))
+  {
+    std::string line = p_lines->substr(0, end);
+    p_lines->erase(0, end + 1);
+
+    if((0 == line.compare(0, 7, "STATE: ")) || (0 == line.compare(0, 7, "ERROR: "))
+       || (0 == line.compare(0, 21, "DEBUG: printer status")))
+    {
+      printf("%8.3f %s\n", time, line.c_str());
+    }
+  }
+}
+
+static double GetMonotonicTime(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<double>(now.tv_sec) + (static_cast<double>(now.tv_nsec) / 1e9);
+}
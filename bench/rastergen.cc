@@ -0,0 +1,235 @@
+/******************************************************************************
+ *
+ * Epson TM-T88V Printer Driver for GNU/Linux
+ *
+ * Copyright (C) 2020 Grégory DAVID.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *****************************************************************************/
+#include <cups/raster.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+/*----------------
+ * MACRO (#define)
+ *----------------*/
+#define EPTMD_GEN_DPI (180) // Resolution of the TM-T88V.
+#define EPTMD_GEN_MM_TO_LINES(mm) ((unsigned)(((mm) * EPTMD_GEN_DPI) / 25.4))
+#define EPTMD_GEN_WIDTH_80 (512) // Printable dots of 80 mm paper.
+#define EPTMD_GEN_WIDTH_58 (360) // Printable dots of 58 mm paper.
+
+/*-----------------
+ * enum declaration
+ *-----------------*/
+typedef enum
+{
+  TmGenText = 0, // Receipt text lines with margins.
+  TmGenImage, // Dense dithered image.
+  TmGenPhoto, // 8 bit gray image, dithered by the filter.
+} EPTME_GEN_PATTERN; // Synthetic page content
+
+/*--------------------------------
+ * Structure prototype declaration
+ *--------------------------------*/
+typedef struct
+{
+  const char *p_name; // Raster file name.
+  unsigned width; // Dots per line.
+  unsigned length; // Page length in mm.
+  unsigned pages; // Pages of the job.
+  EPTME_GEN_PATTERN pattern;
+} EPTMS_GEN_JOB_T; // Synthetic job of the corpus
+
+/*--------------------------------------
+ * Static function prototype declaration
+ *--------------------------------------*/
+static bool WriteJob(const std::string &, const EPTMS_GEN_JOB_T *);
+static void FillLine(unsigned char *, unsigned, unsigned, unsigned, EPTME_GEN_PATTERN, unsigned *);
+
+static const EPTMS_GEN_JOB_T g_TmCorpus[] =
+{
+  { "receipt80", EPTMD_GEN_WIDTH_80, 200, 1, TmGenText },
+  { "receipt58", EPTMD_GEN_WIDTH_58, 200, 1, TmGenText },
+  { "roll80", EPTMD_GEN_WIDTH_80, 2000, 1, TmGenText },
+  { "roll58", EPTMD_GEN_WIDTH_58, 2000, 1, TmGenText },
+  { "image80", EPTMD_GEN_WIDTH_80, 200, 1, TmGenImage },
+  { "image58", EPTMD_GEN_WIDTH_58, 200, 1, TmGenImage },
+  { "multipage80", EPTMD_GEN_WIDTH_80, 200, 10, TmGenText },
+  { "photo80", EPTMD_GEN_WIDTH_80, 200, 1, TmGenPhoto },
+};
+
+int main(int argc, char *argv[])
+{
+  if(2 != argc)
+  {
+    fprintf(stderr, "Usage: %s directory\n", argv[0]);
+    return 1;
+  }
+
+  std::string directory = argv[1];
+  mkdir(directory.c_str(), 0755);
+
+  for(const EPTMS_GEN_JOB_T &job : g_TmCorpus)
+  {
+    std::string path = directory + "/" + job.p_name + ".ras";
+
+    if(!WriteJob(path, &job))
+    {
+      fprintf(stderr, "%s: cannot write %s\n", argv[0], path.c_str());
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static bool WriteJob(const std::string &path, const EPTMS_GEN_JOB_T *p_job)
+{
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if(0 > fd)
+  {
+    return false;
+  }
+
+  cups_raster_t *p_raster = cupsRasterOpen(fd, CUPS_RASTER_WRITE);
+  bool written = (nullptr != p_raster);
+  unsigned seed = 1;
+
+  for(unsigned page = 0; written && (page < p_job->pages); page++)
+  {
+    cups_page_header2_t header;
+    memset(&header, 0, sizeof(header));
+    header.HWResolution[0] = EPTMD_GEN_DPI;
+    header.HWResolution[1] = EPTMD_GEN_DPI;
+    header.PageSize[0] = (p_job->width * 72) / EPTMD_GEN_DPI;
+    header.PageSize[1] = (EPTMD_GEN_MM_TO_LINES(p_job->length) * 72) / EPTMD_GEN_DPI;
+    header.NumCopies = 1;
+    header.cupsWidth = p_job->width;
+    header.cupsHeight = EPTMD_GEN_MM_TO_LINES(p_job->length);
+    header.cupsBitsPerColor = (TmGenPhoto == p_job->pattern) ? 8 : 1;
+    header.cupsBitsPerPixel = header.cupsBitsPerColor;
+    header.cupsBytesPerLine = ((p_job->width * header.cupsBitsPerPixel) + 7) / 8;
+    header.cupsColorOrder = CUPS_ORDER_CHUNKED;
+    header.cupsColorSpace = (TmGenPhoto == p_job->pattern) ? CUPS_CSPACE_SW : CUPS_CSPACE_K;
+    header.cupsRowCount = 24;
+
+    if(0 == cupsRasterWriteHeader2(p_raster, &header))
+    {
+      written = false;
+      break;
+    }
+
+    std::vector<unsigned char> line(header.cupsBytesPerLine);
+
+    for(unsigned y = 0; y < header.cupsHeight; y++)
+    {
+      FillLine(line.data(), header.cupsBytesPerLine, y, header.cupsHeight, p_job->pattern, &seed);
+
+      if(header.cupsBytesPerLine != cupsRasterWritePixels(p_raster, line.data(), header.cupsBytesPerLine))
+      {
+        written = false;
+        break;
+      }
+    }
+  }
+
+  if(nullptr != p_raster)
+  {
+    cupsRasterClose(p_raster);
+  }
+
+  return (0 == close(fd)) && written;
+}
+
+static void FillLine(unsigned char *p_line, unsigned BytesPerLine, unsigned y, unsigned height, EPTME_GEN_PATTERN pattern, unsigned *p_seed)
+{
+  memset(p_line, 0, BytesPerLine);
+
+  if(TmGenPhoto == pattern)
+  {
+    // Diagonal gradient from white to black with a dark disc, 0 is black.
+    unsigned cx = BytesPerLine / 2;
+    unsigned cy = height / 2;
+    unsigned radius = BytesPerLine / 4;
+
+    for(unsigned x = 0; x < BytesPerLine; x++)
+    {
+      unsigned dx = (x > cx) ? (x - cx) : (cx - x);
+      unsigned dy = (y > cy) ? (y - cy) : (cy - y);
+      unsigned level = 255 - ((((x * 255) / BytesPerLine) + ((y * 255) / height)) / 2);
+
+      if(((dx * dx) + (dy * dy)) < (radius * radius))
+      {
+        level /= 4;
+      }
+
+      p_line[x] = (unsigned char)level;
+    }
+
+    return;
+  }
+
+  if(TmGenImage == pattern)
+  {
+    // Gradient with noise, dithered against a random threshold.
+    for(unsigned x = 0; x < (BytesPerLine * 8); x++)
+    {
+      *p_seed = (*p_seed * 1103515245u) + 12345u;
+
+      if(((*p_seed >> 16) % 256) < ((x * 256) / (BytesPerLine * 8)))
+      {
+        p_line[x / 8] |= (unsigned char)(0x80 >> (x % 8));
+      }
+    }
+
+    return;
+  }
+
+  // 24 dot text lines separated by 8 dot spacing, 5 mm margins, a few
+  // longer gaps between paragraphs.
+  unsigned margin = EPTMD_GEN_MM_TO_LINES(5);
+  unsigned row = y / 32;
+
+  if((y < margin) || ((y + margin) >= height) || (24 <= (y % 32)) || (7 == (row % 8)))
+  {
+    return;
+  }
+
+  // Words of random length with random glyph columns.
+  unsigned x = 1;
+  unsigned seed = (row * 2654435761u) + 1;
+
+  while(x < (BytesPerLine - 1))
+  {
+    seed = (seed * 1103515245u) + 12345u;
+    unsigned word = 1 + ((seed >> 16) % 6);
+
+    for(unsigned i = 0; (i < word) && (x < (BytesPerLine - 1)); i++, x++)
+    {
+      *p_seed = (*p_seed * 1103515245u) + 12345u;
+      p_line[x] = (unsigned char)(*p_seed >> 16);
+    }
+
+    x++; // space
+  }
+}
@@ -0,0 +1,805 @@
+/******************************************************************************
+ *
+ * Epson TM-T88V Printer Driver for GNU/Linux
+ *
+ * Copyright (C) 2020 Grégory DAVID.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *****************************************************************************/
+#include "rasterkernel.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define EPTMD_RASTER_KERNEL_X86
+#include <immintrin.h>
+#endif
+
+/*--------------------------------------
+ * Disturbing data (real-time commands)
+ *--------------------------------------*/
+#define DLE (0x10)
+#define ESC (0x1b)
+#define GS (0x1d)
+
+// Checks one candidate byte, p_data[i + 1] must be readable. Bytes are never
+// written to a value that changes the check of their neighbours, so the
+// candidates of a block can be checked in any grouping.
+static inline void AvoidDisturbingByte(unsigned char *p_data, unsigned long i)
+{
+  if(IsDisturbingPair(p_data[i], p_data[i + 1]))
+  {
+    p_data[i] = (DLE == p_data[i]) ? 0x30 : 0x3B;
+  }
+}
+
+static void AvoidDisturbingDataTail(unsigned char *p_data, unsigned long i, unsigned long data_size)
+{
+  for(; (i + 1) < data_size; i++)
+  {
+    AvoidDisturbingByte(p_data, i);
+  }
+}
+
+/*----------------------------------
+ * Line width of the kernel templates
+ *----------------------------------*/
+// Kernels instantiated for a width ignore BytesPerLine, the compiler unrolls
+// their line loops. Width 0 is the kernel for any width.
+#define EPTMD_KERNEL_BYTES(Width, BytesPerLine) ((0 != (Width)) ? (Width) : (BytesPerLine))
+
+template <unsigned Width>
+static void CopyLine(unsigned char *p_dest, const unsigned char *p_data, unsigned BytesPerLine)
+{
+  memcpy(p_dest, p_data, EPTMD_KERNEL_BYTES(Width, BytesPerLine));
+}
+
+/*------------------------------
+ * Ink columns (blocks of bytes)
+ *------------------------------*/
+// FindInkBytes returns bit n set if byte x + n is not 0x00 in some line.
+typedef unsigned (*EPTMS_INK_BYTES_T)(const unsigned char *p_data, unsigned BytesPerLine, unsigned lines, unsigned x);
+
+// Scans blocks inwards from both edges, only the blocks up to the first ink
+// of each side are read. BytesPerLine must be at least one block.
+static void FindInkColumnsInBlocks(EPTMS_INK_BYTES_T FindInkBytes, unsigned block, const unsigned char *p_data,
+                                   unsigned BytesPerLine, unsigned lines, unsigned *p_left, unsigned *p_right)
+{
+  unsigned mask = 0;
+  unsigned x = 0;
+
+  for(unsigned left = 0; (0 == mask) && (left < BytesPerLine); left += block)
+  {
+    x = ((left + block) <= BytesPerLine) ? left : (BytesPerLine - block); // Tail overlaps blank bytes already read.
+    mask = FindInkBytes(p_data, BytesPerLine, lines, x);
+  }
+
+  if(0 == mask)
+  {
+    *p_left = 0;
+    *p_right = 0;
+    return;
+  }
+
+  *p_left = x + static_cast<unsigned>(__builtin_ctz(mask));
+
+  for(unsigned right = BytesPerLine; ; right = x)
+  {
+    x = (block <= right) ? (right - block) : 0;
+    mask = FindInkBytes(p_data, BytesPerLine, lines, x);
+
+    if(0 != mask)
+    {
+      *p_right = x + 32 - static_cast<unsigned>(__builtin_clz(mask));
+      return;
+    }
+  }
+}
+
+static unsigned FindInkBytesBytewise(const unsigned char *p_data, unsigned BytesPerLine, unsigned lines, unsigned x)
+{
+  for(unsigned y = 0; y < lines; y++, p_data += BytesPerLine)
+  {
+    if(0x00 != p_data[x])
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*-----------------------------
+ * Ordered dither (8x8 Bayer)
+ *-----------------------------*/
+// Pixels at or below the threshold print black, a line of the matrix is
+// repeated to fill a 32 byte vector.
+alignas(32) static const unsigned char g_TmBayerThresholds[8][32] =
+{
+  {   1, 129,  33, 161,   9, 137,  41, 169,   1, 129,  33, 161,   9, 137,  41, 169,   1, 129,  33, 161,   9, 137,  41, 169,   1, 129,  33, 161,   9, 137,  41, 169 },
+  { 193,  65, 225,  97, 201,  73, 233, 105, 193,  65, 225,  97, 201,  73, 233, 105, 193,  65, 225,  97, 201,  73, 233, 105, 193,  65, 225,  97, 201,  73, 233, 105 },
+  {  49, 177,  17, 145,  57, 185,  25, 153,  49, 177,  17, 145,  57, 185,  25, 153,  49, 177,  17, 145,  57, 185,  25, 153,  49, 177,  17, 145,  57, 185,  25, 153 },
+  { 241, 113, 209,  81, 249, 121, 217,  89, 241, 113, 209,  81, 249, 121, 217,  89, 241, 113, 209,  81, 249, 121, 217,  89, 241, 113, 209,  81, 249, 121, 217,  89 },
+  {  13, 141,  45, 173,   5, 133,  37, 165,  13, 141,  45, 173,   5, 133,  37, 165,  13, 141,  45, 173,   5, 133,  37, 165,  13, 141,  45, 173,   5, 133,  37, 165 },
+  { 205,  77, 237, 109, 197,  69, 229, 101, 205,  77, 237, 109, 197,  69, 229, 101, 205,  77, 237, 109, 197,  69, 229, 101, 205,  77, 237, 109, 197,  69, 229, 101 },
+  {  61, 189,  29, 157,  53, 181,  21, 149,  61, 189,  29, 157,  53, 181,  21, 149,  61, 189,  29, 157,  53, 181,  21, 149,  61, 189,  29, 157,  53, 181,  21, 149 },
+  { 253, 125, 221,  93, 245, 117, 213,  85, 253, 125, 221,  93, 245, 117, 213,  85, 253, 125, 221,  93, 245, 117, 213,  85, 253, 125, 221,  93, 245, 117, 213,  85 },
+};
+
+static inline unsigned char ReverseBits(unsigned char bits)
+{
+  bits = (unsigned char)(((bits & 0xf0) >> 4) | ((bits & 0x0f) << 4));
+  bits = (unsigned char)(((bits & 0xcc) >> 2) | ((bits & 0x33) << 2));
+  return (unsigned char)(((bits & 0xaa) >> 1) | ((bits & 0x55) << 1));
+}
+
+// Dithers the pixels from x, which must be a multiple of 8.
+static void DitherOrderedTail(const unsigned char *p_gray, unsigned x, unsigned width, unsigned y, unsigned char invert, unsigned char *p_line)
+{
+  const unsigned char *p_threshold = g_TmBayerThresholds[y % 8];
+
+  for(; x < width; x += 8)
+  {
+    unsigned count = ((width - x) < 8) ? (width - x) : 8;
+    unsigned char bits = 0;
+
+    for(unsigned n = 0; n < count; n++)
+    {
+      if((unsigned char)(p_gray[x + n] ^ invert) <= p_threshold[n])
+      {
+        bits = (unsigned char)(bits | (0x80 >> n));
+      }
+    }
+
+    p_line[x / 8] = bits;
+  }
+}
+
+/*----------------------------
+ * Portable kernel (64bit words)
+ *----------------------------*/
+template <unsigned Width>
+static inline bool IsBlankLineGeneric(const unsigned char *p_data, unsigned BytesPerLine)
+{
+  BytesPerLine = EPTMD_KERNEL_BYTES(Width, BytesPerLine);
+  std::uint64_t accumulator = 0;
+  std::uint64_t word;
+  unsigned x = 0;
+
+  if(sizeof(word) > BytesPerLine)
+  {
+    for(; x < BytesPerLine; x++)
+    {
+      accumulator |= p_data[x];
+    }
+
+    return 0 == accumulator;
+  }
+
+  for(; (x + sizeof(word)) <= BytesPerLine; x += sizeof(word))
+  {
+    memcpy(&word, p_data + x, sizeof(word));
+    accumulator |= word;
+  }
+
+  if(x < BytesPerLine) // Tail overlaps the last full word.
+  {
+    memcpy(&word, p_data + BytesPerLine - sizeof(word), sizeof(word));
+    accumulator |= word;
+  }
+
+  return 0 == accumulator;
+}
+
+static void AvoidDisturbingDataGeneric(unsigned char *p_data, unsigned long data_size)
+{
+  const std::uint64_t ones = 0x0101010101010101ull;
+  const std::uint64_t highs = 0x8080808080808080ull;
+  unsigned long i = 0;
+
+  for(; (i + sizeof(std::uint64_t)) < data_size; i += sizeof(std::uint64_t))
+  {
+    std::uint64_t word;
+    memcpy(&word, p_data + i, sizeof(word));
+    // Has a zero byte after xor with DLE or ESC.
+    std::uint64_t dle = word ^ (ones * DLE);
+    std::uint64_t esc = word ^ (ones * ESC);
+
+    if(0 == ((((dle - ones) & ~dle) | ((esc - ones) & ~esc)) & highs))
+    {
+      continue;
+    }
+
+    for(unsigned long n = i; n < (i + sizeof(std::uint64_t)); n++)
+    {
+      AvoidDisturbingByte(p_data, n);
+    }
+  }
+
+  AvoidDisturbingDataTail(p_data, i, data_size);
+}
+
+template <unsigned Width>
+static unsigned FindBlankLinesGeneric(const unsigned char *p_data, unsigned BytesPerLine, unsigned lines, std::uint64_t *p_bitmap)
+{
+  BytesPerLine = EPTMD_KERNEL_BYTES(Width, BytesPerLine);
+  unsigned blank_lines = 0;
+  unsigned line_no;
+
+  for(line_no = 0; line_no < lines; line_no += 64)
+  {
+    unsigned count = ((lines - line_no) < 64) ? (lines - line_no) : 64;
+    std::uint64_t bits = 0;
+    unsigned n;
+
+    for(n = 0; n < count; n++)
+    {
+      if(IsBlankLineGeneric<Width>(p_data, BytesPerLine))
+      {
+        bits |= (std::uint64_t)1 << n;
+      }
+
+      p_data += BytesPerLine;
+    }
+
+    blank_lines += static_cast<unsigned>(__builtin_popcountll(bits));
+
+    if(64 > count) // Lines past the page are blank.
+    {
+      bits |= ~(std::uint64_t)0 << count;
+    }
+
+    p_bitmap[line_no / 64] = bits;
+  }
+
+  return blank_lines;
+}
+
+template <unsigned Width>
+static unsigned FindInkBytesGeneric(const unsigned char *p_data, unsigned BytesPerLine, unsigned lines, unsigned x)
+{
+  BytesPerLine = EPTMD_KERNEL_BYTES(Width, BytesPerLine);
+  std::uint64_t accumulator = 0;
+  std::uint64_t word;
+
+  for(unsigned y = 0; y < lines; y++, p_data += BytesPerLine)
+  {
+    memcpy(&word, p_data + x, sizeof(word));
+    accumulator |= word;
+  }
+
+  unsigned char bytes[sizeof(accumulator)];
+  unsigned mask = 0;
+  memcpy(bytes, &accumulator, sizeof(bytes));
+
+  for(unsigned n = 0; n < sizeof(bytes); n++)
+  {
+    if(0x00 != bytes[n])
+    {
+      mask |= 1u << n;
+    }
+  }
+
+  return mask;
+}
+
+static void DitherOrderedGeneric(const unsigned char *p_gray, unsigned width, unsigned y, unsigned char invert, unsigned char *p_line)
+{
+  DitherOrderedTail(p_gray, 0, width, y, invert, p_line);
+}
+
+template <unsigned Width>
+static void FindInkColumnsGeneric(const unsigned char *p_data, unsigned BytesPerLine, unsigned lines, unsigned *p_left, unsigned *p_right)
+{
+  BytesPerLine = EPTMD_KERNEL_BYTES(Width, BytesPerLine);
+  if(sizeof(std::uint64_t) > BytesPerLine)
+  {
+    FindInkColumnsInBlocks(FindInkBytesBytewise, 1, p_data, BytesPerLine, lines, p_left, p_right);
+    return;
+  }
+
+  FindInkColumnsInBlocks(FindInkBytesGeneric<Width>, sizeof(std::uint64_t), p_data, BytesPerLine, lines, p_left, p_right);
+}
+
+#ifdef EPTMD_RASTER_KERNEL_X86
+/*-------------
+ * SSE2 kernel
+ *-------------*/
+template <unsigned Width>
+__attribute__((target("sse2")))
+static inline bool IsBlankLineSSE2(const unsigned char *p_data, unsigned BytesPerLine)
+{
+  BytesPerLine = EPTMD_KERNEL_BYTES(Width, BytesPerLine);
+  if(16 > BytesPerLine)
+  {
+    return IsBlankLineGeneric<Width>(p_data, BytesPerLine);
+  }
+
+  __m128i accumulator = _mm_setzero_si128();
+  unsigned x = 0;
+
+  for(; (x + 16) <= BytesPerLine; x += 16)
+  {
+    accumulator = _mm_or_si128(accumulator, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p_data + x)));
+  }
+
+  if(x < BytesPerLine) // Tail overlaps the last full vector.
+  {
+    accumulator = _mm_or_si128(accumulator, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p_data + BytesPerLine - 16)));
+  }
+
+  return 0xffff == _mm_movemask_epi8(_mm_cmpeq_epi8(accumulator, _mm_setzero_si128()));
+}
+
+template <unsigned Width>
+__attribute__((target("sse2")))
+static unsigned FindBlankLinesSSE2(const unsigned char *p_data, unsigned BytesPerLine, unsigned lines, std::uint64_t *p_bitmap)
+{
+  BytesPerLine = EPTMD_KERNEL_BYTES(Width, BytesPerLine);
+  unsigned blank_lines = 0;
+  unsigned line_no;
+
+  for(line_no = 0; line_no < lines; line_no += 64)
+  {
+    unsigned count = ((lines - line_no) < 64) ? (lines - line_no) : 64;
+    std::uint64_t bits = 0;
+    unsigned n;
+
+    for(n = 0; n < count; n++)
+    {
+      if(IsBlankLineSSE2<Width>(p_data, BytesPerLine))
+      {
+        bits |= (std::uint64_t)1 << n;
+      }
+
+      p_data += BytesPerLine;
+    }
+
+    blank_lines += static_cast<unsigned>(__builtin_popcountll(bits));
+
+    if(64 > count) // Lines past the page are blank.
+    {
+      bits |= ~(std::uint64_t)0 << count;
+    }
+
+    p_bitmap[line_no / 64] = bits;
+  }
+
+  return blank_lines;
+}
+
+__attribute__((target("sse2")))
+static void AvoidDisturbingDataSSE2(unsigned char *p_data, unsigned long data_size)
+{
+  const __m128i dle = _mm_set1_epi8(DLE);
+  const __m128i esc = _mm_set1_epi8(ESC);
+  unsigned long i = 0;
+
+  for(; (i + 16) < data_size; i += 16)
+  {
+    __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p_data + i));
+    unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(data, dle), _mm_cmpeq_epi8(data, esc))));
+
+    for(; 0 != mask; mask &= mask - 1)
+    {
+      AvoidDisturbingByte(p_data, i + static_cast<unsigned>(__builtin_ctz(mask)));
+    }
+  }
+
+  AvoidDisturbingDataTail(p_data, i, data_size);
+}
+
+template <unsigned Width>
+__attribute__((target("sse2")))
+static unsigned FindInkBytesSSE2(const unsigned char *p_data, unsigned BytesPerLine, unsigned lines, unsigned x)
+{
+  BytesPerLine = EPTMD_KERNEL_BYTES(Width, BytesPerLine);
+  __m128i accumulator = _mm_setzero_si128();
+
+  for(unsigned y = 0; y < lines; y++, p_data += BytesPerLine)
+  {
+    accumulator = _mm_or_si128(accumulator, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p_data + x)));
+  }
+
+  return ~static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(accumulator, _mm_setzero_si128()))) & 0xffff;
+}
+
+__attribute__((target("sse2")))
+static void DitherOrderedSSE2(const unsigned char *p_gray, unsigned width, unsigned y, unsigned char invert, unsigned char *p_line)
+{
+  const __m128i threshold = _mm_load_si128(reinterpret_cast<const __m128i *>(g_TmBayerThresholds[y % 8]));
+  const __m128i flip = _mm_set1_epi8(static_cast<char>(invert));
+  unsigned x = 0;
+
+  for(; (x + 16) <= width; x += 16)
+  {
+    __m128i gray = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p_gray + x)), flip);
+    unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(gray, threshold), gray)));
+    p_line[x / 8] = ReverseBits(static_cast<unsigned char>(mask));
+    p_line[(x / 8) + 1] = ReverseBits(static_cast<unsigned char>(mask >> 8));
+  }
+
+  DitherOrderedTail(p_gray, x, width, y, invert, p_line);
+}
+
+template <unsigned Width>
+static void FindInkColumnsSSE2(const unsigned char *p_data, unsigned BytesPerLine, unsigned lines, unsigned *p_left, unsigned *p_right)
+{
+  BytesPerLine = EPTMD_KERNEL_BYTES(Width, BytesPerLine);
+  if(16 > BytesPerLine)
+  {
+    FindInkColumnsGeneric<Width>(p_data, BytesPerLine, lines, p_left, p_right);
+    return;
+  }
+
+  FindInkColumnsInBlocks(FindInkBytesSSE2<Width>, 16, p_data, BytesPerLine, lines, p_left, p_right);
+}
+
+template <unsigned Width>
+static bool IsBlankLineSSE2Entry(const unsigned char *p_data, unsigned BytesPerLine)
+{
+  return IsBlankLineSSE2<Width>(p_data, BytesPerLine);
+}
+
+/*-------------
+ * AVX2 kernel
+ *-------------*/
+template <unsigned Width>
+__attribute__((target("avx2")))
+static inline bool IsBlankLineAVX2(const unsigned char *p_data, unsigned BytesPerLine)
+{
+  BytesPerLine = EPTMD_KERNEL_BYTES(Width, BytesPerLine);
+  if(32 > BytesPerLine)
+  {
+    return IsBlankLineSSE2<Width>(p_data, BytesPerLine);
+  }
+
+  __m256i accumulator = _mm256_setzero_si256();
+  unsigned x = 0;
+
+  for(; (x + 32) <= BytesPerLine; x += 32)
+  {
+    accumulator = _mm256_or_si256(accumulator, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p_data + x)));
+  }
+
+  if(x < BytesPerLine) // Tail overlaps the last full vector.
+  {
+    accumulator = _mm256_or_si256(accumulator, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p_data + BytesPerLine - 32)));
+  }
+
+  return 0 != _mm256_testz_si256(accumulator, accumulator);
+}
+
+template <unsigned Width>
+__attribute__((target("avx2")))
+static unsigned FindBlankLinesAVX2(const unsigned char *p_data, unsigned BytesPerLine, unsigned lines, std::uint64_t *p_bitmap)
+{
+  BytesPerLine = EPTMD_KERNEL_BYTES(Width, BytesPerLine);
+  unsigned blank_lines = 0;
+  unsigned line_no;
+
+  for(line_no = 0; line_no < lines; line_no += 64)
+  {
+    unsigned count = ((lines - line_no) < 64) ? (lines - line_no) : 64;
+    std::uint64_t bits = 0;
+    unsigned n;
+
+    for(n = 0; n < count; n++)
+    {
+      if(IsBlankLineAVX2<Width>(p_data, BytesPerLine))
+      {
+        bits |= (std::uint64_t)1 << n;
+      }
+
+      p_data += BytesPerLine;
+    }
+
+    blank_lines += static_cast<unsigned>(__builtin_popcountll(bits));
+
+    if(64 > count) // Lines past the page are blank.
+    {
+      bits |= ~(std::uint64_t)0 << count;
+    }
+
+    p_bitmap[line_no / 64] = bits;
+  }
+
+  return blank_lines;
+}
+
+__attribute__((target("avx2")))
+static void AvoidDisturbingDataAVX2(unsigned char *p_data, unsigned long data_size)
+{
+  const __m256i dle = _mm256_set1_epi8(DLE);
+  const __m256i esc = _mm256_set1_epi8(ESC);
+  unsigned long i = 0;
+
+  for(; (i + 32) < data_size; i += 32)
+  {
+    __m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p_data + i));
+    unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(data, dle), _mm256_cmpeq_epi8(data, esc))));
+
+    for(; 0 != mask; mask &= mask - 1)
+    {
+      AvoidDisturbingByte(p_data, i + static_cast<unsigned>(__builtin_ctz(mask)));
+    }
+  }
+
+  AvoidDisturbingDataTail(p_data, i, data_size);
+}
+
+template <unsigned Width>
+__attribute__((target("avx2")))
+static unsigned FindInkBytesAVX2(const unsigned char *p_data, unsigned BytesPerLine, unsigned lines, unsigned x)
+{
+  BytesPerLine = EPTMD_KERNEL_BYTES(Width, BytesPerLine);
+  __m256i accumulator = _mm256_setzero_si256();
+
+  for(unsigned y = 0; y < lines; y++, p_data += BytesPerLine)
+  {
+    accumulator = _mm256_or_si256(accumulator, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p_data + x)));
+  }
+
+  return ~static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(accumulator, _mm256_setzero_si256())));
+}
+
+__attribute__((target("avx2")))
+static void DitherOrderedAVX2(const unsigned char *p_gray, unsigned width, unsigned y, unsigned char invert, unsigned char *p_line)
+{
+  // Pixels are reversed in each group of 8 so that movemask yields MSB first bytes.
+  const __m256i reverse = _mm256_set_epi8(8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7,
+                                          8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i threshold = _mm256_shuffle_epi8(_mm256_load_si256(reinterpret_cast<const __m256i *>(g_TmBayerThresholds[y % 8])), reverse);
+  const __m256i flip = _mm256_set1_epi8(static_cast<char>(invert));
+  unsigned x = 0;
+
+  for(; (x + 32) <= width; x += 32)
+  {
+    __m256i gray = _mm256_shuffle_epi8(_mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p_gray + x)), flip), reverse);
+    std::uint32_t mask = static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(gray, threshold), gray)));
+
+    for(unsigned n = 0; n < 4; n++)
+    {
+      p_line[(x / 8) + n] = static_cast<unsigned char>(mask >> (n * 8));
+    }
+  }
+
+  DitherOrderedTail(p_gray, x, width, y, invert, p_line);
+}
+
+template <unsigned Width>
+static void FindInkColumnsAVX2(const unsigned char *p_data, unsigned BytesPerLine, unsigned lines, unsigned *p_left, unsigned *p_right)
+{
+  BytesPerLine = EPTMD_KERNEL_BYTES(Width, BytesPerLine);
+  if(32 > BytesPerLine)
+  {
+    FindInkColumnsSSE2<Width>(p_data, BytesPerLine, lines, p_left, p_right);
+    return;
+  }
+
+  FindInkColumnsInBlocks(FindInkBytesAVX2<Width>, 32, p_data, BytesPerLine, lines, p_left, p_right);
+}
+
+template <unsigned Width>
+__attribute__((target("avx2")))
+static bool IsBlankLineAVX2Entry(const unsigned char *p_data, unsigned BytesPerLine)
+{
+  return IsBlankLineAVX2<Width>(p_data, BytesPerLine);
+}
+#endif // EPTMD_RASTER_KERNEL_X86
+
+template <unsigned Width>
+static bool IsBlankLineGenericEntry(const unsigned char *p_data, unsigned BytesPerLine)
+{
+  return IsBlankLineGeneric<Width>(p_data, BytesPerLine);
+}
+
+/*--------------------
+ * Kernel dispatching
+ *--------------------*/
+// Kernel of an instruction set for lines of Width bytes, 0 for any width.
+#define EPTMD_RASTER_KERNEL(name, isa, Width) \
+  { name, Width, IsBlankLine##isa##Entry<Width>, FindBlankLines##isa<Width>, AvoidDisturbingData##isa, \
+    FindInkColumns##isa<Width>, DitherOrdered##isa, CopyLine<Width> }
+
+static const EPTMS_RASTER_KERNEL_T g_RasterKernels[] =
+{
+  EPTMD_RASTER_KERNEL("generic", Generic, 0),
+#ifdef EPTMD_RASTER_KERNEL_X86
+  EPTMD_RASTER_KERNEL("sse2", SSE2, 0),
+  EPTMD_RASTER_KERNEL("avx2", AVX2, 0),
+#endif
+};
+
+// Same instruction sets as g_RasterKernels, for the widths of the rolls.
+static const EPTMS_RASTER_KERNEL_T g_RasterWidthKernels[][EPTMD_RASTER_WIDTHS] =
+{
+  { EPTMD_RASTER_KERNEL("generic", Generic, EPTMD_RASTER_WIDTH_80), EPTMD_RASTER_KERNEL("generic", Generic, EPTMD_RASTER_WIDTH_58) },
+#ifdef EPTMD_RASTER_KERNEL_X86
+  { EPTMD_RASTER_KERNEL("sse2", SSE2, EPTMD_RASTER_WIDTH_80), EPTMD_RASTER_KERNEL("sse2", SSE2, EPTMD_RASTER_WIDTH_58) },
+  { EPTMD_RASTER_KERNEL("avx2", AVX2, EPTMD_RASTER_WIDTH_80), EPTMD_RASTER_KERNEL("avx2", AVX2, EPTMD_RASTER_WIDTH_58) },
+#endif
+};
+
+static unsigned CountRasterKernels(void)
+{
+  unsigned count = 1;
+#ifdef EPTMD_RASTER_KERNEL_X86
+  __builtin_cpu_init();
+
+  if(__builtin_cpu_supports("sse2"))
+  {
+    count = 2;
+
+    if(__builtin_cpu_supports("avx2"))
+    {
+      count = 3;
+    }
+  }
+
+#endif
+  return count;
+}
+
+const EPTMS_RASTER_KERNEL_T *GetRasterKernels(unsigned *p_count)
+{
+  static const unsigned count = CountRasterKernels();
+  *p_count = count;
+  return g_RasterKernels;
+}
+
+const EPTMS_RASTER_KERNEL_T *GetRasterKernel(void)
+{
+  // Kernels are ordered from the most portable to the fastest.
+  static const EPTMS_RASTER_KERNEL_T *p_kernel = &g_RasterKernels[CountRasterKernels() - 1];
+  return p_kernel;
+}
+
+const EPTMS_RASTER_KERNEL_T *GetRasterKernelForWidth(const EPTMS_RASTER_KERNEL_T *p_kernel, unsigned BytesPerLine)
+{
+  for(unsigned k = 0; k < (sizeof(g_RasterKernels) / sizeof(g_RasterKernels[0])); k++)
+  {
+    if(p_kernel != &g_RasterKernels[k])
+    {
+      continue;
+    }
+
+    for(const EPTMS_RASTER_KERNEL_T &width_kernel : g_RasterWidthKernels[k])
+    {
+      if(BytesPerLine == width_kernel.BytesPerLine)
+      {
+        return &width_kernel;
+      }
+    }
+  }
+
+  return p_kernel;
+}
+
+bool IsBlankRasterLine(const unsigned char *p_data, unsigned BytesPerLine)
+{
+  return GetRasterKernel()->IsBlankLine(p_data, BytesPerLine);
+}
+
+unsigned FindBlankRasterLines(const unsigned char *p_data, unsigned BytesPerLine, unsigned lines, std::uint64_t *p_bitmap)
+{
+  return GetRasterKernel()->FindBlankLines(p_data, BytesPerLine, lines, p_bitmap);
+}
+
+void AvoidDisturbingRasterData(unsigned char *p_data, unsigned long data_size)
+{
+  GetRasterKernel()->AvoidDisturbingData(p_data, data_size);
+}
+
+void FindInkRasterColumns(const unsigned char *p_data, unsigned BytesPerLine, unsigned lines, unsigned *p_left, unsigned *p_right)
+{
+  GetRasterKernel()->FindInkColumns(p_data, BytesPerLine, lines, p_left, p_right);
+}
+
+void DitherOrderedRasterLine(const unsigned char *p_gray, unsigned width, unsigned y, unsigned char invert, unsigned char *p_line)
+{
+  GetRasterKernel()->DitherOrdered(p_gray, width, y, invert, p_line);
+}
+
+unsigned FindBlackRasterLineTop(const std::uint64_t *p_blankLines, unsigned lines)
+{
+  unsigned words = EPTMD_BITMAP_WORDS(lines);
+  unsigned w;
+
+  for(w = 0; w < words; w++)
+  {
+    if(~(std::uint64_t)0 != p_blankLines[w])
+    {
+      return (w * 64) + static_cast<unsigned>(__builtin_ctzll(~p_blankLines[w]));
+    }
+  }
+
+  return lines;
+}
+
+unsigned FindBlackRasterLineEnd(const std::uint64_t *p_blankLines, unsigned lines)
+{
+  unsigned w = EPTMD_BITMAP_WORDS(lines);
+
+  while(0 < w)
+  {
+    w--;
+
+    if(~(std::uint64_t)0 != p_blankLines[w])
+    {
+      return (w * 64) + 63 - static_cast<unsigned>(__builtin_clzll(~p_blankLines[w]));
+    }
+  }
+
+  return 0;
+}
+
+// GS 8 L fn 112: p L is the size of the parameters and the data, xL xH the
+// width in dots, yL yH the lines.
+void EncodeRasterBandHeader(unsigned char *p_command, unsigned long width, unsigned lines)
+{
+  static const unsigned char command[EPTMD_BAND_HEADER_SIZE] = { GS, '8', 'L', 0, 0, 0, 0, 48, 112, 48, 1, 1, 49, 0, 0, 0, 0 };
+  unsigned long size = (((width + 7) / 8) * lines) + 10;
+  memcpy(p_command, command, sizeof(command));
+  p_command[3] = (unsigned char)(size & 0xff);
+  p_command[4] = (unsigned char)((size >> 8) & 0xff);
+  p_command[5] = (unsigned char)((size >> 16) & 0xff);
+  p_command[6] = (unsigned char)((size >> 24) & 0xff);
+  p_command[13] = (unsigned char)(width & 0xff);
+  p_command[14] = (unsigned char)((width >> 8) & 0xff);
+  p_command[15] = (unsigned char)(lines & 0xff);
+  p_command[16] = (unsigned char)((lines >> 8) & 0xff);
+}
+
+// Floyd-Steinberg, p_errors[x + 1] holds the error carried to pixel x of this
+// line and is replaced by the error carried to pixel x of the next line.
+void DitherDiffusionRasterLine(const unsigned char *p_gray, unsigned width, unsigned char invert, int *p_errors, unsigned char *p_line)
+{
+  int right = 0; // 7/16 to the next pixel
+  int below = 0; // 1/16 + 5/16 to the pixel below the previous one
+  int below_right = 0; // 1/16 to the pixel below this one
+  unsigned char bits = 0;
+
+  for(unsigned x = 0; x < width; x++)
+  {
+    int value = (p_gray[x] ^ invert) + right + p_errors[x + 1];
+    bool black = value < 128;
+    int error = black ? value : (value - 255);
+
+    if(black)
+    {
+      bits = (unsigned char)(bits | (0x80 >> (x % 8)));
+    }
+
+    if(7 == (x % 8))
+    {
+      p_line[x / 8] = bits;
+      bits = 0;
+    }
+
+    right = (error * 7) / 16;
+    p_errors[x] = below + ((error * 3) / 16);
+    below = below_right + ((error * 5) / 16);
+    below_right = error / 16;
+  }
+
+  p_errors[width] = below;
+
+  if(0 != (width % 8))
+  {
+    p_line[width / 8] = bits;
+  }
+}
@@ -0,0 +1,100 @@
+/******************************************************************************
+ *
+ * Epson TM-T88V Printer Driver for GNU/Linux
+ *
+ * Copyright (C) 2020 Grégory DAVID.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *****************************************************************************/
+#ifndef RASTERKERNEL_H
+#define RASTERKERNEL_H
+
+#include <cstdint>
+
+/*----------------
+ * MACRO (#define)
+ *----------------*/
+#define EPTMD_BITMAP_WORDS(lines) (((lines) + 63) / 64)
+// Bytes per line of the rolls, 512 and 360 dots, their kernels are built for
+// that width.
+#define EPTMD_RASTER_WIDTH_80 (64)
+#define EPTMD_RASTER_WIDTH_58 (45)
+#define EPTMD_RASTER_WIDTHS (2)
+#define EPTMD_BAND_HEADER_SIZE (17) // GS 8 L fn 112 up to the raster data.
+
+/*--------------------------------
+ * Structure prototype declaration
+ *--------------------------------*/
+typedef struct
+{
+  const char *p_name; // Instruction set of the kernel.
+  unsigned BytesPerLine; // Line width the kernel is built for, 0 for any width.
+  // Returns true if all bytes of the raster line are 0x00.
+  bool (*IsBlankLine)(const unsigned char *p_data, unsigned BytesPerLine);
+  // Sets one bit per blank line in bitmap, bits past the last line are set too.
+  // Returns the number of blank lines.
+  unsigned (*FindBlankLines)(const unsigned char *p_data, unsigned BytesPerLine, unsigned lines, std::uint64_t *p_bitmap);
+  // Breaks DLE EOT/ENQ/DC4 and ESC = pairs, the last byte is only read as the
+  // second byte of a pair.
+  void (*AvoidDisturbingData)(unsigned char *p_data, unsigned long data_size);
+  // Sets [*p_left, *p_right) to the byte columns that are not 0x00 in some
+  // line, both 0 if all lines are blank.
+  void (*FindInkColumns)(const unsigned char *p_data, unsigned BytesPerLine, unsigned lines, unsigned *p_left, unsigned *p_right);
+  // Converts an 8 bit gray line (0 is black once XORed with invert) to a 1 bit
+  // line with the 8x8 Bayer matrix at line y. p_line may be p_gray.
+  void (*DitherOrdered)(const unsigned char *p_gray, unsigned width, unsigned y, unsigned char invert, unsigned char *p_line);
+  // Copies one raster line.
+  void (*CopyLine)(unsigned char *p_dest, const unsigned char *p_data, unsigned BytesPerLine);
+} EPTMS_RASTER_KERNEL_T; // Raster line kernels
+
+/*-------------------------------
+ * Function prototype declaration
+ *-------------------------------*/
+const EPTMS_RASTER_KERNEL_T *GetRasterKernel(void);
+const EPTMS_RASTER_KERNEL_T *GetRasterKernels(unsigned *p_count);
+// Returns the kernel built for lines of BytesPerLine bytes with the instruction
+// set of p_kernel, one of GetRasterKernels(), or p_kernel for other widths.
+const EPTMS_RASTER_KERNEL_T *GetRasterKernelForWidth(const EPTMS_RASTER_KERNEL_T *p_kernel, unsigned BytesPerLine);
+
+bool IsBlankRasterLine(const unsigned char *p_data, unsigned BytesPerLine);
+unsigned FindBlankRasterLines(const unsigned char *p_data, unsigned BytesPerLine, unsigned lines, std::uint64_t *p_bitmap);
+void AvoidDisturbingRasterData(unsigned char *p_data, unsigned long data_size);
+void FindInkRasterColumns(const unsigned char *p_data, unsigned BytesPerLine, unsigned lines, unsigned *p_left, unsigned *p_right);
+void DitherOrderedRasterLine(const unsigned char *p_gray, unsigned width, unsigned y, unsigned char invert, unsigned char *p_line);
+// Return the first and the last line that is not blank in a blank line bitmap,
+// lines and 0 if all lines are blank.
+unsigned FindBlackRasterLineTop(const std::uint64_t *p_blankLines, unsigned lines);
+unsigned FindBlackRasterLineEnd(const std::uint64_t *p_blankLines, unsigned lines);
+// Sets the EPTMD_BAND_HEADER_SIZE bytes of GS 8 L fn 112 for a band of lines of
+// width dots.
+void EncodeRasterBandHeader(unsigned char *p_command, unsigned long width, unsigned lines);
+// Error diffusion keeps width + 2 errors between the lines of a page, all 0
+// before the first line. p_line may be p_gray.
+void DitherDiffusionRasterLine(const unsigned char *p_gray, unsigned width, unsigned char invert, int *p_errors, unsigned char *p_line);
+
+// DLE EOT/ENQ/DC4 and ESC = are executed by the printer even inside raster data.
+static inline bool IsDisturbingPair(unsigned char first, unsigned char second)
+{
+  return ((0x10 == first) && ((0x04 == second) || (0x05 == second) || (0x14 == second)))
+         || ((0x1b == first) && (0x3d == second));
+}
+
+static inline bool IsBlankLineInBitmap(const std::uint64_t *p_bitmap, unsigned line_no)
+{
+  return 0 != ((p_bitmap[line_no / 64] >> (line_no % 64)) & 1);
+}
+
+#endif // RASTERKERNEL_H
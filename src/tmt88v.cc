@@ -0,0 +1,4083 @@
+/******************************************************************************
+ *
+ * Epson TM-T88V Printer Driver for GNU/Linux
+ *
+ * Copyright (C) Seiko Epson Corporation 2019.
+ * Copyright (C) 2020 Grégory DAVID.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *****************************************************************************/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <cups/cups.h>
+#include <cups/ppd.h>
+#include <cups/raster.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <errno.h>
+#include <fcntl.h>
+#include <cmath>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "rasterkernel.h"
+#include "tmt88vpriv.h"
+
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+#endif
+
+/*--------------------
+ * command declaration
+ *--------------------*/
+#define ESC (0x1b)
+#define GS (0x1d)
+
+/*----------------
+ * MACRO (#define)
+ *----------------*/
+#define EPTMD_BITS_TO_BYTES(bits) (((bits) + 7) / 8)
+#define EPTMD_OUTPUT_BUFFER_SIZE (16 * 1024) // Size of the coalescing output buffer.
+#define EPTMD_OUTPUT_GATHER_SIZE (1024) // Data at least this long is gathered with writev() instead of copied.
+#define EPTMD_OUTPUT_POLL_TIMEOUT (100) // Milliseconds between cancel checks while the output is full.
+#define EPTMD_CANCEL_DRAIN_TIME (2.0) // Seconds left to the command being written when the job is canceled.
+#define EPTMD_STATUS_FIRST_TIMEOUT (0.5) // Seconds waited for the first status after Automatic Status Back is enabled.
+#define EPTMD_STATUS_POLL_TIMEOUT (0.1) // Seconds between cancel checks while the printer cannot print.
+#define EPTMD_REASON_BIT(reason) (1u << (reason))
+#define EPTMD_BLANK_FEED_LINES (24) // Shortest interior blank run fed with ESC J instead of sent as raster.
+#define EPTMD_MAX_BAND_LINES (256) // Highest band accepted by TmxBandHeight.
+#define EPTMD_BAND_TARGET_BYTES (4000) // Raster bytes of an automatic band, fits a 4 KB receive buffer with its commands.
+#define EPTMD_PIPELINE_BANDS (4) // Band buffers between the reader and the writer thread.
+#define EPTMD_GRAPHICS_ENTRIES (32) // Bands remembered by the graphics cache index.
+#define EPTMD_GRAPHICS_JOB_BANDS (4) // Leading bands of a job checked against the graphics cache.
+#define EPTMD_GRAPHICS_MIN_BYTES (512) // Smallest band worth storing as NV graphics.
+#define EPTMD_GRAPHICS_CAPACITY (64 * 1024) // NV graphics bytes used by the cache, a quarter of the TM-T88V area.
+#define EPTMD_GRAPHICS_KEY_CODE1 ('T') // First key code of the cached NV graphics.
+#define EPTMD_GRAPHICS_KEYS (16) // Bands stored at once, the other entries of the index are candidates.
+#define EPTMD_GRAPHICS_MIN_JOBS (5) // Jobs printing a band before it is stored.
+#define EPTMD_GRAPHICS_MAX_IDLE (30 * 24 * 3600) // Seconds a band stays in the index without being printed.
+#define EPTMD_GRAPHICS_MIN_IDLE (24 * 3600) // Seconds a stored band is kept before another band may take its place.
+#define EPTMD_GRAPHICS_KEYS_TIMEOUT (0.5) // Seconds waited for each block of the NV graphics key code list.
+#define EPTMD_GRAPHICS_INDEX_HEADER "TmxGraphicsCache 2\n" // First line of the graphics cache index.
+#define EPTMD_CONFIG_CACHE_MAGIC (0x464d4354) // "TCMF", configuration cache file.
+#define EPTMD_CONFIG_CACHE_VERSION (1) // Incremented when EPTMS_CONFIG_T changes meaning.
+#define EPTMD_ARENA_ALIGNMENT (64) // Alignment of the page buffers, a cache line.
+#define EPTMD_ARENA_ALIGN(size) ((((size) + EPTMD_ARENA_ALIGNMENT - 1) / EPTMD_ARENA_ALIGNMENT) * EPTMD_ARENA_ALIGNMENT)
+
+// Static tracepoints for perf and bpftrace, e.g. usdt:rastertotmt88v:phase_end.
+#ifdef ENABLE_USDT
+#define EPTMD_PROBE1(name, arg1) DTRACE_PROBE1(rastertotmt88v, name, arg1)
+#define EPTMD_PROBE2(name, arg1, arg2) DTRACE_PROBE2(rastertotmt88v, name, arg1, arg2)
+#else
+#define EPTMD_PROBE1(name, arg1) ((void)(arg1))
+#define EPTMD_PROBE2(name, arg1, arg2) ((void)(arg1), (void)(arg2))
+#endif
+
+/*-----------------
+ * enum declaration
+ *-----------------*/
+typedef enum
+{
+  TmPaperReductionOff = 0,
+  TmPaperReductionTop,
+  TmPaperReductionBottom,
+  TmPaperReductionBoth,
+} EPTME_BLANK_SKIP_TYPE; // Paper Reduction
+
+typedef enum
+{
+  TmBuzzerNotUsed = 0,
+  TmBuzzerInternal,
+  TmBuzzerExternal,
+} EPTME_BUZZER; // Buzzer Type
+
+typedef enum
+{
+  TmDrawerNotUsed = 0,
+  TmDrawer1,
+  TmDrawer2,
+} EPTME_DRAWER; // Drawer No
+
+typedef enum
+{
+  TmNoCut = 0,
+  TmCutPerJob,
+  TmCutPerPage,
+} EPTME_PAPER_CUT; // Paper Cut
+
+typedef enum
+{
+  TmFlushPerPage = 0,
+  TmFlushPerBand,
+} EPTME_OUTPUT_FLUSH; // Output Flush
+
+typedef enum
+{
+  TmStreamingOff = 0,
+  TmStreamingOn,
+  TmStreamingThreaded,
+} EPTME_STREAMING; // Band Streaming
+
+typedef enum
+{
+  TmGraphicsCacheOff = 0,
+  TmGraphicsCacheOn,
+} EPTME_GRAPHICS_CACHE; // Graphics Cache
+
+typedef enum
+{
+  TmColumnCropOff = 0,
+  TmColumnCropOn,
+} EPTME_COLUMN_CROP; // Column Crop
+
+typedef enum
+{
+  TmDitheringRasterizer = 0,
+  TmDitheringOrdered,
+  TmDitheringDiffusion,
+} EPTME_DITHERING; // Dithering of 8 bit gray raster
+
+typedef enum
+{
+  TmContinuousRollOff = 0,
+  TmContinuousRollOn,
+} EPTME_CONTINUOUS_ROLL; // Continuous Roll
+
+typedef enum
+{
+  TmFlowControlOff = 0,
+  TmFlowControlOn,
+} EPTME_FLOW_CONTROL; // Flow control from the printer status
+
+typedef enum
+{
+  TmReasonOffline = 0,
+  TmReasonCoverOpen,
+  TmReasonMediaEmpty,
+  TmReasonMediaLow,
+  TmReasonError,
+  TmReasonCount,
+} EPTME_PRINTER_REASON; // Printer state reason reported from the printer status
+
+typedef enum
+{
+  TmOutputDescriptor = 0,
+  TmOutputMemory,
+  TmOutputCallback,
+} EPTME_OUTPUT_SINK; // Destination of the commands
+
+typedef enum
+{
+  TmPhaseParameters = 0,
+  TmPhaseReadRaster,
+  TmPhaseBlankScan,
+  TmPhaseAvoidDisturbing,
+  TmPhaseWriteBand,
+  TmPhaseUserFile,
+  TmPhaseCount,
+} EPTME_PHASE; // Timed phase of the job
+
+typedef enum
+{
+  TmUserFileStartJob = 0,
+  TmUserFileEndJob,
+  TmUserFileStartPage,
+  TmUserFileEndPage,
+  TmUserFileCount,
+} EPTME_USER_FILE; // User file sent around the job and pages
+
+/*--------------------------------
+ * Structure prototype declaration
+ *--------------------------------*/
+typedef struct
+{
+  char *p_printerName; // The name of the destination printer.
+  unsigned char h_motionUnit; // Horizontal motion units.
+  unsigned char v_motionUnit; // Vertical motion units.
+  EPTME_BLANK_SKIP_TYPE paperReduction; // Paper reduction settings.
+  EPTME_BUZZER buzzerControl; // Buzzer control settings.
+  EPTME_DRAWER drawerControl; // Drawer control settings.
+  EPTME_PAPER_CUT cutControl; // Paper cut settings.
+  EPTME_OUTPUT_FLUSH flushControl; // Output flush settings.
+  EPTME_STREAMING streamingControl; // Band streaming settings.
+  unsigned blankFeedLines; // Shortest interior blank run to feed, 0 if disabled.
+  unsigned bandHeight; // Band height settings, 0 for automatic.
+  unsigned maxBandLines; // Maximum band length of the current page.
+  EPTME_GRAPHICS_CACHE graphicsCache; // Graphics cache settings.
+  EPTME_COLUMN_CROP columnCrop; // Column crop settings.
+  EPTME_DITHERING dithering; // Dithering settings.
+  EPTME_CONTINUOUS_ROLL continuousRoll; // Continuous roll settings.
+  EPTME_FLOW_CONTROL flowControl; // Flow control settings.
+} EPTMS_CONFIG_T; // Configuration parameters
+
+typedef struct
+{
+  unsigned char *p_base; // Aligned storage, nullptr before the first page.
+  std::size_t capacity; // Bytes of storage.
+  unsigned long long allocations; // Number of times the storage was allocated.
+} EPTMS_ARENA_T; // Page buffers storage, reused across the pages of a job
+
+typedef struct
+{
+  EPTME_DITHERING method; // TmDitheringRasterizer when the raster is 1 bit.
+  unsigned char invert; // XORed with the gray values so that 0 is black.
+  int *p_errors; // Error diffusion carried to the next line.
+} EPTMS_DITHER_T; // Conversion of 8 bit gray lines to 1 bit
+
+typedef struct
+{
+  cups_raster_t *p_raster;
+  cups_page_header2_t pageHeader;
+  EPTMS_ARENA_T arena; // Storage of the buffers below.
+  unsigned char *p_lineBuffer; // One raster line as read, nullptr when lines are read into the page buffer.
+  unsigned char *p_pageBuffer;
+  std::uint64_t *p_blankLines; // Blank line bitmap of page.
+  unsigned char *p_bandBuffer; // Streamed band and one spare line.
+  unsigned char *p_slotBuffer; // Band buffers of the writer thread.
+  EPTMS_DITHER_T dither; // Dithering of the current page.
+  const EPTMS_RASTER_KERNEL_T *p_kernel; // Line kernels built for the width of the page.
+  unsigned long reducedLines; // Raster lines removed by paper reduction.
+  double reducedLength; // Paper saved by paper reduction in mm.
+} EPTMS_JOB_INFO_T; // Job Information parameters
+
+typedef struct
+{
+  EPTME_OUTPUT_SINK sink; // Destination of the commands.
+  int fd; // Destination file descriptor.
+  std::vector<unsigned char> memory; // Commands written to memory.
+  EPTMS_WRITE_CALLBACK_T p_write; // Callback receiving the commands.
+  void *p_context; // First argument of p_write.
+  unsigned char buffer[EPTMD_OUTPUT_BUFFER_SIZE]; // Pending commands not yet written.
+  std::size_t length; // Number of pending bytes in buffer.
+  unsigned long long syscalls; // Number of write()/writev() calls issued.
+  unsigned long long bands; // Number of raster bands written.
+  unsigned long long bandBytes; // Raster bytes of the bands.
+  unsigned long long cropBytes; // Raster bytes left out by the column crop.
+  double writeTime; // Seconds spent in write()/writev() and waiting for fd.
+  double blockedTime; // Seconds spent waiting for fd to accept data.
+  unsigned long long waits; // Number of poll() calls.
+  int flags; // File status flags of fd before O_NONBLOCK, -1 if unchanged.
+  bool aborted; // A write was given up after a cancel, fd may end inside a command.
+  unsigned long long bytes; // Number of bytes written to fd.
+  std::vector<unsigned char> *p_record; // Receives the written bytes while a page is recorded.
+} EPTMS_OUTPUT_T; // Coalescing output writer
+
+typedef struct
+{
+  bool enabled; // The status is read from the back-channel.
+  bool statusBack; // GS a enabled Automatic Status Back for this job.
+  unsigned char packet[4]; // Automatic Status Back packet being received.
+  unsigned length; // Bytes of packet received.
+  unsigned reasons; // EPTMD_REASON_BIT of the reasons set with STATE:.
+  unsigned long long statuses; // Packets received.
+  unsigned long long pauses; // Times the bands waited for the printer.
+  double pausedTime; // Seconds the bands waited for the printer.
+} EPTMS_PRINTER_T; // Printer status sent by Automatic Status Back
+
+typedef struct
+{
+  double time[TmPhaseCount]; // Seconds spent in each phase.
+  unsigned long long calls[TmPhaseCount]; // Number of timed intervals of each phase.
+  unsigned long long blankLines; // Blank raster lines fed or removed instead of sent.
+} EPTMS_TIMING_T; // Phase timers
+
+typedef struct
+{
+  bool loaded; // The file has been looked up.
+  unsigned char *p_data; // Mapped file contents, nullptr if missing or empty.
+  std::size_t size; // File size.
+} EPTMS_USER_FILE_T; // User file cached for the job
+
+typedef struct
+{
+  std::uint64_t hash; // Content hash of the band.
+  unsigned width; // Band width in dots.
+  unsigned lines; // Band height in dots.
+  unsigned hits; // Jobs that printed the band.
+  unsigned char key; // Second key code of the NV graphics, 0 if not stored.
+  long long last; // Time the band was last printed.
+  bool printed; // Printed by this job, not saved.
+} EPTMS_GRAPHICS_ENTRY_T; // Band known by the graphics cache
+
+typedef struct
+{
+  bool enabled; // The cache is used by this job.
+  bool changed; // The index must be saved at the end of the job.
+  bool reset; // The index is new, the printer may hold the bands of an earlier one.
+  long long now; // Start time of the job.
+  unsigned bands; // Leading bands of the job checked so far.
+  unsigned count; // Used entries.
+  EPTMS_GRAPHICS_ENTRY_T entries[EPTMD_GRAPHICS_ENTRIES];
+} EPTMS_GRAPHICS_CACHE_T; // Recurring bands stored in the printer NV graphics area
+
+typedef struct
+{
+  std::uint32_t magic; // EPTMD_CONFIG_CACHE_MAGIC
+  std::uint32_t version; // EPTMD_CONFIG_CACHE_VERSION
+  std::uint32_t configSize; // sizeof(EPTMS_CONFIG_T)
+  std::uint32_t keySize; // Bytes of the key following the header.
+} EPTMS_CONFIG_CACHE_HEADER_T; // Configuration cache file header, followed by the key and the configuration
+
+typedef struct
+{
+  unsigned char *p_data; // Sanitized band raster.
+  unsigned lines; // Band length, 0 if the slot only feeds paper.
+  unsigned long feedUnits; // Paper feed after the band.
+} EPTMS_PIPELINE_SLOT_T; // Band waiting for the writer thread
+
+typedef struct
+{
+  EPTMS_ENCODER_T *p_encoder;
+  cups_page_header2_t *p_header;
+  EPTMS_PIPELINE_SLOT_T slots[EPTMD_PIPELINE_BANDS]; // Ring of bands, sent in order.
+  unsigned head; // Slot sent next.
+  unsigned count; // Slots queued, including the one being sent.
+  bool done; // No more slots for this page.
+  result_t result; // First error of the writer thread.
+  std::mutex mutex;
+  std::condition_variable changed; // Signaled when a slot is queued or released.
+  std::thread writer;
+} EPTMS_PIPELINE_T; // Reader/writer band pipeline of a page
+
+typedef struct
+{
+  bool open; // Pages are being streamed.
+  cups_page_header2_t header; // Layout of the streamed pages, also read by the writer thread.
+  unsigned char *p_band; // Band buffer and one spare line, in the job arena.
+  unsigned bandLines; // Lines stored in the band buffer.
+  unsigned blankLines; // Blank lines held back, sent only if black lines follow.
+  bool foundBlack; // The top blank has been skipped.
+  EPTMS_TIMING_T startTiming; // Timing when the stream was opened.
+  unsigned long long startBytes; // Output bytes when the stream was opened.
+  double startWriteTime; // Output write time when the stream was opened.
+  EPTMS_PIPELINE_T pipeline;
+  EPTMS_PIPELINE_T *p_pipeline; // nullptr when bands are sent by the reader.
+} EPTMS_STREAM_T; // Band stream of a page, or of several pages on a continuous roll
+
+typedef struct
+{
+  const unsigned char *p_data;
+  std::size_t size;
+  std::size_t offset; // Bytes already read.
+} EPTMS_MEMORY_RASTER_T; // Raster read from memory
+
+struct EPTMS_ENCODER_S
+{
+  EPTMS_CONFIG_T config;
+  EPTMS_JOB_INFO_T jobInfo;
+  std::string printerName; // Storage of config.p_printerName.
+  FILE *p_log; // Destination of the messages to CUPS.
+  bool backChannel; // The status may be read from CUPS_BC_FD.
+  std::atomic<char> canceled;
+  std::atomic<long long> cancelTime; // CLOCK_MONOTONIC nanoseconds of the cancel request.
+  EPTMS_OUTPUT_T output;
+  // Read by the thread writing the bands.
+  EPTMS_PRINTER_T printer;
+  // Written by the writer thread for TmPhaseWriteBand only, read once it is
+  // joined, at the end of the page or of a threaded roll.
+  EPTMS_TIMING_T timing;
+  EPTMS_USER_FILE_T userFiles[TmUserFileCount];
+  EPTMS_GRAPHICS_CACHE_T graphics;
+  // Commands of the first copy of a page, replayed for the other copies.
+  std::vector<unsigned char> pageRecord;
+  EPTMS_STREAM_T stream;
+}; // Raster to ESC/POS encoder
+
+/*--------------------------------------
+ * Static function prototype declaration
+ *--------------------------------------*/
+static void fprintf_DebugLog(EPTMS_ENCODER_T *);
+static void fprintf_OutputLog(EPTMS_ENCODER_T *);
+static void fprintf_PrinterLog(EPTMS_ENCODER_T *);
+static void fprintf_TimingLog(EPTMS_ENCODER_T *, const char *, EPTMS_TIMING_T *, unsigned long long, double);
+static void ResetEncoder(EPTMS_ENCODER_T *);
+static ssize_t ReadRasterMemory(void *, unsigned char *, size_t);
+static result_t GetParameters(EPTMS_ENCODER_T *, const char *, const char *);
+static result_t GetParametersFromPPD(const char *, const char *, EPTMS_CONFIG_T *);
+static bool GetConfigCacheKey(const char *, const char *, std::string *, std::string *);
+static bool LoadConfigCache(const std::string &, const std::string &, EPTMS_CONFIG_T *);
+static void SaveConfigCache(const std::string &, const std::string &, EPTMS_CONFIG_T *);
+static result_t GetModelSpecificFromPPD(ppd_file_t *, EPTMS_CONFIG_T *);
+static result_t GetPaperReductionFromPPD(ppd_file_t *, EPTMS_CONFIG_T *);
+static result_t GetBuzzerAndDrawerFromPPD(ppd_file_t *, EPTMS_CONFIG_T *);
+static result_t GetPaperCutFromPPD(ppd_file_t *, EPTMS_CONFIG_T *);
+static result_t GetOutputFlushFromPPD(ppd_file_t *, EPTMS_CONFIG_T *);
+static result_t GetStreamingFromPPD(ppd_file_t *, EPTMS_CONFIG_T *);
+static result_t GetBlankFeedFromPPD(ppd_file_t *, EPTMS_CONFIG_T *);
+static result_t GetBandHeightFromPPD(ppd_file_t *, EPTMS_CONFIG_T *);
+static result_t GetGraphicsCacheFromPPD(ppd_file_t *, EPTMS_CONFIG_T *);
+static result_t GetColumnCropFromPPD(ppd_file_t *, EPTMS_CONFIG_T *);
+static result_t GetDitheringFromPPD(ppd_file_t *, EPTMS_CONFIG_T *);
+static result_t GetContinuousRollFromPPD(ppd_file_t *, EPTMS_CONFIG_T *);
+static result_t GetFlowControlFromPPD(ppd_file_t *, EPTMS_CONFIG_T *);
+
+static result_t DoJob(EPTMS_ENCODER_T *);
+static result_t StartJob(EPTMS_ENCODER_T *);
+static result_t OpenDrawer(EPTMS_ENCODER_T *);
+static result_t SoundBuzzer(EPTMS_ENCODER_T *);
+static result_t EndJob(EPTMS_ENCODER_T *, cups_page_header2_t *);
+
+static result_t DoPage(EPTMS_ENCODER_T *);
+static result_t EndRoll(EPTMS_ENCODER_T *, bool);
+static void CountReducedLines(EPTMS_ENCODER_T *, cups_page_header2_t *, unsigned);
+static unsigned GetMaxBandLines(EPTMS_CONFIG_T *, cups_page_header2_t *);
+static result_t ReservePageBuffers(EPTMS_CONFIG_T *, EPTMS_JOB_INFO_T *);
+static result_t ReserveArena(EPTMS_ARENA_T *, std::size_t);
+static void FreeArena(EPTMS_ARENA_T *);
+static result_t StartPage(EPTMS_ENCODER_T *);
+static result_t EndPage(EPTMS_ENCODER_T *, cups_page_header2_t *);
+static result_t ReplayPage(EPTMS_ENCODER_T *, cups_page_header2_t *);
+static result_t ReadRaster(EPTMS_ENCODER_T *, cups_page_header2_t *, cups_raster_t *, EPTMS_DITHER_T *, unsigned char *, unsigned char *, unsigned);
+static void TransferRaster(const EPTMS_RASTER_KERNEL_T *, unsigned char *, unsigned char *, unsigned, unsigned);
+static bool IsDirectRead(cups_page_header2_t *, EPTMS_DITHER_T *);
+static bool SetDither(EPTMS_CONFIG_T *, cups_page_header2_t *, EPTMS_DITHER_T *);
+static void DitherRaster(EPTMS_DITHER_T *, const unsigned char *, unsigned, unsigned, unsigned char *);
+static result_t WriteRaster(EPTMS_ENCODER_T *, cups_page_header2_t *, unsigned char *, std::uint64_t *, unsigned *);
+static result_t WriteRasterBands(EPTMS_ENCODER_T *, cups_page_header2_t *, unsigned char *, unsigned, unsigned);
+static unsigned FindBlankFeedLines(EPTMS_CONFIG_T *, cups_page_header2_t *, std::uint64_t *, unsigned, unsigned, unsigned *);
+static result_t OpenStream(EPTMS_ENCODER_T *);
+static bool IsStreamCompatible(EPTMS_ENCODER_T *, cups_page_header2_t *);
+static result_t StreamRaster(EPTMS_ENCODER_T *, unsigned *);
+static result_t CloseStream(EPTMS_ENCODER_T *, bool, unsigned *);
+static result_t StreamBandLine(EPTMS_ENCODER_T *, cups_page_header2_t *, EPTMS_PIPELINE_T *, unsigned char *, unsigned *, unsigned char *);
+static result_t StreamBlankLines(EPTMS_ENCODER_T *, cups_page_header2_t *, EPTMS_PIPELINE_T *, unsigned char *, unsigned *, unsigned);
+static result_t StreamBand(EPTMS_ENCODER_T *, cups_page_header2_t *, EPTMS_PIPELINE_T *, unsigned char *, unsigned, unsigned long);
+static result_t SendBand(EPTMS_ENCODER_T *, cups_page_header2_t *, unsigned char *, unsigned, unsigned long);
+static result_t StartPipeline(EPTMS_PIPELINE_T *, EPTMS_ENCODER_T *, cups_page_header2_t *, unsigned char *);
+static result_t QueueBand(EPTMS_PIPELINE_T *, unsigned char *, unsigned, unsigned long);
+static result_t FinishPipeline(EPTMS_PIPELINE_T *);
+static void PipelineWriter(EPTMS_PIPELINE_T *);
+static bool IsPaperReductionTop(EPTMS_CONFIG_T *);
+static bool IsBlankLineNeeded(EPTMS_CONFIG_T *);
+static bool IsPaperReductionBottom(EPTMS_CONFIG_T *);
+static void AvoidDisturbingData(EPTMS_ENCODER_T *, cups_page_header2_t *, unsigned char *, unsigned, bool);
+static result_t WriteBand(EPTMS_ENCODER_T *, cups_page_header2_t *, unsigned char *, unsigned);
+static void CropBand(EPTMS_ENCODER_T *, cups_page_header2_t *, unsigned char *, unsigned, unsigned *, unsigned long *);
+static result_t WriteBandCommands(EPTMS_ENCODER_T *, unsigned, unsigned long, unsigned char *, unsigned);
+static result_t WriteCachedBand(EPTMS_ENCODER_T *, unsigned, unsigned long, unsigned char *, unsigned, bool *);
+static EPTMS_GRAPHICS_ENTRY_T *FindGraphicsEntry(EPTMS_GRAPHICS_CACHE_T *, std::uint64_t, unsigned, unsigned);
+static EPTMS_GRAPHICS_ENTRY_T *FindStaleGraphicsEntry(EPTMS_GRAPHICS_CACHE_T *);
+static void RemoveGraphicsEntry(EPTMS_GRAPHICS_CACHE_T *, unsigned);
+static unsigned char GetGraphicsKey(EPTMS_GRAPHICS_CACHE_T *, unsigned long);
+static result_t DeleteGraphicsKey(EPTMS_ENCODER_T *, unsigned char);
+static bool ReadGraphicsKeys(EPTMS_ENCODER_T *, bool *);
+static result_t PrepareGraphicsCache(EPTMS_ENCODER_T *);
+static void LoadGraphicsCache(EPTMS_ENCODER_T *);
+static void SaveGraphicsCache(EPTMS_ENCODER_T *);
+static bool GetFeedUnits(EPTMS_CONFIG_T *, cups_page_header2_t *, unsigned, unsigned long *);
+static result_t WriteFeed(EPTMS_ENCODER_T *, unsigned long);
+
+static result_t WriteUserFile(EPTMS_ENCODER_T *, char *, EPTME_USER_FILE);
+static result_t LoadUserFile(char *, EPTME_USER_FILE, EPTMS_USER_FILE_T *);
+static std::string GetUserFilePath(char *, const char *);
+static std::string GetGraphicsCachePath(char *);
+static void FreeUserFiles(EPTMS_ENCODER_T *);
+static result_t WriteData(EPTMS_ENCODER_T *, unsigned char *, unsigned int);
+static result_t WriteVector(EPTMS_ENCODER_T *, struct iovec *, int);
+static ssize_t WriteOutput(EPTMS_OUTPUT_T *, struct iovec *, int);
+static result_t FlushData(EPTMS_ENCODER_T *);
+static void InitOutput(EPTMS_ENCODER_T *);
+static void ExitOutput(EPTMS_ENCODER_T *);
+static result_t WaitOutput(EPTMS_ENCODER_T *);
+static result_t WriteCancelSequence(EPTMS_ENCODER_T *);
+static bool HasBackChannel(EPTMS_ENCODER_T *);
+static result_t EnableStatusBack(EPTMS_ENCODER_T *);
+static void ReadPrinterStatus(EPTMS_ENCODER_T *, double);
+static void SetPrinterReasons(EPTMS_ENCODER_T *, unsigned);
+static result_t WaitPrinter(EPTMS_ENCODER_T *);
+static double GetCancelTime(EPTMS_ENCODER_T *);
+static double GetMonotonicTime(void);
+static double StartPhase(EPTME_PHASE);
+static double EndPhase(EPTMS_ENCODER_T *, EPTME_PHASE, double);
+
+EPTMS_ENCODER_T *TmCreateEncoder(const char *p_printerName)
+{
+  EPTMS_ENCODER_T *p_encoder = new(std::nothrow) EPTMS_ENCODER_T();
+
+  if(nullptr == p_encoder)
+  {
+    return nullptr;
+  }
+
+  p_encoder->printerName = (nullptr != p_printerName) ? p_printerName : "";
+  p_encoder->config.p_printerName = &p_encoder->printerName[0];
+  p_encoder->p_log = stderr;
+  p_encoder->output.sink = TmOutputDescriptor;
+  p_encoder->output.fd = STDOUT_FILENO;
+  p_encoder->output.flags = -1;
+  ResetEncoder(p_encoder);
+  return p_encoder;
+}
+
+void TmDeleteEncoder(EPTMS_ENCODER_T *p_encoder)
+{
+  delete p_encoder;
+}
+
+tm_result_t TmLoadEncoderConfig(EPTMS_ENCODER_T *p_encoder, const char *p_ppdPath, const char *p_jobOptions)
+{
+  double start_time = StartPhase(TmPhaseParameters);
+  result_t result = GetParameters(p_encoder, p_ppdPath, (nullptr != p_jobOptions) ? p_jobOptions : "");
+  fprintf(p_encoder->p_log, "DEBUG: startup time = %.6f s\n", EndPhase(p_encoder, TmPhaseParameters, start_time) - start_time);
+  // The cached configuration has no printer name.
+  p_encoder->config.p_printerName = &p_encoder->printerName[0];
+  return result;
+}
+
+void TmSetEncoderLog(EPTMS_ENCODER_T *p_encoder, FILE *p_log)
+{
+  p_encoder->p_log = p_log;
+}
+
+void TmSetEncoderBackChannel(EPTMS_ENCODER_T *p_encoder, bool enabled)
+{
+  p_encoder->backChannel = enabled;
+}
+
+void TmSetEncoderOutputFd(EPTMS_ENCODER_T *p_encoder, int fd)
+{
+  p_encoder->output.sink = TmOutputDescriptor;
+  p_encoder->output.fd = fd;
+}
+
+void TmSetEncoderOutputMemory(EPTMS_ENCODER_T *p_encoder)
+{
+  p_encoder->output.sink = TmOutputMemory;
+  p_encoder->output.fd = -1;
+}
+
+void TmSetEncoderOutputCallback(EPTMS_ENCODER_T *p_encoder, EPTMS_WRITE_CALLBACK_T p_write, void *p_context)
+{
+  p_encoder->output.sink = TmOutputCallback;
+  p_encoder->output.fd = -1;
+  p_encoder->output.p_write = p_write;
+  p_encoder->output.p_context = p_context;
+}
+
+const unsigned char *TmGetEncoderOutput(EPTMS_ENCODER_T *p_encoder, std::size_t *p_size)
+{
+  *p_size = p_encoder->output.memory.size();
+  return p_encoder->output.memory.data();
+}
+
+tm_result_t TmEncodeRaster(EPTMS_ENCODER_T *p_encoder, cups_raster_t *p_raster)
+{
+  p_encoder->jobInfo.p_raster = p_raster;
+  p_encoder->output.memory.clear();
+  InitOutput(p_encoder);
+
+  // Processing print job.
+  result_t result = DoJob(p_encoder);
+
+  FreeUserFiles(p_encoder);
+  ExitOutput(p_encoder);
+  p_encoder->jobInfo.p_raster = nullptr;
+
+  // Output message for debugging.
+  fprintf_DebugLog(p_encoder);
+  fprintf_OutputLog(p_encoder);
+  fprintf_PrinterLog(p_encoder);
+  EPTMS_TIMING_T job_start = {};
+  fprintf_TimingLog(p_encoder, "job", &job_start, p_encoder->output.bytes, p_encoder->output.writeTime);
+  ResetEncoder(p_encoder);
+  return result;
+}
+
+tm_result_t TmEncodeRasterFd(EPTMS_ENCODER_T *p_encoder, int fd)
+{
+  cups_raster_t *p_raster = cupsRasterOpen(fd, CUPS_RASTER_READ);
+
+  if(nullptr == p_raster)
+  {
+    return E_INIT_FAILED_CUPS_RASTER_READ;
+  }
+
+  result_t result = TmEncodeRaster(p_encoder, p_raster);
+  cupsRasterClose(p_raster);
+  return result;
+}
+
+tm_result_t TmEncodeRasterMemory(EPTMS_ENCODER_T *p_encoder, const unsigned char *p_data, std::size_t size)
+{
+  EPTMS_MEMORY_RASTER_T memory = { p_data, size, 0 };
+  cups_raster_t *p_raster = cupsRasterOpenIO(ReadRasterMemory, &memory, CUPS_RASTER_READ);
+
+  if(nullptr == p_raster)
+  {
+    return E_INIT_FAILED_CUPS_RASTER_READ;
+  }
+
+  result_t result = TmEncodeRaster(p_encoder, p_raster);
+  cupsRasterClose(p_raster);
+  return result;
+}
+
+void TmCancelEncoder(EPTMS_ENCODER_T *p_encoder)
+{
+  struct timespec now;
+
+  if(0 == p_encoder->canceled)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    p_encoder->cancelTime = (static_cast<long long>(now.tv_sec) * 1000000000LL) + now.tv_nsec;
+  }
+
+  p_encoder->canceled = 1;
+}
+
+static void fprintf_DebugLog(EPTMS_ENCODER_T *p_encoder)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  fprintf(p_encoder->p_log, "DEBUG: p_printerName = %s\n", p_config->p_printerName);
+  fprintf(p_encoder->p_log, "DEBUG: v_motionUnit = %u\n", p_config->v_motionUnit);
+  fprintf(p_encoder->p_log, "DEBUG: h_motionUnit = %u\n", p_config->h_motionUnit);
+  fprintf(p_encoder->p_log, "DEBUG: paperReduction = %d\n", p_config->paperReduction);
+  fprintf(p_encoder->p_log, "DEBUG: buzzerControl = %d\n", p_config->buzzerControl);
+  fprintf(p_encoder->p_log, "DEBUG: drawerControl = %d\n", p_config->drawerControl);
+  fprintf(p_encoder->p_log, "DEBUG: cutControl = %d\n", p_config->cutControl);
+  fprintf(p_encoder->p_log, "DEBUG: flushControl = %d\n", p_config->flushControl);
+  fprintf(p_encoder->p_log, "DEBUG: streamingControl = %d\n", p_config->streamingControl);
+  fprintf(p_encoder->p_log, "DEBUG: blankFeedLines = %u\n", p_config->blankFeedLines);
+  fprintf(p_encoder->p_log, "DEBUG: bandHeight = %u\n", p_config->bandHeight);
+  fprintf(p_encoder->p_log, "DEBUG: maxBandLines = %u\n", p_config->maxBandLines);
+  fprintf(p_encoder->p_log, "DEBUG: graphicsCache = %d\n", p_config->graphicsCache);
+  fprintf(p_encoder->p_log, "DEBUG: columnCrop = %d\n", p_config->columnCrop);
+  fprintf(p_encoder->p_log, "DEBUG: dithering = %d\n", p_config->dithering);
+  fprintf(p_encoder->p_log, "DEBUG: continuousRoll = %d\n", p_config->continuousRoll);
+  fprintf(p_encoder->p_log, "DEBUG: flowControl = %d\n", p_config->flowControl);
+}
+
+static void fprintf_OutputLog(EPTMS_ENCODER_T *p_encoder)
+{
+  EPTMS_OUTPUT_T *p_output = &p_encoder->output;
+  fprintf(p_encoder->p_log, "DEBUG: output bytes = %llu\n", p_output->bytes);
+  fprintf(p_encoder->p_log, "DEBUG: output syscalls = %llu\n", p_output->syscalls);
+  fprintf(p_encoder->p_log, "DEBUG: output bands = %llu (%llu raster bytes, %llu cropped)\n", p_output->bands, p_output->bandBytes, p_output->cropBytes);
+
+  if(0 < p_output->writeTime)
+  {
+    fprintf(p_encoder->p_log, "DEBUG: output write time = %.6f s (%.1f KiB/s)\n",
+            p_output->writeTime, (static_cast<double>(p_output->bytes) / 1024.0) / p_output->writeTime);
+  }
+
+  fprintf(p_encoder->p_log, "DEBUG: output blocked time = %.6f s (%llu waits)\n", p_output->blockedTime, p_output->waits);
+  fprintf(p_encoder->p_log, "ATTR: tmx-output-blocked=%.6f\n", p_output->blockedTime);
+
+  if(0 != p_encoder->canceled)
+  {
+    double latency = GetMonotonicTime() - GetCancelTime(p_encoder);
+    fprintf(p_encoder->p_log, "DEBUG: cancel latency = %.6f s%s\n", latency, p_output->aborted ? " (output aborted)" : "");
+    fprintf(p_encoder->p_log, "ATTR: tmx-cancel-latency=%.6f\n", latency);
+  }
+}
+
+static void fprintf_PrinterLog(EPTMS_ENCODER_T *p_encoder)
+{
+  EPTMS_PRINTER_T *p_printer = &p_encoder->printer;
+  fprintf(p_encoder->p_log, "DEBUG: printer status = %llu packets, paused %.6f s (%llu pauses)\n",
+          p_printer->statuses, p_printer->pausedTime, p_printer->pauses);
+  fprintf(p_encoder->p_log, "ATTR: tmx-output-paused=%.6f\n", p_printer->pausedTime);
+}
+
+// Prints the phase times since 'p_start'. The job totals are also set as job attributes.
+static void fprintf_TimingLog(EPTMS_ENCODER_T *p_encoder, const char *p_scope, EPTMS_TIMING_T *p_start, unsigned long long bytes, double writeTime)
+{
+  const char *p_names[TmPhaseCount] = { "parameters", "read-raster", "blank-scan", "avoid-disturbing", "write-band", "user-file" };
+  bool job = (0 == strcmp("job", p_scope));
+
+  for(unsigned phase = 0; phase < TmPhaseCount; phase++)
+  {
+    double time = p_encoder->timing.time[phase] - p_start->time[phase];
+    unsigned long long calls = p_encoder->timing.calls[phase] - p_start->calls[phase];
+
+    if(0 == calls)
+    {
+      continue;
+    }
+
+    fprintf(p_encoder->p_log, "DEBUG: %s time %s = %.6f s (%llu)\n", p_scope, p_names[phase], time, calls);
+
+    if(job)
+    {
+      fprintf(p_encoder->p_log, "ATTR: tmx-time-%s=%.6f\n", p_names[phase], time);
+    }
+  }
+
+  unsigned long long blank_lines = p_encoder->timing.blankLines - p_start->blankLines;
+  fprintf(p_encoder->p_log, "DEBUG: %s time write = %.6f s\n", p_scope, writeTime);
+  fprintf(p_encoder->p_log, "DEBUG: %s output = %llu bytes, %llu blank lines skipped\n", p_scope, bytes, blank_lines);
+
+  if(job)
+  {
+    fprintf(p_encoder->p_log, "ATTR: tmx-time-write=%.6f tmx-output-bytes=%llu tmx-blank-lines=%llu\n", writeTime, bytes, blank_lines);
+  }
+}
+
+// Clears the state of the last job, the configuration and the output
+// destination are kept.
+static void ResetEncoder(EPTMS_ENCODER_T *p_encoder)
+{
+  EPTMS_OUTPUT_T *p_output = &p_encoder->output;
+  p_output->length = 0;
+  p_output->syscalls = 0;
+  p_output->bands = 0;
+  p_output->bandBytes = 0;
+  p_output->cropBytes = 0;
+  p_output->writeTime = 0;
+  p_output->blockedTime = 0;
+  p_output->waits = 0;
+  p_output->aborted = false;
+  p_output->bytes = 0;
+  memset(&p_encoder->timing, 0, sizeof(p_encoder->timing));
+  memset(&p_encoder->printer, 0, sizeof(p_encoder->printer));
+  p_encoder->jobInfo.reducedLines = 0;
+  p_encoder->jobInfo.reducedLength = 0;
+}
+
+static ssize_t ReadRasterMemory(void *p_context, unsigned char *p_buffer, size_t length)
+{
+  EPTMS_MEMORY_RASTER_T *p_memory = static_cast<EPTMS_MEMORY_RASTER_T *>(p_context);
+  std::size_t size = ((p_memory->size - p_memory->offset) < length) ? (p_memory->size - p_memory->offset) : length;
+  memcpy(p_buffer, p_memory->p_data + p_memory->offset, size);
+  p_memory->offset += size;
+  return static_cast<ssize_t>(size);
+}
+
+// The configuration resolved from the PPD file and the job options is
+// cached, so that jobs with the same options skip PPD parsing.
+static result_t GetParameters(EPTMS_ENCODER_T *p_encoder, const char *p_ppdPath, const char *p_jobOptions)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  std::string path;
+  std::string key;
+  bool cacheable = GetConfigCacheKey(p_ppdPath, p_jobOptions, &path, &key);
+
+  if(cacheable && LoadConfigCache(path, key, p_config))
+  {
+    fprintf(p_encoder->p_log, "DEBUG: configuration from cache %s\n", path.c_str());
+    return SUCCESS;
+  }
+
+  result_t result = GetParametersFromPPD(p_ppdPath, p_jobOptions, p_config);
+
+  if((SUCCESS == result) && cacheable)
+  {
+    SaveConfigCache(path, key, p_config);
+  }
+
+  fprintf(p_encoder->p_log, "DEBUG: configuration from PPD file\n");
+  return result;
+}
+
+// The key is the PPD path, its modification time and size, and the Tmx
+// job options, sorted. CUPS adds per-job attributes such as job-uuid to the
+// options, they must not be part of the key. The cache lives in the CUPS
+// temporary directory only.
+static bool GetConfigCacheKey(const char *p_ppd, const char *p_jobOptions, std::string *p_path, std::string *p_key)
+{
+  const char *p_directory = getenv("TMPDIR");
+  struct stat info;
+
+  if((nullptr == p_ppd) || (nullptr == p_directory) || (0 != stat(p_ppd, &info)))
+  {
+    return false;
+  }
+
+  cups_option_t *p_options = nullptr;
+  int num_option = cupsParseOptions(p_jobOptions, 0, &p_options);
+  std::vector<std::string> options;
+
+  for(int i = 0; i < num_option; i++)
+  {
+    if(0 == strncasecmp(p_options[i].name, "Tmx", 3))
+    {
+      options.push_back(std::string(p_options[i].name) + '=' + p_options[i].value);
+    }
+  }
+
+  cupsFreeOptions(num_option, p_options);
+  std::sort(options.begin(), options.end());
+
+  std::ostringstream key;
+  key << p_ppd << '\n' << info.st_mtim.tv_sec << '.' << info.st_mtim.tv_nsec << '\n' << info.st_size;
+
+  for(const std::string &option : options)
+  {
+    key << '\n' << option;
+  }
+
+  *p_key = key.str();
+
+  // FNV-1a
+  std::uint64_t hash = 0xcbf29ce484222325ULL;
+
+  for(char c : *p_key)
+  {
+    hash = (hash ^ (unsigned char)c) * 0x100000001b3ULL;
+  }
+
+  char name[64];
+  snprintf(name, sizeof(name), "/rastertotmt88v-%016llx.cfg", (unsigned long long)hash);
+  *p_path = std::string(p_directory) + name;
+  return true;
+}
+
+static bool LoadConfigCache(const std::string &path, const std::string &key, EPTMS_CONFIG_T *p_config)
+{
+  int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW);
+
+  if(0 > fd)
+  {
+    return false;
+  }
+
+  // Only files written by this user are trusted.
+  struct stat info;
+  EPTMS_CONFIG_CACHE_HEADER_T header;
+  std::string cached_key(key.size(), '\0');
+  EPTMS_CONFIG_T config;
+  bool loaded = (0 == fstat(fd, &info)) && (geteuid() == info.st_uid)
+                && (sizeof(header) == read(fd, &header, sizeof(header)))
+                && (EPTMD_CONFIG_CACHE_MAGIC == header.magic) && (EPTMD_CONFIG_CACHE_VERSION == header.version)
+                && (sizeof(config) == header.configSize) && (key.size() == header.keySize)
+                && ((ssize_t)key.size() == read(fd, &cached_key[0], key.size())) && (key == cached_key)
+                && (sizeof(config) == read(fd, &config, sizeof(config)));
+  close(fd);
+
+  if(loaded)
+  {
+    *p_config = config;
+  }
+
+  return loaded;
+}
+
+static void SaveConfigCache(const std::string &path, const std::string &key, EPTMS_CONFIG_T *p_config)
+{
+  EPTMS_CONFIG_CACHE_HEADER_T header = { EPTMD_CONFIG_CACHE_MAGIC, EPTMD_CONFIG_CACHE_VERSION,
+                                         sizeof(EPTMS_CONFIG_T), (std::uint32_t)key.size()
+                                       };
+  EPTMS_CONFIG_T config = *p_config;
+  config.p_printerName = nullptr;
+
+  // Replaced at once, so that a concurrent job never reads a partial file.
+  std::string temporary_path = path + ".tmp";
+  int fd = open(temporary_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+
+  if(0 > fd)
+  {
+    return;
+  }
+
+  struct iovec vector[3];
+  vector[0].iov_base = &header;
+  vector[0].iov_len = sizeof(header);
+  vector[1].iov_base = const_cast<char *>(key.data());
+  vector[1].iov_len = key.size();
+  vector[2].iov_base = &config;
+  vector[2].iov_len = sizeof(config);
+  bool saved = ((ssize_t)(sizeof(header) + key.size() + sizeof(config)) == writev(fd, vector, 3));
+
+  if((0 != close(fd)) || !saved || (0 != rename(temporary_path.c_str(), path.c_str())))
+  {
+    unlink(temporary_path.c_str());
+  }
+}
+
+static result_t GetParametersFromPPD(const char *p_ppdPath, const char *p_jobOptions, EPTMS_CONFIG_T *p_config)
+{
+  ppd_file_t *p_ppd = nullptr;
+  {
+    // Load the PPD file
+    p_ppd = ppdOpenFile(p_ppdPath);
+
+    if(nullptr == p_ppd)
+    {
+      return 4001;
+    }
+
+    ppdMarkDefaults(p_ppd);
+  }
+  {
+    // Check conflict
+    cups_option_t *p_options = nullptr;
+    int num_option = cupsParseOptions(p_jobOptions, 0, &p_options);
+
+    if(0 < num_option)
+    {
+      if(0 != cupsMarkOptions(p_ppd, num_option, p_options)) // 1 if conflicts exist, 0 otherwise
+      {
+        ppdClose(p_ppd);
+        cupsFreeOptions(num_option, p_options);
+        return 4002;
+      }
+    }
+
+    cupsFreeOptions(num_option, p_options);
+  }
+  result_t result = SUCCESS;
+  {
+    // Get parameters
+    if(SUCCESS == result)
+    {
+      result = GetModelSpecificFromPPD(p_ppd, p_config);
+    }
+
+    if(SUCCESS == result)
+    {
+      result = GetPaperReductionFromPPD(p_ppd, p_config);
+    }
+
+    if(SUCCESS == result)
+    {
+      result = GetPaperCutFromPPD(p_ppd, p_config);
+    }
+
+    if(SUCCESS == result)
+    {
+      result = GetBuzzerAndDrawerFromPPD(p_ppd, p_config);
+    }
+
+    if(SUCCESS == result)
+    {
+      result = GetOutputFlushFromPPD(p_ppd, p_config);
+    }
+
+    if(SUCCESS == result)
+    {
+      result = GetStreamingFromPPD(p_ppd, p_config);
+    }
+
+    if(SUCCESS == result)
+    {
+      result = GetBlankFeedFromPPD(p_ppd, p_config);
+    }
+
+    if(SUCCESS == result)
+    {
+      result = GetBandHeightFromPPD(p_ppd, p_config);
+    }
+
+    if(SUCCESS == result)
+    {
+      result = GetGraphicsCacheFromPPD(p_ppd, p_config);
+    }
+
+    if(SUCCESS == result)
+    {
+      result = GetColumnCropFromPPD(p_ppd, p_config);
+    }
+
+    if(SUCCESS == result)
+    {
+      result = GetDitheringFromPPD(p_ppd, p_config);
+    }
+
+    if(SUCCESS == result)
+    {
+      result = GetContinuousRollFromPPD(p_ppd, p_config);
+    }
+
+    if(SUCCESS == result)
+    {
+      result = GetFlowControlFromPPD(p_ppd, p_config);
+    }
+  }
+  // Unload the PPD file
+  ppdClose(p_ppd);
+  return result;
+}
+
+static result_t GetModelSpecificFromPPD(ppd_file_t *p_ppd, EPTMS_CONFIG_T *p_config)
+{
+  {
+    char ppdKeyMotionUnit[] = "TmxMotionUnitHori";
+    ppd_attr_t *p_attribute = ppdFindAttr(p_ppd, ppdKeyMotionUnit, nullptr);
+
+    if(nullptr == p_attribute)
+    {
+      return E_GETMODELPPD_ATTR_HMOTION_NOTFIND;
+    }
+
+    p_config->h_motionUnit = (unsigned char)atol(p_attribute->value);
+
+    if((0 == p_config->h_motionUnit) || (255 < p_config->h_motionUnit)) // GS P Command Specification
+    {
+      return E_GETMODELPPD_ATTR_HMOTION_OUT_OF_RANGE;
+    }
+  }
+  {
+    char ppdKeyMotionUnit[] = "TmxMotionUnitVert";
+    ppd_attr_t *p_attribute = ppdFindAttr(p_ppd, ppdKeyMotionUnit, nullptr);
+
+    if(nullptr == p_attribute)
+    {
+      return E_GETMODELPPD_ATTR_VMOTION_NOTFIND;
+    }
+
+    p_config->v_motionUnit = (unsigned char)atol(p_attribute->value);
+
+    if((0 == p_config->v_motionUnit) || (255 < p_config->v_motionUnit)) // GS P Command Specification
+    {
+      return E_GETMODELPPD_ATTR_VMOTION_OUT_OF_RANGE;
+    }
+  }
+  return SUCCESS;
+}
+
+static result_t GetPaperReductionFromPPD(ppd_file_t *p_ppd, EPTMS_CONFIG_T *p_config)
+{
+  char ppdKey[] = "TmxPaperReduction";
+  ppd_choice_t *p_choice = ppdFindMarkedChoice(p_ppd, ppdKey);
+
+  if(nullptr == p_choice)
+  {
+    return E_GETPAPERREDUCPPD_ATTR_NOTFIND;
+  }
+
+  if(0 == strcmp("Off", p_choice->choice))
+  {
+    p_config->paperReduction = TmPaperReductionOff;
+  }
+  else if(0 == strcmp("Top", p_choice->choice))
+  {
+    p_config->paperReduction = TmPaperReductionTop;
+  }
+  else if(0 == strcmp("Bottom", p_choice->choice))
+  {
+    p_config->paperReduction = TmPaperReductionBottom;
+  }
+  else if(0 == strcmp("Both", p_choice->choice))
+  {
+    p_config->paperReduction = TmPaperReductionBoth;
+  }
+  else
+  {
+    return E_GETPAPERREDUCPPD_ATTR_OUT_OF_RANGE;
+  }
+
+  return SUCCESS;
+}
+
+static result_t GetBuzzerAndDrawerFromPPD(ppd_file_t *p_ppd, EPTMS_CONFIG_T *p_config)
+{
+  char ppdKey[] = "TmxBuzzerAndDrawer";
+  ppd_choice_t *p_choice = ppdFindMarkedChoice(p_ppd, ppdKey);
+
+  if(nullptr == p_choice)
+  {
+    return E_GETBUZZERDRAWERPPD_ATTR_NOTFIND;
+  }
+
+  if(0 == strcmp("NotUsed", p_choice->choice))
+  {
+    p_config->buzzerControl = TmBuzzerNotUsed;
+    p_config->drawerControl = TmDrawerNotUsed;
+  }
+  else if(0 == strcmp("InternalBuzzer", p_choice->choice))
+  {
+    p_config->buzzerControl = TmBuzzerInternal;
+  }
+  else if(0 == strcmp("ExternalBuzzer", p_choice->choice))
+  {
+    p_config->buzzerControl = TmBuzzerExternal;
+  }
+  else if(0 == strcmp("OpenDrawer1", p_choice->choice))
+  {
+    p_config->drawerControl = TmDrawer1;
+  }
+  else if(0 == strcmp("OpenDrawer2", p_choice->choice))
+  {
+    p_config->drawerControl = TmDrawer2;
+  }
+  else
+  {
+    return E_GETBUZZERDRAWERPPD_ATTR_OUT_OF_RANGE;
+  }
+
+  return SUCCESS;
+}
+
+static result_t GetPaperCutFromPPD(ppd_file_t *p_ppd, EPTMS_CONFIG_T *p_config)
+{
+  char ppdKey[] = "TmxPaperCut";
+  ppd_choice_t *p_choice = ppdFindMarkedChoice(p_ppd, ppdKey);
+
+  if(nullptr == p_choice)
+  {
+    return E_GETPAPERCUTPPD_ATTR_NOTFIND;
+  }
+
+  if(0 == strcmp("NoCut", p_choice->choice))
+  {
+    p_config->cutControl = TmNoCut;
+  }
+  else if(0 == strcmp("CutPerJob", p_choice->choice))
+  {
+    p_config->cutControl = TmCutPerJob;
+  }
+  else if(0 == strcmp("CutPerPage", p_choice->choice))
+  {
+    p_config->cutControl = TmCutPerPage;
+  }
+  else
+  {
+    return E_GETPAPERCUTPPD_ATTR_OUT_OF_RANGE;
+  }
+
+  return SUCCESS;
+}
+
+static result_t GetOutputFlushFromPPD(ppd_file_t *p_ppd, EPTMS_CONFIG_T *p_config)
+{
+  char ppdKey[] = "TmxOutputFlush";
+  ppd_choice_t *p_choice = ppdFindMarkedChoice(p_ppd, ppdKey);
+
+  if(nullptr == p_choice) // PPD files installed before this option existed.
+  {
+    p_config->flushControl = TmFlushPerPage;
+    return SUCCESS;
+  }
+
+  if(0 == strcmp("PerPage", p_choice->choice))
+  {
+    p_config->flushControl = TmFlushPerPage;
+  }
+  else if(0 == strcmp("PerBand", p_choice->choice))
+  {
+    p_config->flushControl = TmFlushPerBand;
+  }
+  else
+  {
+    return E_GETOUTPUTFLUSHPPD_ATTR_OUT_OF_RANGE;
+  }
+
+  return SUCCESS;
+}
+
+static result_t GetStreamingFromPPD(ppd_file_t *p_ppd, EPTMS_CONFIG_T *p_config)
+{
+  char ppdKey[] = "TmxStreaming";
+  ppd_choice_t *p_choice = ppdFindMarkedChoice(p_ppd, ppdKey);
+
+  if(nullptr == p_choice) // PPD files installed before this option existed.
+  {
+    p_config->streamingControl = TmStreamingOff;
+    return SUCCESS;
+  }
+
+  if(0 == strcmp("Off", p_choice->choice))
+  {
+    p_config->streamingControl = TmStreamingOff;
+  }
+  else if(0 == strcmp("On", p_choice->choice))
+  {
+    p_config->streamingControl = TmStreamingOn;
+  }
+  else if(0 == strcmp("Threaded", p_choice->choice))
+  {
+    p_config->streamingControl = TmStreamingThreaded;
+  }
+  else
+  {
+    return E_GETSTREAMINGPPD_ATTR_OUT_OF_RANGE;
+  }
+
+  return SUCCESS;
+}
+
+static result_t GetBlankFeedFromPPD(ppd_file_t *p_ppd, EPTMS_CONFIG_T *p_config)
+{
+  char ppdKey[] = "TmxBlankFeed";
+  ppd_choice_t *p_choice = ppdFindMarkedChoice(p_ppd, ppdKey);
+
+  if(nullptr == p_choice) // PPD files installed before this option existed.
+  {
+    p_config->blankFeedLines = EPTMD_BLANK_FEED_LINES;
+    return SUCCESS;
+  }
+
+  if(0 == strcmp("Off", p_choice->choice))
+  {
+    p_config->blankFeedLines = 0;
+  }
+  else if(0 == strcmp("On", p_choice->choice))
+  {
+    p_config->blankFeedLines = EPTMD_BLANK_FEED_LINES;
+  }
+  else
+  {
+    return E_GETBLANKFEEDPPD_ATTR_OUT_OF_RANGE;
+  }
+
+  return SUCCESS;
+}
+
+static result_t GetBandHeightFromPPD(ppd_file_t *p_ppd, EPTMS_CONFIG_T *p_config)
+{
+  char ppdKey[] = "TmxBandHeight";
+  ppd_choice_t *p_choice = ppdFindMarkedChoice(p_ppd, ppdKey);
+
+  if((nullptr == p_choice) || (0 == strcmp("Auto", p_choice->choice))) // Not in PPD files installed before this option existed.
+  {
+    p_config->bandHeight = 0;
+    return SUCCESS;
+  }
+
+  p_config->bandHeight = (unsigned)atol(p_choice->choice);
+
+  if((0 == p_config->bandHeight) || (EPTMD_MAX_BAND_LINES < p_config->bandHeight))
+  {
+    return E_GETBANDHEIGHTPPD_ATTR_OUT_OF_RANGE;
+  }
+
+  return SUCCESS;
+}
+
+static result_t GetGraphicsCacheFromPPD(ppd_file_t *p_ppd, EPTMS_CONFIG_T *p_config)
+{
+  char ppdKey[] = "TmxGraphicsCache";
+  ppd_choice_t *p_choice = ppdFindMarkedChoice(p_ppd, ppdKey);
+
+  if(nullptr == p_choice) // PPD files installed before this option existed.
+  {
+    p_config->graphicsCache = TmGraphicsCacheOff;
+    return SUCCESS;
+  }
+
+  if(0 == strcmp("Off", p_choice->choice))
+  {
+    p_config->graphicsCache = TmGraphicsCacheOff;
+  }
+  else if(0 == strcmp("On", p_choice->choice))
+  {
+    p_config->graphicsCache = TmGraphicsCacheOn;
+  }
+  else
+  {
+    return E_GETGRAPHICSCACHEPPD_ATTR_OUT_OF_RANGE;
+  }
+
+  return SUCCESS;
+}
+
+static result_t GetColumnCropFromPPD(ppd_file_t *p_ppd, EPTMS_CONFIG_T *p_config)
+{
+  char ppdKey[] = "TmxColumnCrop";
+  ppd_choice_t *p_choice = ppdFindMarkedChoice(p_ppd, ppdKey);
+
+  if(nullptr == p_choice) // PPD files installed before this option existed.
+  {
+    p_config->columnCrop = TmColumnCropOn;
+    return SUCCESS;
+  }
+
+  if(0 == strcmp("Off", p_choice->choice))
+  {
+    p_config->columnCrop = TmColumnCropOff;
+  }
+  else if(0 == strcmp("On", p_choice->choice))
+  {
+    p_config->columnCrop = TmColumnCropOn;
+  }
+  else
+  {
+    return E_GETCOLUMNCROPPPD_ATTR_OUT_OF_RANGE;
+  }
+
+  return SUCCESS;
+}
+
+static result_t GetDitheringFromPPD(ppd_file_t *p_ppd, EPTMS_CONFIG_T *p_config)
+{
+  char ppdKey[] = "TmxDithering";
+  ppd_choice_t *p_choice = ppdFindMarkedChoice(p_ppd, ppdKey);
+
+  if(nullptr == p_choice) // PPD files installed before this option existed.
+  {
+    p_config->dithering = TmDitheringRasterizer;
+    return SUCCESS;
+  }
+
+  if(0 == strcmp("Rasterizer", p_choice->choice))
+  {
+    p_config->dithering = TmDitheringRasterizer;
+  }
+  else if(0 == strcmp("Ordered", p_choice->choice))
+  {
+    p_config->dithering = TmDitheringOrdered;
+  }
+  else if(0 == strcmp("Diffusion", p_choice->choice))
+  {
+    p_config->dithering = TmDitheringDiffusion;
+  }
+  else
+  {
+    return E_GETDITHERINGPPD_ATTR_OUT_OF_RANGE;
+  }
+
+  return SUCCESS;
+}
+
+// Needs TmxPaperCut and TmxStreaming.
+static result_t GetContinuousRollFromPPD(ppd_file_t *p_ppd, EPTMS_CONFIG_T *p_config)
+{
+  char ppdKey[] = "TmxContinuousRoll";
+  ppd_choice_t *p_choice = ppdFindMarkedChoice(p_ppd, ppdKey);
+
+  if(nullptr == p_choice) // PPD files installed before this option existed.
+  {
+    p_config->continuousRoll = TmContinuousRollOff;
+    return SUCCESS;
+  }
+
+  if(0 == strcmp("Off", p_choice->choice))
+  {
+    p_config->continuousRoll = TmContinuousRollOff;
+  }
+  else if(0 == strcmp("On", p_choice->choice))
+  {
+    p_config->continuousRoll = TmContinuousRollOn;
+  }
+  else
+  {
+    return E_GETCONTINUOUSROLLPPD_ATTR_OUT_OF_RANGE;
+  }
+
+  // Pages cut apart are not a roll.
+  if(TmCutPerPage == p_config->cutControl)
+  {
+    p_config->continuousRoll = TmContinuousRollOff;
+  }
+
+  // The roll is one stream of lines, which page buffers cannot hold.
+  if((TmContinuousRollOn == p_config->continuousRoll) && (TmStreamingOff == p_config->streamingControl))
+  {
+    p_config->streamingControl = TmStreamingOn;
+  }
+
+  return SUCCESS;
+}
+
+static result_t GetFlowControlFromPPD(ppd_file_t *p_ppd, EPTMS_CONFIG_T *p_config)
+{
+  char ppdKey[] = "TmxFlowControl";
+  ppd_choice_t *p_choice = ppdFindMarkedChoice(p_ppd, ppdKey);
+
+  if(nullptr == p_choice) // PPD files installed before this option existed.
+  {
+    p_config->flowControl = TmFlowControlOff;
+    return SUCCESS;
+  }
+
+  if(0 == strcmp("Off", p_choice->choice))
+  {
+    p_config->flowControl = TmFlowControlOff;
+  }
+  else if(0 == strcmp("On", p_choice->choice))
+  {
+    p_config->flowControl = TmFlowControlOn;
+  }
+  else
+  {
+    return E_GETFLOWCONTROLPPD_ATTR_OUT_OF_RANGE;
+  }
+
+  return SUCCESS;
+}
+
+static result_t DoJob(EPTMS_ENCODER_T *p_encoder)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  EPTMS_JOB_INFO_T *p_jobInfo = &p_encoder->jobInfo;
+  result_t result = SUCCESS;
+  unsigned page = 0;
+  result = StartJob(p_encoder);
+
+  while(SUCCESS == result)
+  {
+    if(0 == cupsRasterReadHeader2(p_jobInfo->p_raster, &p_jobInfo->pageHeader))
+    {
+      result = SUCCESS;
+      break;
+    }
+
+    page++;
+    fprintf(p_encoder->p_log, "PAGE: %u %d\n", page, p_jobInfo->pageHeader.NumCopies);
+    fprintf(p_encoder->p_log, "DEBUG: cupsBytesPerLine = %u\n", p_jobInfo->pageHeader.cupsBytesPerLine);
+    fprintf(p_encoder->p_log, "DEBUG: cupsBitsPerPixel = %u\n", p_jobInfo->pageHeader.cupsBitsPerPixel);
+    fprintf(p_encoder->p_log, "DEBUG: cupsBitsPerColor = %u\n", p_jobInfo->pageHeader.cupsBitsPerColor);
+    fprintf(p_encoder->p_log, "DEBUG: cupsHeight = %u\n", p_jobInfo->pageHeader.cupsHeight);
+    fprintf(p_encoder->p_log, "DEBUG: cupsWidth = %u\n", p_jobInfo->pageHeader.cupsWidth);
+
+    if(!SetDither(p_config, &p_jobInfo->pageHeader, &p_jobInfo->dither))
+    {
+      result = 2001;
+      break;
+    }
+
+    result = DoPage(p_encoder);
+  }
+
+  // The roll ends with the job.
+  if(p_encoder->stream.open)
+  {
+    result_t roll_result = EndRoll(p_encoder, (SUCCESS == result));
+
+    if(SUCCESS == result)
+    {
+      result = roll_result;
+    }
+  }
+
+  fprintf(p_encoder->p_log, "DEBUG: paper reduction = %lu lines (%.1f mm)\n", p_jobInfo->reducedLines, p_jobInfo->reducedLength);
+
+  // Free buffers of page.
+  FreeArena(&p_jobInfo->arena);
+  p_jobInfo->p_lineBuffer = nullptr;
+  p_jobInfo->p_pageBuffer = nullptr;
+  p_jobInfo->p_blankLines = nullptr;
+  p_jobInfo->p_bandBuffer = nullptr;
+  p_jobInfo->p_slotBuffer = nullptr;
+  p_jobInfo->dither.p_errors = nullptr;
+  std::vector<unsigned char>().swap(p_encoder->pageRecord);
+
+  if(SUCCESS != result)
+  {
+    EndJob(p_encoder, &p_jobInfo->pageHeader);
+  }
+  else
+  {
+    result = EndJob(p_encoder, &p_jobInfo->pageHeader);
+  }
+
+  // Deliver whatever is still pending, a canceled job ends with the cleanup sequence.
+  if(0 != p_encoder->canceled)
+  {
+    WriteCancelSequence(p_encoder);
+  }
+  else
+  {
+    FlushData(p_encoder);
+  }
+
+  // Bands stored during a failed job may not have reached the printer.
+  if(SUCCESS == result)
+  {
+    SaveGraphicsCache(p_encoder);
+  }
+
+  return result;
+}
+
+static result_t StartJob(EPTMS_ENCODER_T *p_encoder)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  result_t result = SUCCESS;
+
+  if(0 != p_encoder->canceled)
+  {
+    return CANCEL;
+  }
+
+  LoadGraphicsCache(p_encoder);
+
+  {
+    // Write configuration commands.
+    unsigned char CommandSetDevice[3 + 2] = { ESC, '=', 0x01, ESC, '@' };
+    result = WriteData(p_encoder, CommandSetDevice, sizeof(CommandSetDevice));
+
+    if(SUCCESS != result)
+    {
+      return E_STARTJOB_FAILED_SET_DEVICE;
+    }
+
+    unsigned char CommandSetPrintSheet[4] = { ESC, 'c', '0', 0x02 };
+    result = WriteData(p_encoder, CommandSetPrintSheet, sizeof(CommandSetPrintSheet));
+
+    if(SUCCESS != result)
+    {
+      return E_STARTJOB_FAILED_SET_PRINT_SHEET;
+    }
+
+    unsigned char CommandSetConfigSheet[4] = { ESC, 'c', '1', 0x02 };
+    result = WriteData(p_encoder, CommandSetConfigSheet, sizeof(CommandSetConfigSheet));
+
+    if(SUCCESS != result)
+    {
+      return E_STARTJOB_FAILED_SET_CONFIG_SHEET;
+    }
+
+    unsigned char CommandSetNearendPrint[4] = { ESC, 'c', '3', 0x00 };
+    result = WriteData(p_encoder, CommandSetNearendPrint, sizeof(CommandSetNearendPrint));
+
+    if(SUCCESS != result)
+    {
+      return E_STARTJOB_FAILED_SET_NEAREND_PRINT;
+    }
+
+    unsigned char CommandSetBaseMotionUnit[4] = { GS, 'P', 0x00, 0x00 };
+    CommandSetBaseMotionUnit[2] = p_config->h_motionUnit & 0xff;
+    CommandSetBaseMotionUnit[3] = p_config->v_motionUnit;
+    result = WriteData(p_encoder, CommandSetBaseMotionUnit, sizeof(CommandSetBaseMotionUnit));
+
+    if(SUCCESS != result)
+    {
+      return E_STARTJOB_FAILED_SET_BASE_MOTION_UNIT;
+    }
+  }
+
+  // The printer is asked for its NV graphics before it sends its status.
+  result = PrepareGraphicsCache(p_encoder);
+
+  if(SUCCESS != result)
+  {
+    return E_STARTJOB_FAILED_GRAPHICS_CACHE;
+  }
+
+  // Printer status.
+  result = EnableStatusBack(p_encoder);
+
+  if(SUCCESS != result)
+  {
+    return E_STARTJOB_FAILED_SET_STATUS_BACK;
+  }
+
+  // Drawer open.
+  result = OpenDrawer(p_encoder);
+
+  if(SUCCESS != result)
+  {
+    return E_STARTJOB_FAILED_OPEN_DRAWER;
+  }
+
+  // Sound buzzer.
+  result = SoundBuzzer(p_encoder);
+
+  if(SUCCESS != result)
+  {
+    return E_STARTJOB_FAILED_SOUND_BUZZER;
+  }
+
+  // Send user file.
+  result = WriteUserFile(p_encoder, p_config->p_printerName, TmUserFileStartJob);
+
+  if(SUCCESS != result)
+  {
+    return E_STARTJOB_FAILED_WRITE_USER_FILE;
+  }
+
+  return SUCCESS;
+}
+
+static result_t OpenDrawer(EPTMS_ENCODER_T *p_encoder)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  result_t result = SUCCESS;
+
+  if(TmDrawerNotUsed == p_config->drawerControl)
+  {
+    return SUCCESS;
+  }
+
+  unsigned char Command[5] = { ESC, 'p', 0, 50 /* on time */, 200 /* off time */ };
+  Command[2] = static_cast<unsigned char>(p_config->drawerControl - 1); // pin no
+  result = WriteData(p_encoder, Command, sizeof(Command));
+  return result;
+}
+
+static result_t SoundBuzzer(EPTMS_ENCODER_T *p_encoder)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  result_t result = SUCCESS;
+
+  if(TmBuzzerNotUsed == p_config->buzzerControl)
+  {
+    return SUCCESS;
+  }
+  else if(TmBuzzerInternal == p_config->buzzerControl) // Sound internal buzzer
+  {
+    unsigned char Command[5] = { ESC, 'p', 1/* pin no */, 50/* on time */, 200/* off time */ };
+    int n;
+
+    for(n = 0; n < 1 /* repeat count */; n++)
+    {
+      result = WriteData(p_encoder, Command, sizeof(Command));
+
+      if(SUCCESS != result)
+      {
+        return result;
+      }
+    }
+  }
+  else if(TmBuzzerExternal == p_config->buzzerControl) // Sound external buzzer
+  {
+    unsigned char Command[10] = { ESC, '(', 'A', 5, 0, 97, 100, 1, 50/* on time */, 200/* off time */ };
+    result = WriteData(p_encoder, Command, sizeof(Command));
+
+    if(SUCCESS != result)
+    {
+      return result;
+    }
+  }
+  else {}
+
+  return SUCCESS;
+}
+
+static result_t EndJob(EPTMS_ENCODER_T *p_encoder, cups_page_header2_t *)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  result_t result = SUCCESS;
+
+  if(0 != p_encoder->canceled)
+  {
+    return CANCEL;
+  }
+
+  // Send user file.
+  result = WriteUserFile(p_encoder, p_config->p_printerName, TmUserFileEndJob);
+
+  if(SUCCESS != result)
+  {
+    return E_ENDJOB_FAILED_WRITE_USER_FILE;
+  }
+
+  // Feed and cut paper.
+  unsigned char Command[3 + 4] = { ESC, 'J', 0, GS, 'V', 66, 0 };
+
+  switch(p_config->cutControl)
+  {
+    case TmCutPerJob:
+      result = WriteData(p_encoder, Command, sizeof(Command));
+
+      if(SUCCESS != result)
+      {
+        return 2202;
+      }
+
+      break;
+
+    default:
+      break;
+  }
+
+  // The printer status is only read during the job.
+  if(p_encoder->printer.statusBack)
+  {
+    unsigned char CommandStatusBack[3] = { GS, 'a', 0x00 };
+    result = WriteData(p_encoder, CommandStatusBack, sizeof(CommandStatusBack));
+
+    if(SUCCESS != result)
+    {
+      return E_ENDJOB_FAILED_SET_STATUS_BACK;
+    }
+  }
+
+  // Flush output at job end.
+  result = FlushData(p_encoder);
+
+  if(SUCCESS != result)
+  {
+    return E_ENDJOB_FAILED_FLUSH;
+  }
+
+  return SUCCESS;
+}
+
+static result_t DoPage(EPTMS_ENCODER_T *p_encoder)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  EPTMS_JOB_INFO_T *p_jobInfo = &p_encoder->jobInfo;
+  unsigned copies = (1 < p_jobInfo->pageHeader.NumCopies) ? p_jobInfo->pageHeader.NumCopies : 1;
+  // On a continuous roll the page only adds lines to the stream of the job.
+  bool merged = (TmContinuousRollOn == p_config->continuousRoll) && (1 == copies);
+  // The writer thread of a threaded roll updates the timing and the output
+  // counters until the roll ends, EndRoll reports them for the whole roll.
+  bool threaded_roll = merged && (TmStreamingThreaded == p_config->streamingControl);
+  result_t result = SUCCESS;
+
+  // A page that cannot follow the roll ends it.
+  if(p_encoder->stream.open && !(merged && IsStreamCompatible(p_encoder, &p_jobInfo->pageHeader)))
+  {
+    result = EndRoll(p_encoder, true);
+  }
+
+  EPTMS_TIMING_T page_start = {};
+  unsigned long long start_bytes = 0;
+  double start_write_time = 0;
+
+  if(!threaded_roll)
+  {
+    page_start = p_encoder->timing;
+    start_bytes = p_encoder->output.bytes;
+    start_write_time = p_encoder->output.writeTime;
+  }
+
+  // The page is encoded once, the other copies replay its commands.
+  if(1 < copies)
+  {
+    p_encoder->pageRecord.clear();
+    p_encoder->output.p_record = &p_encoder->pageRecord;
+  }
+
+  bool resumed = p_encoder->stream.open;
+  unsigned reduced_lines = 0;
+  unsigned long long allocations = p_jobInfo->arena.allocations;
+
+  // The roll keeps the band height of its first page.
+  if(!resumed)
+  {
+    if(SUCCESS == result)
+    {
+      result = StartPage(p_encoder);
+    }
+
+    p_config->maxBandLines = GetMaxBandLines(p_config, &p_jobInfo->pageHeader);
+    fprintf(p_encoder->p_log, "DEBUG: maxBandLines = %u\n", p_config->maxBandLines);
+    // No writer thread runs without a roll, so the kernel is only changed here.
+    p_jobInfo->p_kernel = GetRasterKernelForWidth(GetRasterKernel(), EPTMD_BITS_TO_BYTES(p_jobInfo->pageHeader.cupsWidth));
+    fprintf(p_encoder->p_log, "DEBUG: raster kernel = %s/%u\n", p_jobInfo->p_kernel->p_name, p_jobInfo->p_kernel->BytesPerLine);
+
+    if(SUCCESS == result)
+    {
+      result = ReservePageBuffers(p_config, p_jobInfo);
+    }
+
+    fprintf(p_encoder->p_log, "DEBUG: page buffers = %zu bytes, %llu allocations\n",
+            p_jobInfo->arena.capacity, p_jobInfo->arena.allocations - allocations);
+  }
+  else if(nullptr != p_jobInfo->dither.p_errors)
+  {
+    // Pages of the roll keep the buffers of its first page, in use by the
+    // writer thread, only the error diffusion starts again.
+    memset(p_jobInfo->dither.p_errors, 0, (p_jobInfo->pageHeader.cupsWidth + 2) * sizeof(int));
+  }
+
+  if(TmStreamingOff != p_config->streamingControl)
+  {
+    if((SUCCESS == result) && !resumed)
+    {
+      result = OpenStream(p_encoder);
+    }
+
+    if(SUCCESS == result)
+    {
+      result = StreamRaster(p_encoder, &reduced_lines);
+    }
+
+    if(!merged || (SUCCESS != result))
+    {
+      result_t stream_result = CloseStream(p_encoder, (SUCCESS == result), &reduced_lines);
+
+      if(SUCCESS == result)
+      {
+        result = stream_result;
+      }
+    }
+  }
+  else
+  {
+    if(SUCCESS == result)
+    {
+      double start_time = StartPhase(TmPhaseReadRaster);
+      result = ReadRaster(p_encoder, &p_jobInfo->pageHeader, p_jobInfo->p_raster, &p_jobInfo->dither, p_jobInfo->p_lineBuffer, p_jobInfo->p_pageBuffer, 
+                          p_config->maxBandLines);
+      EndPhase(p_encoder, TmPhaseReadRaster, start_time);
+    }
+
+    if(SUCCESS == result)
+    {
+      // Classify blank lines once for all trimming stages.
+      if(IsBlankLineNeeded(p_config))
+      {
+        double start_time = StartPhase(TmPhaseBlankScan);
+        p_jobInfo->p_kernel->FindBlankLines(p_jobInfo->p_pageBuffer, EPTMD_BITS_TO_BYTES(p_jobInfo->pageHeader.cupsWidth),
+                                            p_jobInfo->pageHeader.cupsHeight, p_jobInfo->p_blankLines);
+        EndPhase(p_encoder, TmPhaseBlankScan, start_time);
+      }
+
+      result = WriteRaster(p_encoder, &p_jobInfo->pageHeader, p_jobInfo->p_pageBuffer, p_jobInfo->p_blankLines, &reduced_lines);
+    }
+  }
+
+  CountReducedLines(p_encoder, &p_jobInfo->pageHeader, reduced_lines);
+
+  // Recorded pages never join a roll, so no writer thread reads p_record here.
+  if(1 < copies)
+  {
+    p_encoder->output.p_record = nullptr;
+  }
+
+  // The roll is ended by a later page or by the end of the job.
+  if((SUCCESS == result) && !p_encoder->stream.open)
+  {
+    result = EndPage(p_encoder, &p_jobInfo->pageHeader);
+  }
+
+  for(unsigned copy = 1; (SUCCESS == result) && (copy < copies); copy++)
+  {
+    result = ReplayPage(p_encoder, &p_jobInfo->pageHeader);
+  }
+
+  if(1 < copies)
+  {
+    fprintf(p_encoder->p_log, "DEBUG: page copies = %u (%zu bytes replayed each)\n", copies, p_encoder->pageRecord.size());
+  }
+
+  if(!threaded_roll)
+  {
+    fprintf_TimingLog(p_encoder, "page", &page_start, p_encoder->output.bytes - start_bytes, p_encoder->output.writeTime - start_write_time);
+  }
+
+  return result;
+}
+
+// Sends the lines held by the roll and ends it as a page, 'complete' is
+// false after an error and only stops the stream.
+static result_t EndRoll(EPTMS_ENCODER_T *p_encoder, bool complete)
+{
+  EPTMS_STREAM_T *p_stream = &p_encoder->stream;
+  bool threaded = (nullptr != p_stream->p_pipeline);
+  unsigned reduced_lines = 0;
+  result_t result = CloseStream(p_encoder, complete, &reduced_lines);
+  CountReducedLines(p_encoder, &p_stream->header, reduced_lines);
+
+  // The writer thread is joined, its pages were not reported one by one.
+  if(threaded)
+  {
+    fprintf_TimingLog(p_encoder, "roll", &p_stream->startTiming, p_encoder->output.bytes - p_stream->startBytes,
+                      p_encoder->output.writeTime - p_stream->startWriteTime);
+  }
+
+  if(complete && (SUCCESS == result))
+  {
+    result = EndPage(p_encoder, &p_encoder->stream.header);
+  }
+
+  return result;
+}
+
+static void CountReducedLines(EPTMS_ENCODER_T *p_encoder, cups_page_header2_t *p_header, unsigned lines)
+{
+  EPTMS_JOB_INFO_T *p_jobInfo = &p_encoder->jobInfo;
+  p_jobInfo->reducedLines += lines;
+  p_encoder->timing.blankLines += lines;
+
+  if(0 != p_header->HWResolution[1])
+  {
+    p_jobInfo->reducedLength += (lines * 25.4) / p_header->HWResolution[1];
+  }
+}
+
+// Automatic band height keeps the raster bytes of a band below the target,
+// in whole rows of the rasterizer.
+static unsigned GetMaxBandLines(EPTMS_CONFIG_T *p_config, cups_page_header2_t *p_header)
+{
+  unsigned BytesPerLine = EPTMD_BITS_TO_BYTES(p_header->cupsWidth);
+
+  if((0 != p_config->bandHeight) || (0 == BytesPerLine))
+  {
+    return (0 != p_config->bandHeight) ? p_config->bandHeight : EPTMD_MAX_BAND_LINES;
+  }
+
+  unsigned lines = EPTMD_BAND_TARGET_BYTES / BytesPerLine;
+
+  if((0 < p_header->cupsRowCount) && (p_header->cupsRowCount <= lines))
+  {
+    lines -= lines % p_header->cupsRowCount;
+  }
+
+  if(0 == lines)
+  {
+    lines = 1;
+  }
+  else if(EPTMD_MAX_BAND_LINES < lines)
+  {
+    lines = EPTMD_MAX_BAND_LINES;
+  }
+
+  return lines;
+}
+
+// Lays out the buffers needed by the page in the job arena, which only
+// grows when a page is larger than all the previous ones.
+static result_t ReservePageBuffers(EPTMS_CONFIG_T *p_config, EPTMS_JOB_INFO_T *p_jobInfo)
+{
+  cups_page_header2_t *p_header = &p_jobInfo->pageHeader;
+  std::size_t BytesPerLine = EPTMD_BITS_TO_BYTES(p_header->cupsWidth);
+  std::size_t line_size = (p_header->cupsBytesPerLine > BytesPerLine) ? p_header->cupsBytesPerLine : BytesPerLine;
+  std::size_t page_size = 0;
+  std::size_t bitmap_size = 0;
+  std::size_t band_size = 0;
+  std::size_t slot_size = 0;
+  std::size_t errors_size = 0;
+
+  if(TmDitheringDiffusion == p_jobInfo->dither.method)
+  {
+    errors_size = (p_header->cupsWidth + 2) * sizeof(int);
+  }
+
+  if(TmStreamingOff == p_config->streamingControl)
+  {
+    line_size = IsDirectRead(p_header, &p_jobInfo->dither) ? 0 : line_size;
+    page_size = p_header->cupsHeight * BytesPerLine;
+    bitmap_size = EPTMD_BITMAP_WORDS(p_header->cupsHeight) * sizeof(std::uint64_t);
+  }
+  else
+  {
+    band_size = (p_config->maxBandLines + 1) * BytesPerLine;
+
+    if(TmStreamingThreaded == p_config->streamingControl)
+    {
+      slot_size = EPTMD_PIPELINE_BANDS * p_config->maxBandLines * BytesPerLine;
+    }
+  }
+
+  std::size_t size = EPTMD_ARENA_ALIGN(line_size) + EPTMD_ARENA_ALIGN(page_size) + EPTMD_ARENA_ALIGN(bitmap_size)
+                     + EPTMD_ARENA_ALIGN(band_size) + EPTMD_ARENA_ALIGN(slot_size) + EPTMD_ARENA_ALIGN(errors_size);
+
+  if(SUCCESS != ReserveArena(&p_jobInfo->arena, size))
+  {
+    return E_DOPAGE_FAILED_DATA_ALLOC;
+  }
+
+  unsigned char *p_next = p_jobInfo->arena.p_base;
+  p_jobInfo->p_lineBuffer = (0 < line_size) ? p_next : nullptr;
+  p_next += EPTMD_ARENA_ALIGN(line_size);
+  p_jobInfo->p_pageBuffer = (0 < page_size) ? p_next : nullptr;
+  p_next += EPTMD_ARENA_ALIGN(page_size);
+  p_jobInfo->p_blankLines = (0 < bitmap_size) ? reinterpret_cast<std::uint64_t *>(p_next) : nullptr;
+  p_next += EPTMD_ARENA_ALIGN(bitmap_size);
+  p_jobInfo->p_bandBuffer = (0 < band_size) ? p_next : nullptr;
+  p_next += EPTMD_ARENA_ALIGN(band_size);
+  p_jobInfo->p_slotBuffer = (0 < slot_size) ? p_next : nullptr;
+  p_next += EPTMD_ARENA_ALIGN(slot_size);
+  p_jobInfo->dither.p_errors = (0 < errors_size) ? reinterpret_cast<int *>(p_next) : nullptr;
+
+  if(0 < errors_size)
+  {
+    memset(p_next, 0, errors_size);
+  }
+
+  return SUCCESS;
+}
+
+// Grows the arena geometrically, the previous contents are not kept.
+static result_t ReserveArena(EPTMS_ARENA_T *p_arena, std::size_t size)
+{
+  if(size <= p_arena->capacity)
+  {
+    return SUCCESS;
+  }
+
+  std::size_t capacity = ((2 * p_arena->capacity) > size) ? (2 * p_arena->capacity) : size;
+  void *p_base = nullptr;
+  FreeArena(p_arena);
+
+  if(0 != posix_memalign(&p_base, EPTMD_ARENA_ALIGNMENT, capacity))
+  {
+    return FAILED;
+  }
+
+  p_arena->p_base = static_cast<unsigned char *>(p_base);
+  p_arena->capacity = capacity;
+  p_arena->allocations++;
+  return SUCCESS;
+}
+
+static void FreeArena(EPTMS_ARENA_T *p_arena)
+{
+  free(p_arena->p_base);
+  p_arena->p_base = nullptr;
+  p_arena->capacity = 0;
+}
+
+static result_t StartPage(EPTMS_ENCODER_T *p_encoder)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  int result;
+  // Send user file.
+  result = WriteUserFile(p_encoder, p_config->p_printerName, TmUserFileStartPage);
+
+  if(SUCCESS != result)
+  {
+    return E_STARTPAGE_FAILED_WRITE_USER_FILE;
+  }
+
+  return SUCCESS;
+}
+
+static result_t EndPage(EPTMS_ENCODER_T *p_encoder, cups_page_header2_t *)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  int result;
+
+  if(0 != p_encoder->canceled)
+  {
+    return CANCEL;
+  }
+
+  // Send user file.
+  result = WriteUserFile(p_encoder, p_config->p_printerName, TmUserFileEndPage);
+
+  if(SUCCESS != result)
+  {
+    return E_ENDPAGE_FAILED_WRITE_USER_FILE;
+  }
+
+  // Feed and cut paper.
+  unsigned char Command[3 + 4] = { ESC, 'J', 0, GS, 'V', 66, 0 };
+
+  switch(p_config->cutControl)
+  {
+    case TmCutPerPage:
+      result = WriteData(p_encoder, Command, sizeof(Command));
+
+      if(SUCCESS != result)
+      {
+        return 3202;
+      }
+
+      break;
+
+    default:
+      break;
+  }
+
+  // Flush output at page end.
+  result = FlushData(p_encoder);
+
+  if(SUCCESS != result)
+  {
+    return E_ENDPAGE_FAILED_FLUSH;
+  }
+
+  return SUCCESS;
+}
+
+static result_t ReplayPage(EPTMS_ENCODER_T *p_encoder, cups_page_header2_t *p_header)
+{
+  if(0 != p_encoder->canceled)
+  {
+    return CANCEL;
+  }
+
+  if(SUCCESS != WaitPrinter(p_encoder))
+  {
+    return CANCEL;
+  }
+
+  if(!p_encoder->pageRecord.empty() && (SUCCESS != WriteData(p_encoder, p_encoder->pageRecord.data(), static_cast<unsigned int>(p_encoder->pageRecord.size()))))
+  {
+    return E_REPLAYPAGE_FAILED_WRITE;
+  }
+
+  return EndPage(p_encoder, p_header);
+}
+
+static result_t ReadRaster(EPTMS_ENCODER_T *p_encoder, cups_page_header2_t *p_header, cups_raster_t *p_raster, EPTMS_DITHER_T *p_dither, unsigned char *p_data, unsigned char *p_pageBuffer, unsigned band_lines)
+{
+  result_t result = SUCCESS;
+  unsigned data_size = p_header->cupsBytesPerLine;
+  unsigned BytesPerLine = EPTMD_BITS_TO_BYTES(p_header->cupsWidth);
+  unsigned i;
+
+  // Lines without padding are read a band at a time straight into the page.
+  if(IsDirectRead(p_header, p_dither))
+  {
+    band_lines = (0 < band_lines) ? band_lines : 1;
+
+    for(i = 0; i < p_header->cupsHeight; i += band_lines)
+    {
+      if(0 != p_encoder->canceled)
+      {
+        result = CANCEL;
+        break;
+      }
+
+      unsigned lines = ((p_header->cupsHeight - i) < band_lines) ? (p_header->cupsHeight - i) : band_lines;
+      unsigned num_bytes_read = cupsRasterReadPixels(p_raster, p_pageBuffer + (data_size * i), data_size * lines);
+
+      if((data_size * lines) > num_bytes_read)
+      {
+        fprintf(p_encoder->p_log, "DEBUG: cupsRasterReadPixels() = %u:%u/%u\n", (i + 1), num_bytes_read, data_size * lines);
+        result = E_READRASTER_FAILED_READ_PIXELS;
+        break;
+      }
+    }
+
+    return result;
+  }
+
+  for(i = 0; i < p_header->cupsHeight; i++)
+  {
+    if(0 != p_encoder->canceled)
+    {
+      result = CANCEL;
+      break;
+    }
+
+    unsigned num_bytes_read = cupsRasterReadPixels(p_raster, p_data, data_size);
+
+    if(data_size > num_bytes_read)
+    {
+      fprintf(p_encoder->p_log, "DEBUG: cupsRasterReadPixels() = %u:%u/%u\n", (i + 1), num_bytes_read, data_size);
+      result = E_READRASTER_FAILED_READ_PIXELS;
+      break;
+    }
+
+    if(TmDitheringRasterizer != p_dither->method)
+    {
+      DitherRaster(p_dither, p_data, p_header->cupsWidth, i, p_pageBuffer + (BytesPerLine * i));
+      continue;
+    }
+
+    TransferRaster(p_encoder->jobInfo.p_kernel, p_pageBuffer, p_data, BytesPerLine, i);
+  }
+
+  return result;
+}
+
+static void TransferRaster(const EPTMS_RASTER_KERNEL_T *p_kernel, unsigned char *p_pageBuffer, unsigned char *p_data, unsigned BytesPerLine, unsigned line_no)
+{
+  // Padding bytes past the line width would overrun the last line of the page.
+  p_kernel->CopyLine(p_pageBuffer + (BytesPerLine * line_no), p_data, BytesPerLine);
+}
+
+// The page buffer has the layout of the raster, without a line to convert.
+static bool IsDirectRead(cups_page_header2_t *p_header, EPTMS_DITHER_T *p_dither)
+{
+  return (TmDitheringRasterizer == p_dither->method) && (EPTMD_BITS_TO_BYTES(p_header->cupsWidth) == p_header->cupsBytesPerLine);
+}
+
+// Chooses how the lines of the page become 1 bit, false if the raster cannot be printed.
+static bool SetDither(EPTMS_CONFIG_T *p_config, cups_page_header2_t *p_header, EPTMS_DITHER_T *p_dither)
+{
+  p_dither->method = TmDitheringRasterizer;
+  p_dither->invert = 0;
+  p_dither->p_errors = nullptr;
+
+  if(1 == p_header->cupsBitsPerPixel)
+  {
+    return true;
+  }
+
+  if(8 != p_header->cupsBitsPerPixel)
+  {
+    return false;
+  }
+
+  switch(p_header->cupsColorSpace)
+  {
+    case CUPS_CSPACE_K:
+      p_dither->invert = 0xff;
+      break;
+
+    case CUPS_CSPACE_W:
+    case CUPS_CSPACE_SW:
+      break;
+
+    default:
+      return false;
+  }
+
+  // Gray raster sent by the Rasterizer choice or an older PPD file is dithered as well.
+  p_dither->method = (TmDitheringDiffusion == p_config->dithering) ? TmDitheringDiffusion : TmDitheringOrdered;
+  return true;
+}
+
+// Converts one gray line to 1 bit, p_line may be p_gray.
+static void DitherRaster(EPTMS_DITHER_T *p_dither, const unsigned char *p_gray, unsigned width, unsigned line_no, unsigned char *p_line)
+{
+  if(TmDitheringDiffusion == p_dither->method)
+  {
+    DitherDiffusionRasterLine(p_gray, width, p_dither->invert, p_dither->p_errors, p_line);
+  }
+  else
+  {
+    DitherOrderedRasterLine(p_gray, width, line_no, p_dither->invert, p_line);
+  }
+}
+
+static result_t WriteRaster(EPTMS_ENCODER_T *p_encoder, cups_page_header2_t *p_header, unsigned char *p_pageBuffer, std::uint64_t *p_blankLines, unsigned *p_reducedLines)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  unsigned line_no = 0;
+  unsigned start_line_no = 0; /* first raster line without top blank */
+  unsigned last_line_no = p_header->cupsHeight; /* last raster line without bottom blank */
+  result_t result;
+
+  // Get top margin
+  if(IsPaperReductionTop(p_config))
+  {
+    start_line_no = FindBlackRasterLineTop(p_blankLines, p_header->cupsHeight);
+  }
+
+  // Get bottom margin
+  if(IsPaperReductionBottom(p_config))
+  {
+    last_line_no = FindBlackRasterLineEnd(p_blankLines, p_header->cupsHeight) + 1;
+
+    if((1 == last_line_no) && IsBlankLineInBitmap(p_blankLines, 0))
+    {
+      last_line_no = 0;
+    }
+  }
+
+  if(start_line_no >= last_line_no) /* This page has not image */
+  {
+    *p_reducedLines = p_header->cupsHeight;
+    return SUCCESS;
+  }
+
+  *p_reducedLines = start_line_no + (p_header->cupsHeight - last_line_no);
+
+  for(line_no = start_line_no; line_no < last_line_no;)
+  {
+    // Command output : raster data up to the next interior blank to feed
+    unsigned feed_lines = 0;
+    unsigned feed_line_no = FindBlankFeedLines(p_config, p_header, p_blankLines, line_no, last_line_no, &feed_lines);
+    result = WriteRasterBands(p_encoder, p_header, p_pageBuffer, line_no, feed_line_no);
+
+    if(SUCCESS != result)
+    {
+      return result;
+    }
+
+    if(last_line_no == feed_line_no)
+    {
+      break;
+    }
+
+    // Command output : paper feed
+    unsigned long feed_units = 0;
+    GetFeedUnits(p_config, p_header, feed_lines, &feed_units);
+    p_encoder->timing.blankLines += feed_lines;
+
+    if(SUCCESS != WriteFeed(p_encoder, feed_units))
+    {
+      return E_WRITERASTER_FAILED_FEED;
+    }
+
+    if(0 != p_encoder->canceled)
+    {
+      return CANCEL;
+    }
+
+    line_no = feed_line_no + feed_lines;
+  }
+
+  return SUCCESS;
+}
+
+static result_t WriteRasterBands(EPTMS_ENCODER_T *p_encoder, cups_page_header2_t *p_header, unsigned char *p_pageBuffer, unsigned start_line_no, unsigned last_line_no)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  unsigned line_no = 0;
+  unsigned char *p_data = nullptr;
+  result_t result;
+
+  // Command output : raster data (band unit)
+  for(line_no = start_line_no; (line_no + p_config->maxBandLines) < last_line_no; line_no += p_config->maxBandLines)
+  {
+    p_data = p_pageBuffer + (EPTMD_BITS_TO_BYTES(p_header->cupsWidth) * line_no);
+    // Avoid disturbing data, the next band follows
+    AvoidDisturbingData(p_encoder, p_header, p_data, p_config->maxBandLines, true);
+    result = WriteBand(p_encoder, p_header, p_data, p_config->maxBandLines);
+
+    if(SUCCESS != result)
+    {
+      return E_WRITERASTER_FAILED_WRITE_BAND;
+    }
+
+    if(TmFlushPerBand == p_config->flushControl)
+    {
+      if(SUCCESS != FlushData(p_encoder))
+      {
+        return E_WRITERASTER_FAILED_FLUSH;
+      }
+    }
+
+    if(0 != p_encoder->canceled)
+    {
+      return CANCEL;
+    }
+  }
+
+  // Command output : raster data
+  if(line_no < last_line_no)
+  {
+    p_data = p_pageBuffer + (EPTMD_BITS_TO_BYTES(p_header->cupsWidth) * line_no);
+    AvoidDisturbingData(p_encoder, p_header, p_data, (last_line_no - line_no), false);
+    result = WriteBand(p_encoder, p_header, p_data, (last_line_no - line_no));
+
+    if(SUCCESS != result)
+    {
+      return E_WRITERASTER_FAILED_WRITE_RASTER;
+    }
+
+    if(TmFlushPerBand == p_config->flushControl)
+    {
+      if(SUCCESS != FlushData(p_encoder))
+      {
+        return E_WRITERASTER_FAILED_FLUSH;
+      }
+    }
+  }
+
+  return SUCCESS;
+}
+
+// Returns the first line of the next blank run that is fed instead of sent,
+// or last_line_no if there is none.
+static unsigned FindBlankFeedLines(EPTMS_CONFIG_T *p_config, cups_page_header2_t *p_header, std::uint64_t *p_blankLines,
+                                   unsigned line_no, unsigned last_line_no, unsigned *p_feed_lines)
+{
+  unsigned long feed_units = 0;
+
+  if(0 == p_config->blankFeedLines)
+  {
+    return last_line_no;
+  }
+
+  while(line_no < last_line_no)
+  {
+    if(!IsBlankLineInBitmap(p_blankLines, line_no))
+    {
+      line_no++;
+      continue;
+    }
+
+    unsigned blank_line_no = line_no;
+
+    while((line_no < last_line_no) && IsBlankLineInBitmap(p_blankLines, line_no))
+    {
+      line_no++;
+    }
+
+    if(GetFeedUnits(p_config, p_header, (line_no - blank_line_no), &feed_units))
+    {
+      *p_feed_lines = line_no - blank_line_no;
+      return blank_line_no;
+    }
+  }
+
+  return last_line_no;
+}
+
+static result_t OpenStream(EPTMS_ENCODER_T *p_encoder)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  EPTMS_JOB_INFO_T *p_jobInfo = &p_encoder->jobInfo;
+  EPTMS_STREAM_T *p_stream = &p_encoder->stream;
+  p_stream->header = p_jobInfo->pageHeader;
+  p_stream->p_band = p_jobInfo->p_bandBuffer;
+  p_stream->bandLines = 0;
+  p_stream->blankLines = 0;
+  p_stream->foundBlack = !IsPaperReductionTop(p_config);
+  p_stream->startTiming = p_encoder->timing;
+  p_stream->startBytes = p_encoder->output.bytes;
+  p_stream->startWriteTime = p_encoder->output.writeTime;
+  p_stream->p_pipeline = nullptr;
+
+  // Bands are sent by a writer thread while the next ones are read.
+  if(TmStreamingThreaded == p_config->streamingControl)
+  {
+    result_t result = StartPipeline(&p_stream->pipeline, p_encoder, &p_stream->header, p_jobInfo->p_slotBuffer);
+
+    if(SUCCESS != result)
+    {
+      return result;
+    }
+
+    p_stream->p_pipeline = &p_stream->pipeline;
+  }
+
+  p_stream->open = true;
+  return SUCCESS;
+}
+
+// Pages of the same layout continue the stream.
+static bool IsStreamCompatible(EPTMS_ENCODER_T *p_encoder, cups_page_header2_t *p_header)
+{
+  cups_page_header2_t *p_stream = &p_encoder->stream.header;
+  return (p_header->cupsWidth == p_stream->cupsWidth) && (p_header->cupsBytesPerLine == p_stream->cupsBytesPerLine)
+         && (p_header->cupsBitsPerPixel == p_stream->cupsBitsPerPixel) && (p_header->cupsColorSpace == p_stream->cupsColorSpace)
+         && (p_header->cupsRowCount == p_stream->cupsRowCount)
+         && (p_header->HWResolution[0] == p_stream->HWResolution[0]) && (p_header->HWResolution[1] == p_stream->HWResolution[1]);
+}
+
+// Adds the lines of the page to the open stream.
+static result_t StreamRaster(EPTMS_ENCODER_T *p_encoder, unsigned *p_reducedLines)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  EPTMS_JOB_INFO_T *p_jobInfo = &p_encoder->jobInfo;
+  result_t result = SUCCESS;
+  EPTMS_STREAM_T *p_stream = &p_encoder->stream;
+  cups_page_header2_t *p_header = &p_stream->header;
+  cups_raster_t *p_raster = p_jobInfo->p_raster;
+  unsigned BytesPerLine = EPTMD_BITS_TO_BYTES(p_header->cupsWidth);
+  unsigned data_size = p_header->cupsBytesPerLine;
+  unsigned char *p_data = p_jobInfo->p_lineBuffer;
+  // One spare line holds the first line of the next band until the current band is sent.
+  unsigned char *p_band = p_stream->p_band;
+  bool find_blank = IsBlankLineNeeded(p_config);
+  unsigned i;
+
+  for(i = 0; i < p_jobInfo->pageHeader.cupsHeight; i++)
+  {
+    if(0 != p_encoder->canceled)
+    {
+      result = CANCEL;
+      break;
+    }
+
+    double start_time = StartPhase(TmPhaseReadRaster);
+    unsigned num_bytes_read = cupsRasterReadPixels(p_raster, p_data, data_size);
+
+    if(data_size > num_bytes_read)
+    {
+      fprintf(p_encoder->p_log, "DEBUG: cupsRasterReadPixels() = %u:%u/%u\n", (i + 1), num_bytes_read, data_size);
+      result = E_STREAMRASTER_FAILED_READ_PIXELS;
+      break;
+    }
+
+    if(TmDitheringRasterizer != p_jobInfo->dither.method)
+    {
+      DitherRaster(&p_jobInfo->dither, p_data, p_header->cupsWidth, i, p_data);
+    }
+
+    start_time = EndPhase(p_encoder, TmPhaseReadRaster, start_time);
+
+    bool blank = find_blank && p_jobInfo->p_kernel->IsBlankLine(p_data, BytesPerLine);
+
+    if(find_blank)
+    {
+      EndPhase(p_encoder, TmPhaseBlankScan, start_time);
+    }
+
+    if(blank)
+    {
+      if(p_stream->foundBlack)
+      {
+        p_stream->blankLines++;
+      }
+      else
+      {
+        (*p_reducedLines)++;
+      }
+
+      continue;
+    }
+
+    p_stream->foundBlack = true;
+    // Blank lines followed by a black line are part of the image.
+    result = StreamBlankLines(p_encoder, p_header, p_stream->p_pipeline, p_band, &p_stream->bandLines, p_stream->blankLines);
+    p_stream->blankLines = 0;
+
+    if(SUCCESS == result)
+    {
+      result = StreamBandLine(p_encoder, p_header, p_stream->p_pipeline, p_band, &p_stream->bandLines, p_data);
+    }
+
+    if(SUCCESS != result)
+    {
+      break;
+    }
+  }
+
+  return result;
+}
+
+// Sends the lines held by the stream when 'flush' is set and waits for the writer thread.
+static result_t CloseStream(EPTMS_ENCODER_T *p_encoder, bool flush, unsigned *p_reducedLines)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  EPTMS_STREAM_T *p_stream = &p_encoder->stream;
+  cups_page_header2_t *p_header = &p_stream->header;
+  result_t result = SUCCESS;
+
+  if(!p_stream->open)
+  {
+    return SUCCESS;
+  }
+
+  p_stream->open = false;
+
+  // Bottom blank
+  if(flush && IsPaperReductionBottom(p_config))
+  {
+    *p_reducedLines += p_stream->blankLines;
+  }
+  else if(flush)
+  {
+    result = StreamBlankLines(p_encoder, p_header, p_stream->p_pipeline, p_stream->p_band, &p_stream->bandLines, p_stream->blankLines);
+  }
+
+  // Command output : raster data (remaining lines)
+  if(flush && (SUCCESS == result) && (0 < p_stream->bandLines))
+  {
+    AvoidDisturbingData(p_encoder, p_header, p_stream->p_band, p_stream->bandLines, false);
+    result = StreamBand(p_encoder, p_header, p_stream->p_pipeline, p_stream->p_band, p_stream->bandLines, 0);
+  }
+
+  // The stream is complete once all its bands are sent.
+  if(nullptr != p_stream->p_pipeline)
+  {
+    result_t writer_result = FinishPipeline(p_stream->p_pipeline);
+
+    if(SUCCESS == result)
+    {
+      result = writer_result;
+    }
+  }
+
+  return result;
+}
+
+static result_t StreamBandLine(EPTMS_ENCODER_T *p_encoder, cups_page_header2_t *p_header, EPTMS_PIPELINE_T *p_pipeline, unsigned char *p_band, unsigned *p_band_lines, unsigned char *p_data)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  unsigned BytesPerLine = EPTMD_BITS_TO_BYTES(p_header->cupsWidth);
+  unsigned char *p_dest = p_band + (BytesPerLine * (*p_band_lines));
+
+  if(nullptr == p_data)
+  {
+    memset(p_dest, 0, BytesPerLine);
+  }
+  else
+  {
+    p_encoder->jobInfo.p_kernel->CopyLine(p_dest, p_data, BytesPerLine);
+  }
+
+  (*p_band_lines)++;
+
+  if(p_config->maxBandLines >= *p_band_lines)
+  {
+    return SUCCESS;
+  }
+
+  // The band is complete and followed by a line, so that it can be sanitized
+  // exactly as the whole page would be.
+  AvoidDisturbingData(p_encoder, p_header, p_band, p_config->maxBandLines, true);
+  result_t result = StreamBand(p_encoder, p_header, p_pipeline, p_band, p_config->maxBandLines, 0);
+
+  if(SUCCESS != result)
+  {
+    return result;
+  }
+
+  if(0 != p_encoder->canceled)
+  {
+    return CANCEL;
+  }
+
+  memmove(p_band, p_dest, BytesPerLine);
+  *p_band_lines = 1;
+  return SUCCESS;
+}
+
+static result_t StreamBlankLines(EPTMS_ENCODER_T *p_encoder, cups_page_header2_t *p_header, EPTMS_PIPELINE_T *p_pipeline, unsigned char *p_band, unsigned *p_band_lines, unsigned lines)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  result_t result = SUCCESS;
+  unsigned long feed_units = 0;
+
+  // Long blank is fed instead of sent as raster.
+  if(GetFeedUnits(p_config, p_header, lines, &feed_units))
+  {
+    p_encoder->timing.blankLines += lines;
+
+    if(0 < *p_band_lines)
+    {
+      AvoidDisturbingData(p_encoder, p_header, p_band, *p_band_lines, false);
+    }
+
+    result = StreamBand(p_encoder, p_header, p_pipeline, p_band, *p_band_lines, feed_units);
+    *p_band_lines = 0;
+    return result;
+  }
+
+  for(; (SUCCESS == result) && (0 < lines); lines--)
+  {
+    result = StreamBandLine(p_encoder, p_header, p_pipeline, p_band, p_band_lines, nullptr);
+  }
+
+  return result;
+}
+
+static result_t StreamBand(EPTMS_ENCODER_T *p_encoder, cups_page_header2_t *p_header, EPTMS_PIPELINE_T *p_pipeline, unsigned char *p_band, unsigned lines, unsigned long feed_units)
+{
+  if(nullptr != p_pipeline)
+  {
+    return QueueBand(p_pipeline, p_band, lines, feed_units);
+  }
+
+  return SendBand(p_encoder, p_header, p_band, lines, feed_units);
+}
+
+static result_t SendBand(EPTMS_ENCODER_T *p_encoder, cups_page_header2_t *p_header, unsigned char *p_band, unsigned lines, unsigned long feed_units)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  if(0 < lines)
+  {
+    if(SUCCESS != WriteBand(p_encoder, p_header, p_band, lines))
+    {
+      return E_STREAMRASTER_FAILED_WRITE_BAND;
+    }
+
+    if(TmFlushPerBand == p_config->flushControl)
+    {
+      if(SUCCESS != FlushData(p_encoder))
+      {
+        return E_STREAMRASTER_FAILED_FLUSH;
+      }
+    }
+  }
+
+  if((0 < feed_units) && (SUCCESS != WriteFeed(p_encoder, feed_units)))
+  {
+    return E_STREAMRASTER_FAILED_FEED;
+  }
+
+  return SUCCESS;
+}
+
+static result_t StartPipeline(EPTMS_PIPELINE_T *p_pipeline, EPTMS_ENCODER_T *p_encoder, cups_page_header2_t *p_header, unsigned char *p_slots)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  std::size_t slot_size = (std::size_t)p_config->maxBandLines * EPTMD_BITS_TO_BYTES(p_header->cupsWidth);
+
+  for(unsigned i = 0; i < EPTMD_PIPELINE_BANDS; i++)
+  {
+    p_pipeline->slots[i].p_data = p_slots + (i * slot_size);
+    p_pipeline->slots[i].lines = 0;
+    p_pipeline->slots[i].feedUnits = 0;
+  }
+
+  p_pipeline->p_encoder = p_encoder;
+  p_pipeline->p_header = p_header;
+  p_pipeline->head = 0;
+  p_pipeline->count = 0;
+  p_pipeline->done = false;
+  p_pipeline->result = SUCCESS;
+
+  try
+  {
+    p_pipeline->writer = std::thread(PipelineWriter, p_pipeline);
+  }
+  catch(const std::system_error &)
+  {
+    return E_STREAMRASTER_FAILED_THREAD;
+  }
+
+  return SUCCESS;
+}
+
+static result_t QueueBand(EPTMS_PIPELINE_T *p_pipeline, unsigned char *p_band, unsigned lines, unsigned long feed_units)
+{
+  std::unique_lock<std::mutex> lock(p_pipeline->mutex);
+
+  // Backpressure : the reader waits until the writer releases a slot.
+  while((EPTMD_PIPELINE_BANDS == p_pipeline->count) && (SUCCESS == p_pipeline->result))
+  {
+    p_pipeline->changed.wait(lock);
+  }
+
+  if(SUCCESS != p_pipeline->result)
+  {
+    return p_pipeline->result;
+  }
+
+  // The tail slot is not seen by the writer until it is counted.
+  EPTMS_PIPELINE_SLOT_T *p_slot = &p_pipeline->slots[(p_pipeline->head + p_pipeline->count) % EPTMD_PIPELINE_BANDS];
+  lock.unlock();
+  memcpy(p_slot->p_data, p_band, (std::size_t)lines * EPTMD_BITS_TO_BYTES(p_pipeline->p_header->cupsWidth));
+  p_slot->lines = lines;
+  p_slot->feedUnits = feed_units;
+  lock.lock();
+  p_pipeline->count++;
+  p_pipeline->changed.notify_all();
+  return SUCCESS;
+}
+
+static result_t FinishPipeline(EPTMS_PIPELINE_T *p_pipeline)
+{
+  {
+    std::lock_guard<std::mutex> lock(p_pipeline->mutex);
+    p_pipeline->done = true;
+    p_pipeline->changed.notify_all();
+  }
+
+  p_pipeline->writer.join();
+  return p_pipeline->result;
+}
+
+static void PipelineWriter(EPTMS_PIPELINE_T *p_pipeline)
+{
+  std::unique_lock<std::mutex> lock(p_pipeline->mutex);
+
+  while(true)
+  {
+    while((0 == p_pipeline->count) && !p_pipeline->done)
+    {
+      p_pipeline->changed.wait(lock);
+    }
+
+    if(0 == p_pipeline->count)
+    {
+      break;
+    }
+
+    // The head slot stays counted while it is sent, so that the reader does not reuse it.
+    EPTMS_PIPELINE_SLOT_T *p_slot = &p_pipeline->slots[p_pipeline->head];
+    result_t result = p_pipeline->result;
+
+    if((SUCCESS == result) && (0 != p_pipeline->p_encoder->canceled))
+    {
+      result = CANCEL; // Queued bands are dropped.
+    }
+    else if(SUCCESS == result)
+    {
+      lock.unlock();
+      result = SendBand(p_pipeline->p_encoder, p_pipeline->p_header, p_slot->p_data, p_slot->lines, p_slot->feedUnits);
+      lock.lock();
+    }
+
+    p_pipeline->result = result;
+    p_pipeline->head = (p_pipeline->head + 1) % EPTMD_PIPELINE_BANDS;
+    p_pipeline->count--;
+    p_pipeline->changed.notify_all();
+  }
+}
+
+static bool IsPaperReductionTop(EPTMS_CONFIG_T *p_config)
+{
+  return (TmPaperReductionTop == p_config->paperReduction) || (TmPaperReductionBoth == p_config->paperReduction);
+}
+
+static bool IsPaperReductionBottom(EPTMS_CONFIG_T *p_config)
+{
+  return (TmPaperReductionBottom == p_config->paperReduction) || (TmPaperReductionBoth == p_config->paperReduction);
+}
+
+// Blank lines are only searched for paper reduction and blank feed.
+static bool IsBlankLineNeeded(EPTMS_CONFIG_T *p_config)
+{
+  return (TmPaperReductionOff != p_config->paperReduction) || (0 != p_config->blankFeedLines);
+}
+
+// Sanitizes the lines of a band. If a raster line follows, its first byte is
+// checked as the second byte of a pair but left unchanged.
+static void AvoidDisturbingData(EPTMS_ENCODER_T *p_encoder, cups_page_header2_t *p_header, unsigned char *p_data, unsigned lines, bool followed)
+{
+  unsigned long data_size = lines * EPTMD_BITS_TO_BYTES(p_header->cupsWidth);
+
+  if(followed)
+  {
+    data_size++;
+  }
+
+  double start_time = StartPhase(TmPhaseAvoidDisturbing);
+  AvoidDisturbingRasterData(p_data, data_size);
+  EndPhase(p_encoder, TmPhaseAvoidDisturbing, start_time);
+}
+
+static result_t WriteBand(EPTMS_ENCODER_T *p_encoder, cups_page_header2_t *p_header, unsigned char *p_data, unsigned lines)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  double start_time = StartPhase(TmPhaseWriteBand);
+  unsigned position = 0;
+  unsigned long width = p_header->cupsWidth;
+  result_t result = WaitPrinter(p_encoder);
+
+  if(SUCCESS != result)
+  {
+    EndPhase(p_encoder, TmPhaseWriteBand, start_time);
+    return result;
+  }
+
+  if(TmColumnCropOn == p_config->columnCrop)
+  {
+    CropBand(p_encoder, p_header, p_data, lines, &position, &width);
+  }
+
+  bool cached = false;
+  result = WriteCachedBand(p_encoder, position, width, p_data, lines, &cached);
+
+  if((SUCCESS == result) && !cached)
+  {
+    result = WriteBandCommands(p_encoder, position, width, p_data, lines);
+  }
+
+  EndPhase(p_encoder, TmPhaseWriteBand, start_time);
+  EPTMD_PROBE1(band, lines);
+  return result;
+}
+
+// Narrows the band to the byte columns that hold black dots, the cropped lines
+// are packed again from p_data. Bands whose packed lines would join into a
+// real-time command are sent in full.
+static void CropBand(EPTMS_ENCODER_T *p_encoder, cups_page_header2_t *p_header, unsigned char *p_data, unsigned lines, unsigned *p_position, unsigned long *p_width)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  unsigned BytesPerLine = EPTMD_BITS_TO_BYTES(p_header->cupsWidth);
+  unsigned left = 0;
+  unsigned right = 0;
+  p_encoder->jobInfo.p_kernel->FindInkColumns(p_data, BytesPerLine, lines, &left, &right);
+
+  if(left == right) // Blank band
+  {
+    return;
+  }
+
+  // ESC $ moves by motion units, the left edge must fall on one.
+  unsigned long units = (unsigned long)left * 8 * p_config->h_motionUnit;
+
+  if((0 == p_header->HWResolution[0]) || (0 != (units % p_header->HWResolution[0])))
+  {
+    left = 0;
+    units = 0;
+  }
+
+  if((0 == left) && (BytesPerLine == right))
+  {
+    return;
+  }
+
+  for(unsigned y = 1; y < lines; y++)
+  {
+    if(IsDisturbingPair(p_data[(y * BytesPerLine) - BytesPerLine + right - 1], p_data[(y * BytesPerLine) + left]))
+    {
+      return;
+    }
+  }
+
+  unsigned length = right - left;
+
+  for(unsigned y = 0; y < lines; y++)
+  {
+    memmove(p_data + ((unsigned long)y * length), p_data + ((unsigned long)y * BytesPerLine) + left, length);
+  }
+
+  *p_position = (unsigned)(units / p_header->HWResolution[0]);
+  *p_width = ((BytesPerLine == right) ? p_header->cupsWidth : (right * 8)) - (left * 8);
+  p_encoder->output.cropBytes += (unsigned long long)(BytesPerLine - length) * lines;
+}
+
+static result_t WriteBandCommands(EPTMS_ENCODER_T *p_encoder, unsigned position, unsigned long width, unsigned char *p_data, unsigned lines)
+{
+  unsigned char CommandSetAbsolutePrintPosition[4] = { ESC, '$', 0, 0 };
+  CommandSetAbsolutePrintPosition[2] = (unsigned char)(position & 0xff);
+  CommandSetAbsolutePrintPosition[3] = (unsigned char)((position >> 8) & 0xff);
+  result_t result = WriteData(p_encoder, CommandSetAbsolutePrintPosition, sizeof(CommandSetAbsolutePrintPosition));
+
+  if(SUCCESS != result)
+  {
+    return result;
+  }
+
+  unsigned long size = EPTMD_BITS_TO_BYTES(width) * lines;
+  unsigned char CommandSetGraphicsdataGS8L112[EPTMD_BAND_HEADER_SIZE];
+  EncodeRasterBandHeader(CommandSetGraphicsdataGS8L112, width, lines);
+  result = WriteData(p_encoder, CommandSetGraphicsdataGS8L112, sizeof(CommandSetGraphicsdataGS8L112));
+
+  if(SUCCESS != result)
+  {
+    return result;
+  }
+
+  result = WriteData(p_encoder, p_data, (unsigned int)size);
+
+  if(SUCCESS != result)
+  {
+    return result;
+  }
+
+  p_encoder->output.bands++;
+  p_encoder->output.bandBytes += size;
+
+  unsigned char CommandSetGraphicsdataGSpL50[7] = { GS, '(', 'L', 2, 0, 48, 50 };
+  result = WriteData(p_encoder, CommandSetGraphicsdataGSpL50, sizeof(CommandSetGraphicsdataGSpL50));
+
+  if(SUCCESS != result)
+  {
+    return result;
+  }
+
+  return SUCCESS;
+}
+
+// Leading bands of a job printed by EPTMD_GRAPHICS_MIN_JOBS jobs are stored
+// once in the NV graphics area with GS ( L fn 67, then printed by key with
+// GS ( L fn 69. The NV memory wears out with writes, so a band printed by a
+// few jobs only, e.g. a reprinted receipt, is never stored.
+static result_t WriteCachedBand(EPTMS_ENCODER_T *p_encoder, unsigned position, unsigned long width, unsigned char *p_data, unsigned lines, bool *p_cached)
+{
+  EPTMS_GRAPHICS_CACHE_T *p_cache = &p_encoder->graphics;
+  unsigned long size = EPTMD_BITS_TO_BYTES(width) * lines;
+  *p_cached = false;
+
+  if(!p_cache->enabled || (EPTMD_GRAPHICS_JOB_BANDS <= p_cache->bands))
+  {
+    return SUCCESS;
+  }
+
+  p_cache->bands++;
+
+  if((EPTMD_GRAPHICS_MIN_BYTES > size) || (0xffff < (size + 11)))
+  {
+    return SUCCESS;
+  }
+
+  // FNV-1a
+  std::uint64_t hash = 0xcbf29ce484222325ULL;
+
+  for(unsigned long i = 0; i < size; i++)
+  {
+    hash = (hash ^ p_data[i]) * 0x100000001b3ULL;
+  }
+
+  EPTMS_GRAPHICS_ENTRY_T *p_entry = FindGraphicsEntry(p_cache, hash, (unsigned)width, lines);
+
+  if(nullptr == p_entry)
+  {
+    return SUCCESS;
+  }
+
+  if(!p_entry->printed)
+  {
+    p_entry->printed = true;
+    p_entry->hits++;
+  }
+
+  p_entry->last = p_cache->now;
+  p_cache->changed = true;
+
+  if(0 == p_entry->key)
+  {
+    if(EPTMD_GRAPHICS_MIN_JOBS > p_entry->hits)
+    {
+      return SUCCESS;
+    }
+
+    unsigned char key = GetGraphicsKey(p_cache, size);
+    EPTMS_GRAPHICS_ENTRY_T *p_stale = nullptr;
+
+    // Stored bands not printed for a while make room, they have to recur
+    // again to be stored again.
+    while((0 == key) && (nullptr != (p_stale = FindStaleGraphicsEntry(p_cache))))
+    {
+      result_t result = DeleteGraphicsKey(p_encoder, p_stale->key);
+
+      if(SUCCESS != result)
+      {
+        return result;
+      }
+
+      p_stale->key = 0;
+      p_stale->hits = 0;
+      key = GetGraphicsKey(p_cache, size);
+    }
+
+    if(0 == key)
+    {
+      return SUCCESS;
+    }
+
+    unsigned char CommandDefineNVGraphics[16] = { GS, '(', 'L', 0, 0, 48, 67, 48, EPTMD_GRAPHICS_KEY_CODE1, 0, 1, 0, 0, 0, 0, 49 };
+    CommandDefineNVGraphics[3] = (unsigned char)((size + 11) & 0xff);
+    CommandDefineNVGraphics[4] = (unsigned char)(((size + 11) >> 8) & 0xff);
+    CommandDefineNVGraphics[9] = key;
+    CommandDefineNVGraphics[11] = (unsigned char)(width & 0xff);
+    CommandDefineNVGraphics[12] = (unsigned char)((width >> 8) & 0xff);
+    CommandDefineNVGraphics[13] = (unsigned char)(lines & 0xff);
+    CommandDefineNVGraphics[14] = (unsigned char)((lines >> 8) & 0xff);
+    // Copies of the page print the key without storing the band again.
+    std::vector<unsigned char> *p_record = p_encoder->output.p_record;
+    p_encoder->output.p_record = nullptr;
+    result_t result = WriteData(p_encoder, CommandDefineNVGraphics, sizeof(CommandDefineNVGraphics));
+
+    if(SUCCESS == result)
+    {
+      result = WriteData(p_encoder, p_data, (unsigned int)size);
+    }
+
+    p_encoder->output.p_record = p_record;
+
+    if(SUCCESS != result)
+    {
+      return result;
+    }
+
+    p_entry->key = key;
+    fprintf(p_encoder->p_log, "DEBUG: graphics cache stores %lu bytes as NV graphics %c%c\n", size, EPTMD_GRAPHICS_KEY_CODE1, key);
+  }
+
+  unsigned char CommandSetAbsolutePrintPosition[4] = { ESC, '$', 0, 0 };
+  unsigned char CommandPrintNVGraphics[11] = { GS, '(', 'L', 6, 0, 48, 69, EPTMD_GRAPHICS_KEY_CODE1, 0, 1, 1 };
+  CommandPrintNVGraphics[8] = p_entry->key;
+  CommandSetAbsolutePrintPosition[2] = (unsigned char)(position & 0xff);
+  CommandSetAbsolutePrintPosition[3] = (unsigned char)((position >> 8) & 0xff);
+  result_t result = WriteData(p_encoder, CommandSetAbsolutePrintPosition, sizeof(CommandSetAbsolutePrintPosition));
+
+  if(SUCCESS == result)
+  {
+    result = WriteData(p_encoder, CommandPrintNVGraphics, sizeof(CommandPrintNVGraphics));
+  }
+
+  if(SUCCESS != result)
+  {
+    return result;
+  }
+
+  p_encoder->output.bands++;
+  *p_cached = true;
+  return SUCCESS;
+}
+
+// Finds the entry of a band, or makes room for it in place of the least
+// printed band that is not stored, the oldest one of a tie.
+static EPTMS_GRAPHICS_ENTRY_T *FindGraphicsEntry(EPTMS_GRAPHICS_CACHE_T *p_cache, std::uint64_t hash, unsigned width, unsigned lines)
+{
+  EPTMS_GRAPHICS_ENTRY_T *p_victim = nullptr;
+
+  for(unsigned i = 0; i < p_cache->count; i++)
+  {
+    EPTMS_GRAPHICS_ENTRY_T *p_entry = &p_cache->entries[i];
+
+    if((hash == p_entry->hash) && (width == p_entry->width) && (lines == p_entry->lines))
+    {
+      return p_entry;
+    }
+
+    if((0 == p_entry->key)
+       && ((nullptr == p_victim) || (p_entry->hits < p_victim->hits)
+           || ((p_entry->hits == p_victim->hits) && (p_entry->last < p_victim->last))))
+    {
+      p_victim = p_entry;
+    }
+  }
+
+  if(EPTMD_GRAPHICS_ENTRIES > p_cache->count)
+  {
+    p_victim = &p_cache->entries[p_cache->count++];
+  }
+
+  if(nullptr != p_victim)
+  {
+    p_victim->hash = hash;
+    p_victim->width = width;
+    p_victim->lines = lines;
+    p_victim->hits = 0;
+    p_victim->key = 0;
+    p_victim->last = p_cache->now;
+    p_victim->printed = false;
+  }
+
+  return p_victim;
+}
+
+// Returns the stored band printed least recently, if not printed for
+// EPTMD_GRAPHICS_MIN_IDLE, nullptr otherwise.
+static EPTMS_GRAPHICS_ENTRY_T *FindStaleGraphicsEntry(EPTMS_GRAPHICS_CACHE_T *p_cache)
+{
+  EPTMS_GRAPHICS_ENTRY_T *p_stale = nullptr;
+
+  for(unsigned i = 0; i < p_cache->count; i++)
+  {
+    EPTMS_GRAPHICS_ENTRY_T *p_entry = &p_cache->entries[i];
+
+    if((0 != p_entry->key) && (EPTMD_GRAPHICS_MIN_IDLE <= (p_cache->now - p_entry->last))
+       && ((nullptr == p_stale) || (p_entry->last < p_stale->last)))
+    {
+      p_stale = p_entry;
+    }
+  }
+
+  return p_stale;
+}
+
+static void RemoveGraphicsEntry(EPTMS_GRAPHICS_CACHE_T *p_cache, unsigned index)
+{
+  p_cache->entries[index] = p_cache->entries[--p_cache->count];
+  p_cache->changed = true;
+}
+
+// Returns a free second key code if 'size' more bytes and one more key fit
+// the cache, 0 otherwise.
+static unsigned char GetGraphicsKey(EPTMS_GRAPHICS_CACHE_T *p_cache, unsigned long size)
+{
+  bool used['~' + 1] = { false };
+  unsigned long stored = size;
+  unsigned keys = 0;
+
+  for(unsigned i = 0; i < p_cache->count; i++)
+  {
+    EPTMS_GRAPHICS_ENTRY_T *p_entry = &p_cache->entries[i];
+
+    if(0 != p_entry->key)
+    {
+      used[p_entry->key] = true;
+      stored += EPTMD_BITS_TO_BYTES(p_entry->width) * p_entry->lines;
+      keys++;
+    }
+  }
+
+  if((EPTMD_GRAPHICS_CAPACITY < stored) || (EPTMD_GRAPHICS_KEYS <= keys))
+  {
+    return 0;
+  }
+
+  for(unsigned char key = ' '; key <= '~'; key++)
+  {
+    if(!used[key])
+    {
+      return key;
+    }
+  }
+
+  return 0;
+}
+
+// Deletes the NV graphics of a band with GS ( L fn 66, so that its space
+// can be used again.
+static result_t DeleteGraphicsKey(EPTMS_ENCODER_T *p_encoder, unsigned char key)
+{
+  unsigned char CommandDeleteNVGraphics[9] = { GS, '(', 'L', 4, 0, 48, 66, EPTMD_GRAPHICS_KEY_CODE1, 0 };
+  CommandDeleteNVGraphics[8] = key;
+  // Copies of the page never delete again.
+  std::vector<unsigned char> *p_record = p_encoder->output.p_record;
+  p_encoder->output.p_record = nullptr;
+  result_t result = WriteData(p_encoder, CommandDeleteNVGraphics, sizeof(CommandDeleteNVGraphics));
+  p_encoder->output.p_record = p_record;
+  fprintf(p_encoder->p_log, "DEBUG: graphics cache deletes NV graphics %c%c\n", EPTMD_GRAPHICS_KEY_CODE1, key);
+  return result;
+}
+
+// Reads the key codes of the NV graphics defined in the printer with
+// GS ( L fn 64. The printer answers 37h 72h, a status, key code pairs and
+// NUL. Status 41h tells that an ACK gets the next block, 40h ends the list.
+// Returns false without a back-channel or an answer.
+static bool ReadGraphicsKeys(EPTMS_ENCODER_T *p_encoder, bool *p_defined)
+{
+  if(!HasBackChannel(p_encoder))
+  {
+    return false;
+  }
+
+  unsigned char CommandKeyCodeList[9] = { GS, '(', 'L', 4, 0, 48, 64, 'K', 'C' };
+  result_t result = WriteData(p_encoder, CommandKeyCodeList, sizeof(CommandKeyCodeList));
+
+  if(SUCCESS == result)
+  {
+    result = FlushData(p_encoder);
+  }
+
+  std::vector<unsigned char> codes;
+  unsigned header = 0; // Bytes of 37h 72h status received.
+  unsigned char status = 0;
+  double deadline = GetMonotonicTime() + EPTMD_GRAPHICS_KEYS_TIMEOUT;
+
+  while((SUCCESS == result) && (GetMonotonicTime() < deadline))
+  {
+    char buffer[64];
+    ssize_t received = cupsBackChannelRead(buffer, sizeof(buffer), deadline - GetMonotonicTime());
+
+    if(0 >= received)
+    {
+      break;
+    }
+
+    for(ssize_t i = 0; (SUCCESS == result) && (i < received); i++)
+    {
+      unsigned char data = static_cast<unsigned char>(buffer[i]);
+
+      // Anything before the header, e.g. a late status, is skipped.
+      if(3 > header)
+      {
+        if(0x37 == data)
+        {
+          header = 1;
+        }
+        else if((1 == header) && (0x72 == data))
+        {
+          header = 2;
+        }
+        else if((2 == header) && ((0x40 == data) || (0x41 == data)))
+        {
+          header = 3;
+          status = data;
+        }
+        else
+        {
+          header = 0;
+        }
+
+        continue;
+      }
+
+      if(0 != data)
+      {
+        codes.push_back(data);
+        continue;
+      }
+
+      for(std::size_t code = 0; (code + 1) < codes.size(); code += 2)
+      {
+        if((EPTMD_GRAPHICS_KEY_CODE1 == codes[code]) && (' ' <= codes[code + 1]) && ('~' >= codes[code + 1]))
+        {
+          p_defined[codes[code + 1]] = true;
+        }
+      }
+
+      if(0x40 == status)
+      {
+        return true;
+      }
+
+      unsigned char CommandAck[1] = { 0x06 };
+      result = WriteData(p_encoder, CommandAck, sizeof(CommandAck));
+
+      if(SUCCESS == result)
+      {
+        result = FlushData(p_encoder);
+      }
+
+      codes.clear();
+      header = 0;
+      deadline = GetMonotonicTime() + EPTMD_GRAPHICS_KEYS_TIMEOUT;
+    }
+  }
+
+  fprintf(p_encoder->p_log, "DEBUG: no NV graphics key code list, graphics cache not checked\n");
+  return false;
+}
+
+// Brings the printer and the index in line before the first band. Bands the
+// printer lost are stored again, bands not printed for EPTMD_GRAPHICS_MAX_IDLE
+// and bands of an earlier index or of another host are deleted.
+static result_t PrepareGraphicsCache(EPTMS_ENCODER_T *p_encoder)
+{
+  EPTMS_GRAPHICS_CACHE_T *p_cache = &p_encoder->graphics;
+
+  if(!p_cache->enabled)
+  {
+    return SUCCESS;
+  }
+
+  bool defined['~' + 1] = { false };
+  bool indexed['~' + 1] = { false };
+  bool listed = ReadGraphicsKeys(p_encoder, defined);
+  result_t result = SUCCESS;
+
+  for(unsigned i = 0; i < p_cache->count;)
+  {
+    EPTMS_GRAPHICS_ENTRY_T *p_entry = &p_cache->entries[i];
+
+    if((0 != p_entry->key) && listed && !defined[p_entry->key])
+    {
+      fprintf(p_encoder->p_log, "DEBUG: NV graphics %c%c not in the printer\n", EPTMD_GRAPHICS_KEY_CODE1, p_entry->key);
+      p_entry->key = 0;
+      p_cache->changed = true;
+    }
+
+    if(EPTMD_GRAPHICS_MAX_IDLE < (p_cache->now - p_entry->last))
+    {
+      if(0 != p_entry->key)
+      {
+        result = DeleteGraphicsKey(p_encoder, p_entry->key);
+      }
+
+      if(SUCCESS != result)
+      {
+        return result;
+      }
+
+      RemoveGraphicsEntry(p_cache, i);
+      continue;
+    }
+
+    indexed[p_entry->key] = true;
+    i++;
+  }
+
+  for(unsigned char key = ' '; key <= '~'; key++)
+  {
+    if(!indexed[key] && (listed ? defined[key] : p_cache->reset))
+    {
+      result = DeleteGraphicsKey(p_encoder, key);
+    }
+
+    if(SUCCESS != result)
+    {
+      return result;
+    }
+  }
+
+  return SUCCESS;
+}
+
+// The index lives in the cache directory, EPTMD_GRAPHICS_INDEX_HEADER then
+// one band per line: hash width lines hits key last
+static void LoadGraphicsCache(EPTMS_ENCODER_T *p_encoder)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  EPTMS_GRAPHICS_CACHE_T *p_cache = &p_encoder->graphics;
+  memset(p_cache, 0, sizeof(*p_cache));
+  p_cache->enabled = (TmGraphicsCacheOn == p_config->graphicsCache);
+
+  if(!p_cache->enabled)
+  {
+    return;
+  }
+
+  p_cache->now = (long long)time(nullptr);
+  std::string path = GetGraphicsCachePath(p_config->p_printerName);
+  FILE *p_file = fopen(path.c_str(), "r");
+
+  if((nullptr == p_file) && (ENOENT != errno))
+  {
+    fprintf(p_encoder->p_log, "WARNING: graphics cache index %s not read: %s\n", path.c_str(), strerror(errno));
+    p_cache->enabled = false;
+    return;
+  }
+
+  char header[sizeof(EPTMD_GRAPHICS_INDEX_HEADER)];
+
+  if((nullptr == p_file) || (nullptr == fgets(header, sizeof(header), p_file)) || (0 != strcmp(EPTMD_GRAPHICS_INDEX_HEADER, header)))
+  {
+    if(nullptr != p_file)
+    {
+      fclose(p_file);
+    }
+
+    // A new index is saved at once, the bands of the earlier one are only
+    // deleted from the printer if it will know about the new ones.
+    p_cache->reset = true;
+    p_cache->changed = true;
+    SaveGraphicsCache(p_encoder);
+
+    if(p_cache->changed)
+    {
+      p_cache->enabled = false;
+    }
+
+    return;
+  }
+
+  unsigned long long hash;
+  unsigned width, lines, hits, key;
+  long long last;
+
+  while((EPTMD_GRAPHICS_ENTRIES > p_cache->count)
+        && (6 == fscanf(p_file, "%llx %u %u %u %u %lld", &hash, &width, &lines, &hits, &key, &last)))
+  {
+    EPTMS_GRAPHICS_ENTRY_T *p_entry = &p_cache->entries[p_cache->count++];
+    p_entry->hash = hash;
+    p_entry->width = width;
+    p_entry->lines = lines;
+    p_entry->hits = hits;
+    p_entry->key = ((' ' <= key) && ('~' >= key)) ? (unsigned char)key : 0;
+    p_entry->last = last;
+  }
+
+  fclose(p_file);
+}
+
+static void SaveGraphicsCache(EPTMS_ENCODER_T *p_encoder)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  EPTMS_GRAPHICS_CACHE_T *p_cache = &p_encoder->graphics;
+
+  if(!p_cache->enabled || !p_cache->changed)
+  {
+    return;
+  }
+
+  // Replaced at once, so that a crash never leaves a partial index.
+  std::string path = GetGraphicsCachePath(p_config->p_printerName);
+  std::string temporary_path = path + ".tmp";
+  FILE *p_file = fopen(temporary_path.c_str(), "w");
+
+  if(nullptr == p_file)
+  {
+    fprintf(p_encoder->p_log, "WARNING: graphics cache index %s not saved: %s\n", path.c_str(), strerror(errno));
+    return;
+  }
+
+  fputs(EPTMD_GRAPHICS_INDEX_HEADER, p_file);
+
+  for(unsigned i = 0; i < p_cache->count; i++)
+  {
+    EPTMS_GRAPHICS_ENTRY_T *p_entry = &p_cache->entries[i];
+    fprintf(p_file, "%016llx %u %u %u %u %lld\n", (unsigned long long)p_entry->hash,
+            p_entry->width, p_entry->lines, p_entry->hits, p_entry->key, p_entry->last);
+  }
+
+  if((0 != fclose(p_file)) || (0 != rename(temporary_path.c_str(), path.c_str())))
+  {
+    fprintf(p_encoder->p_log, "WARNING: graphics cache index %s not saved: %s\n", path.c_str(), strerror(errno));
+    unlink(temporary_path.c_str());
+    return;
+  }
+
+  p_cache->changed = false;
+}
+
+// Converts blank lines to vertical motion units, if the feed fits the
+// raster exactly and the run is long enough to be worth a new band.
+static bool GetFeedUnits(EPTMS_CONFIG_T *p_config, cups_page_header2_t *p_header, unsigned lines, unsigned long *p_units)
+{
+  if((0 == p_config->blankFeedLines) || (p_config->blankFeedLines > lines) || (0 == p_header->HWResolution[1]))
+  {
+    return false;
+  }
+
+  unsigned long units = (unsigned long)lines * p_config->v_motionUnit;
+
+  if(0 != (units % p_header->HWResolution[1]))
+  {
+    return false;
+  }
+
+  *p_units = units / p_header->HWResolution[1];
+  return true;
+}
+
+static result_t WriteFeed(EPTMS_ENCODER_T *p_encoder, unsigned long units)
+{
+  unsigned char CommandPrintAndFeedPaper[3] = { ESC, 'J', 0 };
+
+  while(0 < units)
+  {
+    CommandPrintAndFeedPaper[2] = (unsigned char)((255 < units) ? 255 : units);
+    result_t result = WriteData(p_encoder, CommandPrintAndFeedPaper, sizeof(CommandPrintAndFeedPaper));
+
+    if(SUCCESS != result)
+    {
+      return result;
+    }
+
+    units -= CommandPrintAndFeedPaper[2];
+  }
+
+  return SUCCESS;
+}
+
+// User files are looked up once per job, then sent from their mapping.
+static result_t WriteUserFile(EPTMS_ENCODER_T *p_encoder, char *p_printerName, EPTME_USER_FILE file)
+{
+  double start_time = StartPhase(TmPhaseUserFile);
+  EPTMS_USER_FILE_T *p_file = &p_encoder->userFiles[file];
+  result_t result = SUCCESS;
+
+  if(!p_file->loaded)
+  {
+    result = LoadUserFile(p_printerName, file, p_file);
+  }
+
+  if((SUCCESS == result) && (0 < p_file->size))
+  {
+    result = WriteData(p_encoder, p_file->p_data, static_cast<unsigned int>(p_file->size));
+  }
+
+  EndPhase(p_encoder, TmPhaseUserFile, start_time);
+  return result;
+}
+
+static result_t LoadUserFile(char *p_printerName, EPTME_USER_FILE file, EPTMS_USER_FILE_T *p_file)
+{
+  const char *p_file_names[TmUserFileCount] = { "StartJob.prn", "EndJob.prn", "StartPage.prn", "EndPage.prn" };
+  int fd = open(GetUserFilePath(p_printerName, p_file_names[file]).c_str(), O_RDONLY);
+
+  if(0 > fd)
+  {
+    if(ENOENT == errno) // No such file or directory, not probed again.
+    {
+      p_file->loaded = true;
+      return SUCCESS;
+    }
+
+    return FAILED;
+  }
+
+  struct stat info;
+
+  if((0 != fstat(fd, &info)) || !S_ISREG(info.st_mode) || (UINT32_MAX < static_cast<unsigned long long>(info.st_size)))
+  {
+    close(fd);
+    return FAILED;
+  }
+
+  p_file->size = static_cast<std::size_t>(info.st_size);
+
+  if(0 < p_file->size)
+  {
+    void *p_map = mmap(nullptr, p_file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if(MAP_FAILED == p_map)
+    {
+      p_file->size = 0;
+      close(fd);
+      return FAILED;
+    }
+
+    p_file->p_data = static_cast<unsigned char *>(p_map);
+  }
+
+  p_file->loaded = true;
+
+  if(close(fd) < 0)
+  {
+    return FAILED;
+  }
+
+  return SUCCESS;
+}
+
+// Output a file if it exists in a predetermined place. : /var/lib/tmx-cups
+static std::string GetUserFilePath(char *p_printerName, const char *p_file_name)
+{
+  std::ostringstream path;
+  std::string os_specific_dirname;
+#ifndef EPD_TM_MAC
+  os_specific_dirname = "/var/lib/tmx-cups";
+#else
+  os_specific_dirname = "/Library/Caches/Epson/TerminalPrinter";
+#endif
+  path << os_specific_dirname << p_printerName << "_" << p_file_name;
+  return path.str();
+}
+
+// The filter writes the graphics cache index, so it lives in a directory
+// of the CUPS filter user, made by `make install': TMX_CACHE_DIR
+static std::string GetGraphicsCachePath(char *p_printerName)
+{
+  std::ostringstream path;
+  std::string os_specific_dirname;
+#ifndef EPD_TM_MAC
+  os_specific_dirname = TMX_CACHE_DIR;
+#else
+  os_specific_dirname = "/Library/Caches/Epson/TerminalPrinter";
+#endif
+  path << os_specific_dirname << "/" << p_printerName << "_Graphics.idx";
+  return path.str();
+}
+
+static void FreeUserFiles(EPTMS_ENCODER_T *p_encoder)
+{
+  for(EPTMS_USER_FILE_T &file : p_encoder->userFiles)
+  {
+    if(nullptr != file.p_data)
+    {
+      munmap(file.p_data, file.size);
+    }
+
+    file.loaded = false;
+    file.p_data = nullptr;
+    file.size = 0;
+  }
+}
+
+static result_t WriteData(EPTMS_ENCODER_T *p_encoder, unsigned char *p_buffer, unsigned int size)
+{
+  EPTMS_OUTPUT_T *p_output = &p_encoder->output;
+
+  if(nullptr != p_output->p_record)
+  {
+    p_output->p_record->insert(p_output->p_record->end(), p_buffer, p_buffer + size);
+  }
+
+  // Small commands are coalesced in the output buffer.
+  if((sizeof(p_output->buffer) - p_output->length) >= size)
+  {
+    memcpy(p_output->buffer + p_output->length, p_buffer, size);
+    p_output->length += size;
+    return SUCCESS;
+  }
+
+  // Large data (raster bands) are sent together with the pending commands.
+  if(EPTMD_OUTPUT_GATHER_SIZE <= size)
+  {
+    struct iovec vector[2];
+    vector[0].iov_base = p_output->buffer;
+    vector[0].iov_len = p_output->length;
+    vector[1].iov_base = p_buffer;
+    vector[1].iov_len = size;
+    p_output->length = 0;
+    return WriteVector(p_encoder, vector, 2);
+  }
+
+  result_t result = FlushData(p_encoder);
+
+  if(SUCCESS != result)
+  {
+    return result;
+  }
+
+  memcpy(p_output->buffer, p_buffer, size);
+  p_output->length = size;
+  return SUCCESS;
+}
+
+static result_t WriteVector(EPTMS_ENCODER_T *p_encoder, struct iovec *p_vector, int count)
+{
+  EPTMS_OUTPUT_T *p_output = &p_encoder->output;
+
+  // Nothing can follow a command cut short.
+  if(p_output->aborted)
+  {
+    return CANCEL;
+  }
+
+  while(0 < count)
+  {
+    if(0 == p_vector->iov_len)
+    {
+      p_vector++;
+      count--;
+      continue;
+    }
+
+    double start_time = GetMonotonicTime();
+    ssize_t written = WriteOutput(p_output, p_vector, count);
+    p_output->writeTime += GetMonotonicTime() - start_time;
+    p_output->syscalls++;
+
+    if(0 > written)
+    {
+      if(EINTR == errno)
+      {
+        continue;
+      }
+
+      if(((EAGAIN == errno) || (EWOULDBLOCK == errno)) && (TmOutputDescriptor == p_output->sink))
+      {
+        result_t result = WaitOutput(p_encoder);
+
+        if(SUCCESS != result)
+        {
+          return result;
+        }
+
+        continue;
+      }
+
+      return FAILED;
+    }
+    else if(0 == written)
+    {
+      return FAILED;
+    }
+
+    std::size_t size = static_cast<std::size_t>(written);
+    p_output->bytes += size;
+
+    // Skip what has been written, partial writes resume in the middle of an entry.
+    while((0 < count) && (p_vector->iov_len <= size))
+    {
+      size -= p_vector->iov_len;
+      p_vector++;
+      count--;
+    }
+
+    if(0 < count)
+    {
+      p_vector->iov_base = static_cast<unsigned char *>(p_vector->iov_base) + size;
+      p_vector->iov_len -= size;
+    }
+  }
+
+  return SUCCESS;
+}
+
+// Returns the bytes taken by the sink as writev() does.
+static ssize_t WriteOutput(EPTMS_OUTPUT_T *p_output, struct iovec *p_vector, int count)
+{
+  switch(p_output->sink)
+  {
+    case TmOutputMemory:
+    {
+      std::size_t size = 0;
+
+      for(int i = 0; i < count; i++)
+      {
+        unsigned char *p_base = static_cast<unsigned char *>(p_vector[i].iov_base);
+        p_output->memory.insert(p_output->memory.end(), p_base, p_base + p_vector[i].iov_len);
+        size += p_vector[i].iov_len;
+      }
+
+      return static_cast<ssize_t>(size);
+    }
+
+    case TmOutputCallback:
+      return p_output->p_write(p_output->p_context, p_vector, count);
+
+    default:
+      return writev(p_output->fd, p_vector, count);
+  }
+}
+
+static result_t FlushData(EPTMS_ENCODER_T *p_encoder)
+{
+  EPTMS_OUTPUT_T *p_output = &p_encoder->output;
+  struct iovec vector;
+  vector.iov_base = p_output->buffer;
+  vector.iov_len = p_output->length;
+  p_output->length = 0;
+  return WriteVector(p_encoder, &vector, 1);
+}
+
+// Writes to a non-blocking fd wait in poll(), where a cancel is seen at once.
+// Not done when the log shares the file, its messages must not be lost.
+static void InitOutput(EPTMS_ENCODER_T *p_encoder)
+{
+  EPTMS_OUTPUT_T *p_output = &p_encoder->output;
+  struct stat output;
+  struct stat log;
+
+  if(TmOutputDescriptor != p_output->sink)
+  {
+    return;
+  }
+
+  if((0 == fstat(p_output->fd, &output)) && (0 == fstat(fileno(p_encoder->p_log), &log))
+     && (output.st_dev == log.st_dev) && (output.st_ino == log.st_ino))
+  {
+    return;
+  }
+
+  int flags = fcntl(p_output->fd, F_GETFL);
+
+  if((0 <= flags) && (0 == (flags & O_NONBLOCK)) && (0 == fcntl(p_output->fd, F_SETFL, flags | O_NONBLOCK)))
+  {
+    p_output->flags = flags;
+  }
+}
+
+static void ExitOutput(EPTMS_ENCODER_T *p_encoder)
+{
+  EPTMS_OUTPUT_T *p_output = &p_encoder->output;
+
+  if(0 <= p_output->flags)
+  {
+    fcntl(p_output->fd, F_SETFL, p_output->flags);
+    p_output->flags = -1;
+  }
+}
+
+// Waits until fd accepts data, e.g. while the printer is out of paper. After
+// a cancel the command being written is given EPTMD_CANCEL_DRAIN_TIME to
+// complete, so that the printer is not left inside it. The timeout covers a
+// signal delivered to another thread or just before poll().
+static result_t WaitOutput(EPTMS_ENCODER_T *p_encoder)
+{
+  EPTMS_OUTPUT_T *p_output = &p_encoder->output;
+  struct pollfd output;
+  output.fd = p_output->fd;
+  output.events = POLLOUT;
+
+  while(true)
+  {
+    if((0 != p_encoder->canceled) && (EPTMD_CANCEL_DRAIN_TIME <= (GetMonotonicTime() - GetCancelTime(p_encoder))))
+    {
+      p_output->aborted = true;
+      return CANCEL;
+    }
+
+    double start_time = GetMonotonicTime();
+    int ready = poll(&output, 1, EPTMD_OUTPUT_POLL_TIMEOUT);
+    double waited = GetMonotonicTime() - start_time;
+    p_output->blockedTime += waited;
+    p_output->writeTime += waited;
+    p_output->waits++;
+
+    // The status tells why the printer does not take data.
+    if((0 == ready) && p_encoder->printer.enabled)
+    {
+      ReadPrinterStatus(p_encoder, 0.0);
+    }
+
+    // Errors and hang-ups are reported by the next write.
+    if(0 < ready)
+    {
+      return SUCCESS;
+    }
+
+    if((0 > ready) && (EINTR != errno))
+    {
+      return FAILED;
+    }
+  }
+}
+
+// Bands are only dropped between commands, so the printer is reset after
+// what has been printed is fed and cut as at the end of a job.
+static result_t WriteCancelSequence(EPTMS_ENCODER_T *p_encoder)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  EPTMS_OUTPUT_T *p_output = &p_encoder->output;
+  result_t result = SUCCESS;
+
+  if(p_output->aborted)
+  {
+    p_output->length = 0;
+    return CANCEL;
+  }
+
+  if(TmNoCut != p_config->cutControl)
+  {
+    unsigned char CommandCut[3 + 4] = { ESC, 'J', 0, GS, 'V', 66, 0 };
+    result = WriteData(p_encoder, CommandCut, sizeof(CommandCut));
+  }
+
+  if((SUCCESS == result) && p_encoder->printer.statusBack)
+  {
+    unsigned char CommandStatusBack[3] = { GS, 'a', 0x00 };
+    result = WriteData(p_encoder, CommandStatusBack, sizeof(CommandStatusBack));
+  }
+
+  if(SUCCESS == result)
+  {
+    unsigned char CommandInitialize[2] = { ESC, '@' };
+    result = WriteData(p_encoder, CommandInitialize, sizeof(CommandInitialize));
+  }
+
+  if(SUCCESS == result)
+  {
+    result = FlushData(p_encoder);
+  }
+
+  return result;
+}
+
+// Not started by CUPS, fd 3 may even be the raster file.
+static bool HasBackChannel(EPTMS_ENCODER_T *p_encoder)
+{
+  struct stat channel;
+  return p_encoder->backChannel && (0 == fstat(CUPS_BC_FD, &channel)) && (S_ISFIFO(channel.st_mode) || S_ISSOCK(channel.st_mode));
+}
+
+// With Automatic Status Back the printer sends its status whenever it
+// changes, the backend passes it on through the back-channel. Backends
+// without a back-channel never answer and the job runs without it, the
+// configuration stays as it is for the next job of the encoder.
+static result_t EnableStatusBack(EPTMS_ENCODER_T *p_encoder)
+{
+  EPTMS_CONFIG_T *p_config = &p_encoder->config;
+  EPTMS_PRINTER_T *p_printer = &p_encoder->printer;
+
+  if(TmFlowControlOff == p_config->flowControl)
+  {
+    return SUCCESS;
+  }
+
+  if(!HasBackChannel(p_encoder))
+  {
+    fprintf(p_encoder->p_log, "DEBUG: no back-channel, flow control disabled\n");
+    return SUCCESS;
+  }
+
+  // Online/offline, error and roll paper sensor status.
+  unsigned char Command[3] = { GS, 'a', 0x0e };
+  result_t result = WriteData(p_encoder, Command, sizeof(Command));
+  p_printer->statusBack = true;
+
+  if(SUCCESS == result)
+  {
+    result = FlushData(p_encoder);
+  }
+
+  if(SUCCESS != result)
+  {
+    return result;
+  }
+
+  // The printer answers at once.
+  double deadline = GetMonotonicTime() + EPTMD_STATUS_FIRST_TIMEOUT;
+  p_printer->enabled = true;
+
+  while(p_printer->enabled && (0 == p_printer->statuses) && (GetMonotonicTime() < deadline))
+  {
+    ReadPrinterStatus(p_encoder, deadline - GetMonotonicTime());
+  }
+
+  if(0 == p_printer->statuses)
+  {
+    fprintf(p_encoder->p_log, "DEBUG: no printer status, flow control disabled\n");
+    p_printer->enabled = false;
+  }
+
+  return SUCCESS;
+}
+
+// Reads the status received so far, waiting up to 'timeout' seconds for it.
+// A packet is 4 bytes, the first one matches 0xx1xx00 and the others 0xx0xxxx,
+// anything else on the back-channel is skipped.
+static void ReadPrinterStatus(EPTMS_ENCODER_T *p_encoder, double timeout)
+{
+  EPTMS_PRINTER_T *p_printer = &p_encoder->printer;
+  char buffer[64];
+  ssize_t received = cupsBackChannelRead(buffer, sizeof(buffer), timeout);
+
+  while(0 < received)
+  {
+    for(ssize_t i = 0; i < received; i++)
+    {
+      unsigned char data = static_cast<unsigned char>(buffer[i]);
+
+      if(0x10 == (data & 0x93))
+      {
+        p_printer->packet[0] = data;
+        p_printer->length = 1;
+        continue;
+      }
+
+      if((0 == p_printer->length) || (0 != (data & 0x90)))
+      {
+        p_printer->length = 0;
+        continue;
+      }
+
+      p_printer->packet[p_printer->length++] = data;
+
+      if(sizeof(p_printer->packet) > p_printer->length)
+      {
+        continue;
+      }
+
+      unsigned reasons = 0;
+      reasons |= (0 != (p_printer->packet[0] & 0x08)) ? EPTMD_REASON_BIT(TmReasonOffline) : 0;
+      reasons |= (0 != (p_printer->packet[0] & 0x20)) ? EPTMD_REASON_BIT(TmReasonCoverOpen) : 0;
+      reasons |= (0 != (p_printer->packet[1] & 0x68)) ? EPTMD_REASON_BIT(TmReasonError) : 0; // Autocutter, unrecoverable or auto-recoverable error.
+      reasons |= (0 != (p_printer->packet[2] & 0x03)) ? EPTMD_REASON_BIT(TmReasonMediaLow) : 0;
+      reasons |= (0 != (p_printer->packet[2] & 0x0c)) ? EPTMD_REASON_BIT(TmReasonMediaEmpty) : 0;
+      p_printer->length = 0;
+      p_printer->statuses++;
+      SetPrinterReasons(p_encoder, reasons);
+    }
+
+    received = cupsBackChannelRead(buffer, sizeof(buffer), 0.0);
+  }
+
+  // The backend closed the back-channel.
+  if(0 == received)
+  {
+    p_printer->enabled = false;
+  }
+}
+
+static void SetPrinterReasons(EPTMS_ENCODER_T *p_encoder, unsigned reasons)
+{
+  const char *p_keywords[TmReasonCount] = { "offline-report", "cover-open-error", "media-empty-error", "media-low-warning", "other-error" };
+  EPTMS_PRINTER_T *p_printer = &p_encoder->printer;
+  unsigned changed = reasons ^ p_printer->reasons;
+
+  for(unsigned reason = 0; reason < TmReasonCount; reason++)
+  {
+    if(0 != (changed & EPTMD_REASON_BIT(reason)))
+    {
+      fprintf(p_encoder->p_log, "STATE: %c%s\n", (0 != (reasons & EPTMD_REASON_BIT(reason))) ? '+' : '-', p_keywords[reason]);
+    }
+  }
+
+  p_printer->reasons = reasons;
+}
+
+// Holds the bands while the printer cannot print, they would only fill its
+// receive buffer. A low paper is reported but printed on, the roll still
+// lasts for some receipts.
+static result_t WaitPrinter(EPTMS_ENCODER_T *p_encoder)
+{
+  const unsigned paused = EPTMD_REASON_BIT(TmReasonOffline) | EPTMD_REASON_BIT(TmReasonCoverOpen)
+                          | EPTMD_REASON_BIT(TmReasonMediaEmpty) | EPTMD_REASON_BIT(TmReasonError);
+  EPTMS_PRINTER_T *p_printer = &p_encoder->printer;
+
+  if(!p_printer->enabled)
+  {
+    return SUCCESS;
+  }
+
+  ReadPrinterStatus(p_encoder, 0.0);
+
+  if(0 == (p_printer->reasons & paused))
+  {
+    return SUCCESS;
+  }
+
+  double start_time = GetMonotonicTime();
+  p_printer->pauses++;
+
+  while(p_printer->enabled && (0 != (p_printer->reasons & paused)))
+  {
+    if(0 != p_encoder->canceled)
+    {
+      p_printer->pausedTime += GetMonotonicTime() - start_time;
+      return CANCEL;
+    }
+
+    ReadPrinterStatus(p_encoder, EPTMD_STATUS_POLL_TIMEOUT);
+  }
+
+  p_printer->pausedTime += GetMonotonicTime() - start_time;
+  return SUCCESS;
+}
+
+static double GetCancelTime(EPTMS_ENCODER_T *p_encoder)
+{
+  return static_cast<double>(p_encoder->cancelTime.load()) / 1e9;
+}
+
+static double GetMonotonicTime(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + ((double)now.tv_nsec / 1e9);
+}
+
+static double StartPhase(EPTME_PHASE phase)
+{
+  EPTMD_PROBE1(phase_start, (int)phase);
+  return GetMonotonicTime();
+}
+
+// Adds the time since 'start_time' to the phase, returns the end time to
+// start the next phase without reading the clock again.
+static double EndPhase(EPTMS_ENCODER_T *p_encoder, EPTME_PHASE phase, double start_time)
+{
+  double end_time = GetMonotonicTime();
+  p_encoder->timing.time[phase] += end_time - start_time;
+  p_encoder->timing.calls[phase]++;
+  EPTMD_PROBE2(phase_end, (int)phase, (long long)((end_time - start_time) * 1e9));
+  return end_time;
+}
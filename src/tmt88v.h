@@ -0,0 +1,94 @@
+/******************************************************************************
+ *
+ * Epson TM-T88V Printer Driver for GNU/Linux
+ *
+ * Copyright (C) Seiko Epson Corporation 2019.
+ * Copyright (C) 2020 Grégory DAVID.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *****************************************************************************/
+#ifndef TMT88V_H
+#define TMT88V_H
+
+#include <cups/raster.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Raster to ESC/POS encoder of the TM-T88V, the engine of the rastertotmt88v
+// filter. An encoder holds the configuration, buffers and cancel state of one
+// job at a time, encoders used by different threads are independent.
+
+/*-----------------
+ * enum declaration
+ *-----------------*/
+// Results of the functions below. Other values are the error codes the
+// filter logs as "ERROR: Error Code=".
+typedef enum
+{
+  TM_SUCCESS = 0,
+  TM_FAILED = 1,
+  TM_CANCEL = 2,
+} EPTME_TM_RESULT_CODE; // Result Code
+
+/*--------------------------------
+ * Structure prototype declaration
+ *--------------------------------*/
+using tm_result_t = std::uint16_t;
+
+typedef struct EPTMS_ENCODER_S EPTMS_ENCODER_T; // Raster to ESC/POS encoder
+
+// Writes the commands like writev(), a short count is resumed with the rest
+// and -1 fails the job.
+typedef ssize_t (*EPTMS_WRITE_CALLBACK_T)(void *p_context, const struct iovec *p_vector, int count);
+
+/*-------------------------------
+ * Function prototype declaration
+ *-------------------------------*/
+// Returns nullptr if out of memory. User files and the graphics cache are
+// looked up with the printer name.
+EPTMS_ENCODER_T *TmCreateEncoder(const char *p_printerName);
+void TmDeleteEncoder(EPTMS_ENCODER_T *p_encoder);
+
+// Reads the configuration from the PPD file with the job options marked, as
+// given to a CUPS filter in argv[5].
+tm_result_t TmLoadEncoderConfig(EPTMS_ENCODER_T *p_encoder, const char *p_ppdPath, const char *p_jobOptions);
+
+// DEBUG:, STATE: and ATTR: messages of the filter, stderr by default.
+void TmSetEncoderLog(EPTMS_ENCODER_T *p_encoder, FILE *p_log);
+// Lets TmxFlowControl read the printer status from the CUPS back-channel.
+void TmSetEncoderBackChannel(EPTMS_ENCODER_T *p_encoder, bool enabled);
+
+// The commands go to a file descriptor (stdout by default), to memory or
+// to a callback. Memory output is kept until the next job starts.
+void TmSetEncoderOutputFd(EPTMS_ENCODER_T *p_encoder, int fd);
+void TmSetEncoderOutputMemory(EPTMS_ENCODER_T *p_encoder);
+void TmSetEncoderOutputCallback(EPTMS_ENCODER_T *p_encoder, EPTMS_WRITE_CALLBACK_T p_write, void *p_context);
+const unsigned char *TmGetEncoderOutput(EPTMS_ENCODER_T *p_encoder, std::size_t *p_size);
+
+// Encodes all pages of a raster as one job. The raster may come from any
+// source of cupsRasterOpenIO().
+tm_result_t TmEncodeRaster(EPTMS_ENCODER_T *p_encoder, cups_raster_t *p_raster);
+tm_result_t TmEncodeRasterFd(EPTMS_ENCODER_T *p_encoder, int fd);
+tm_result_t TmEncodeRasterMemory(EPTMS_ENCODER_T *p_encoder, const unsigned char *p_data, std::size_t size);
+
+// Stops the job being encoded, or the next one. Safe to call from a signal
+// handler or another thread. A canceled encoder stays canceled.
+void TmCancelEncoder(EPTMS_ENCODER_T *p_encoder);
+
+#endif // TMT88V_H
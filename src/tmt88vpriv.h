@@ -0,0 +1,124 @@
+/******************************************************************************
+ *
+ * Epson TM-T88V Printer Driver for GNU/Linux
+ *
+ * Copyright (C) Seiko Epson Corporation 2019.
+ * Copyright (C) 2020 Grégory DAVID.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *****************************************************************************/
+#ifndef TMT88VPRIV_H
+#define TMT88VPRIV_H
+
+#include "tmt88v.h"
+
+// Result codes of the rastertotmt88v filter and its encoder, not installed.
+
+/*-----------------
+ * enum declaration
+ *-----------------*/
+typedef enum
+{
+  SUCCESS = TM_SUCCESS,
+  FAILED = TM_FAILED,
+  CANCEL = TM_CANCEL,
+  // Error codes
+  E_INIT_ARGS = 1001,
+  E_INIT_FAILED_OPEN_RASTER_FILE = 1002,
+  E_INIT_FAILED_CUPS_RASTER_READ = 1003,
+  //
+  E_STARTJOB_FAILED_SET_DEVICE = 2101,
+  E_STARTJOB_FAILED_SET_PRINT_SHEET = 2102,
+  E_STARTJOB_FAILED_SET_CONFIG_SHEET = 2103,
+  E_STARTJOB_FAILED_SET_NEAREND_PRINT = 2104,
+  E_STARTJOB_FAILED_SET_BASE_MOTION_UNIT = 2105,
+  E_STARTJOB_FAILED_OPEN_DRAWER = 2106,
+  E_STARTJOB_FAILED_SOUND_BUZZER = 2107,
+  E_STARTJOB_FAILED_WRITE_USER_FILE = 2108,
+  E_STARTJOB_FAILED_SET_STATUS_BACK = 2109,
+  E_STARTJOB_FAILED_GRAPHICS_CACHE = 2110,
+  //
+  E_ENDJOB_FAILED_WRITE_USER_FILE = 2201,
+  E_ENDJOB_FAILED_CUT = 2202,
+  E_ENDJOB_FAILED_FLUSH = 2203,
+  E_ENDJOB_FAILED_SET_STATUS_BACK = 2204,
+  //
+  E_DOPAGE_FAILED_DATA_ALLOC = 3001,
+  //
+  E_STARTPAGE_FAILED_WRITE_USER_FILE = 3102,
+  //
+  E_ENDPAGE_FAILED_WRITE_USER_FILE = 3201,
+  E_ENDPAGE_FAILED_CUT = 3202,
+  E_ENDPAGE_FAILED_FLUSH = 3203,
+  //
+  E_REPLAYPAGE_FAILED_WRITE = 3601,
+  //
+  E_READRASTER_FAILED_DATA_ALLOC = 3301,
+  E_READRASTER_FAILED_READ_PIXELS = 3302,
+  //
+  E_WRITERASTER_FAILED_WRITE_BAND = 3403,
+  E_WRITERASTER_FAILED_WRITE_RASTER = 3404,
+  E_WRITERASTER_FAILED_FLUSH = 3405,
+  E_WRITERASTER_FAILED_FEED = 3406,
+  //
+  E_STREAMRASTER_FAILED_READ_PIXELS = 3502,
+  E_STREAMRASTER_FAILED_WRITE_BAND = 3503,
+  E_STREAMRASTER_FAILED_FLUSH = 3504,
+  E_STREAMRASTER_FAILED_FEED = 3505,
+  E_STREAMRASTER_FAILED_THREAD = 3506,
+  //
+  E_GETPARAMS_OPEN_PPD_FILE = 4001,
+  E_GETPARAMS_PPD_CONFLICTED_OPT = 4002,
+  //
+  E_GETMODELPPD_ATTR_HMOTION_NOTFIND = 4101,
+  E_GETMODELPPD_ATTR_HMOTION_OUT_OF_RANGE = 4102,
+  E_GETMODELPPD_ATTR_VMOTION_NOTFIND = 4103,
+  E_GETMODELPPD_ATTR_VMOTION_OUT_OF_RANGE = 4104,
+  //
+  E_GETPAPERREDUCPPD_ATTR_NOTFIND = 4201,
+  E_GETPAPERREDUCPPD_ATTR_OUT_OF_RANGE = 4202,
+  //
+  E_GETBUZZERDRAWERPPD_ATTR_NOTFIND = 4301,
+  E_GETBUZZERDRAWERPPD_ATTR_OUT_OF_RANGE = 4302,
+  //
+  E_GETPAPERCUTPPD_ATTR_NOTFIND = 4401,
+  E_GETPAPERCUTPPD_ATTR_OUT_OF_RANGE = 4402,
+  //
+  E_GETOUTPUTFLUSHPPD_ATTR_OUT_OF_RANGE = 4502,
+  //
+  E_GETSTREAMINGPPD_ATTR_OUT_OF_RANGE = 4602,
+  //
+  E_GETBLANKFEEDPPD_ATTR_OUT_OF_RANGE = 4702,
+  //
+  E_GETBANDHEIGHTPPD_ATTR_OUT_OF_RANGE = 4802,
+  //
+  E_GETGRAPHICSCACHEPPD_ATTR_OUT_OF_RANGE = 4902,
+  //
+  E_GETCOLUMNCROPPPD_ATTR_OUT_OF_RANGE = 5002,
+  //
+  E_GETDITHERINGPPD_ATTR_OUT_OF_RANGE = 5102,
+  //
+  E_GETCONTINUOUSROLLPPD_ATTR_OUT_OF_RANGE = 5202,
+  //
+  E_GETFLOWCONTROLPPD_ATTR_OUT_OF_RANGE = 5302,
+} EPTME_RESULT_CODE; // Result Code
+
+/*--------------------------------
+ * Structure prototype declaration
+ *--------------------------------*/
+using result_t = tm_result_t;
+
+#endif // TMT88VPRIV_H